@@ -4,190 +4,795 @@
 #include <string.h>
 #include <time.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include "ipc_wire.h"
 
 /* Define to avoid compiler complaints*/
 #ifndef DT_REG
 #define DT_REG 8
 #endif
 
+#define BACKUP_QUEUE_LEN 64
+#define URING_BACKUP_BATCH 256 // copies handed to the ring at a time
+#define MOVE_BATCH 64          // renames handed to the ring at a time
+
+/* A copy job handed from the directory scan to the worker pool */
+struct backup_job
+{
+    char name[256];
+};
+
+/* Bounded job queue shared by the scan and the workers of one backup run */
+struct backup_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct backup_job jobs[BACKUP_QUEUE_LEN];
+    int head;
+    int count;
+    int closed; // set once the scan has queued every file
+    int copy_failures;
+    int copied;
+    int unchanged; // skipped because the manifest says the backup is current
+    const char *src_dir;
+    const char *dst_dir;
+    const char *date; // date directory being backed up, for the catalog
+    struct manifest *manifest;
+    struct journal *journal;
+};
+
+/* State of the asynchronous run started by start_backup() */
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static int run_active = 0;
+static int run_finished = 0;
+static int run_status = BACKUP_SUCCESS;
+static int run_event_fd = -1;
+static int run_resume = 0; // the running backup finishes interrupted runs only
+
 /* Helper function to get the current date as "YYYY-MM-DD" */
 void get_date_string(char *buffer, size_t size)
 {
     time_t now = time(NULL);
-    struct tm *tm_now = localtime(&now);
+    struct tm tm_now;
+    localtime_r(&now, &tm_now); // called from the pipeline workers as well
     snprintf(buffer, size, "%04d-%02d-%02d",
-             tm_now->tm_year + 1900, tm_now->tm_mon + 1, tm_now->tm_mday);
+             tm_now.tm_year + 1900, tm_now.tm_mon + 1, tm_now.tm_mday);
 }
 
-void move_reports()
+/* Date of the reporting directory that reports uploaded now belong to: the
+   nightly backup files everything uploaded since the previous run under its
+   own date, so uploads after today's backup time go to tomorrow */
+void report_cycle_date(char *buffer, size_t size)
 {
-    char date_dir[MAX_PATH_BUFFER];
-    get_date_string(date_dir, sizeof(date_dir));
+    time_t now = time(NULL);
+    struct tm tm_now;
+    localtime_r(&now, &tm_now);
+    int backup_hour, backup_minute;
+    config_backup_time(&backup_hour, &backup_minute);
+    if (tm_now.tm_hour * 60 + tm_now.tm_min >= backup_hour * 60 + backup_minute)
+    {
+        tm_now.tm_mday++;
+        tm_now.tm_isdst = -1;
+        mktime(&tm_now); // normalise month/year rollover
+    }
+    snprintf(buffer, size, "%04d-%02d-%02d",
+             tm_now.tm_year + 1900, tm_now.tm_mon + 1, tm_now.tm_mday);
+}
 
-    /* Create a subdirectory under REPORT_DIR for today's reports */
-    char full_report_dir[MAX_PATH_BUFFER];
-    snprintf(full_report_dir, sizeof(full_report_dir), "%s/%s", REPORT_DIR, date_dir);
-    if (ensure_directory(full_report_dir) == -1)
+/* 1 if a report uploaded at `when` missed the missing-report deadline of
+   its cycle: it arrived between the configured deadline and the
+   nightly backup (uploads are accepted then, just flagged) */
+int report_is_late(time_t when)
+{
+    struct tm tm;
+    localtime_r(&when, &tm);
+    int minute = tm.tm_hour * 60 + tm.tm_min;
+    int hour, min;
+    config_deadline(&hour, &min);
+    int deadline = hour * 60 + min;
+    config_backup_time(&hour, &min);
+    int backup = hour * 60 + min;
+    if (deadline <= backup)
+        return minute >= deadline && minute < backup;
+    return minute >= deadline || minute < backup; // window spans midnight
+}
+
+/* Log and report the outcome of moving one report (err is 0 or an errno value) */
+static void report_moved(const char *name, const char *dst_path, const char *full_report_dir, int err)
+{
+    if (err == 0)
     {
-        log_message("ERROR", "Failed to create today's reporting directory");
-        return;
+        struct stat st;
+        int late = 0;
+        if (stat(dst_path, &st) == 0)
+        {
+            catalog_record(CATALOG_FILED, strrchr(full_report_dir, '/') + 1, name, st.st_size, 0);
+            late = report_is_late(st.st_mtime);
+        }
+
+        char msg[1024];
+        snprintf(msg, sizeof(msg), "Moved %sfile %s to reporting directory %s",
+                 late ? "late " : "", name, full_report_dir);
+        log_message("INFO", msg);
+
+        /* Report the move operation via POSIX IPC */
+        ipc_send(ipc_default(), "move_reports", 1, msg);
+    }
+    else
+    {
+        char msg[1024];
+        snprintf(msg, sizeof(msg), "Failed to move file %s: %s", name, strerror(err));
+        log_event("ERROR", "move_reports", msg);
+
+        ipc_send(ipc_default(), "move_reports", 0, msg);
     }
+}
 
-    DIR *dir = opendir(UPLOAD_DIR);
+/* Renames collected for the io_uring engine */
+struct move_batch
+{
+    struct uring *ring;
+    const char *full_report_dir;
+    int count;
+    char *src[MOVE_BATCH];
+    char *dst[MOVE_BATCH];
+};
+
+static void move_batch_flush(struct move_batch *b)
+{
+    int errors[MOVE_BATCH];
+    uring_rename_batch(b->ring, (const char *const *)b->src, (const char *const *)b->dst, b->count, errors);
+    for (int i = 0; i < b->count; i++)
+    {
+        if (errors[i] == -1) // the ring failed before getting to it
+            errors[i] = rename(b->src[i], b->dst[i]) == 0 ? 0 : errno;
+        report_moved(strrchr(b->dst[i], '/') + 1, b->dst[i], b->full_report_dir, errors[i]);
+        free(b->src[i]);
+        free(b->dst[i]);
+    }
+    b->count = 0;
+}
+
+/* Move every .xml report found in dir, and below it, into full_report_dir.
+   Department subdirectories are flattened: report names are per department.
+   With a batch the renames are queued on its ring instead of done inline. */
+static void move_reports_from(const char *upload_dir, const char *full_report_dir, struct move_batch *batch)
+{
+    DIR *dir = opendir(upload_dir);
     if (!dir)
     {
-        log_message("ERROR", "Failed to open upload directory for moving reports");
+        char err[MAX_PATH_BUFFER + 64];
+        snprintf(err, sizeof(err), "Failed to open upload directory %s for moving reports", upload_dir);
+        log_message("ERROR", err);
         return;
     }
 
     struct dirent *entry;
     while ((entry = readdir(dir)) != NULL)
     {
-        if (entry->d_type == DT_REG) // Only process regular files
+        if (entry->d_type == DT_DIR && entry->d_name[0] != '.')
+        {
+            char sub_dir[MAX_PATH_BUFFER];
+            snprintf(sub_dir, sizeof(sub_dir), "%s/%s", upload_dir, entry->d_name);
+            move_reports_from(sub_dir, full_report_dir, batch);
+        }
+        else if (entry->d_type == DT_REG) // Only process regular files
         {
             char *ext = strrchr(entry->d_name, '.');
             if (ext && strcmp(ext, ".xml") == 0)
             {
                 char src_path[MAX_PATH_BUFFER];
                 char dst_path[MAX_PATH_BUFFER];
-                snprintf(src_path, sizeof(src_path), "%s/%s", UPLOAD_DIR, entry->d_name);
+                snprintf(src_path, sizeof(src_path), "%s/%s", upload_dir, entry->d_name);
                 snprintf(dst_path, sizeof(dst_path), "%s/%s", full_report_dir, entry->d_name);
 
-                if (rename(src_path, dst_path) == 0)
-                {
-                    char msg[1024];
-                    snprintf(msg, sizeof(msg), "Moved file %s to reporting directory %s", entry->d_name, full_report_dir);
-                    log_message("INFO", msg);
-
-                    /* Report the move operation via POSIX IPC */
-                    mqd_t mq = mq_open(MQ_NAME, O_RDWR);
-                    if (mq != (mqd_t)-1)
-                    {
-                        send_task_msg(mq, "move_reports", 1, msg);
-                        mq_close(mq);
-                    }
-                }
-                else
+                if (report_rejected(src_path))
+                    continue; // malformed: quarantined instead of filed
+
+                if (batch && (batch->src[batch->count] = strdup(src_path)) != NULL &&
+                    (batch->dst[batch->count] = strdup(dst_path)) != NULL)
                 {
-                    char err[1024];
-                    snprintf(err, sizeof(err), "Failed to move file %s: %s", entry->d_name, strerror(errno));
-                    log_message("ERROR", err);
-
-                    mqd_t mq = mq_open(MQ_NAME, O_RDWR);
-                    if (mq != (mqd_t)-1)
-                    {
-                        send_task_msg(mq, "move_reports", 0, err);
-                        mq_close(mq);
-                    }
+                    if (++batch->count == MOVE_BATCH)
+                        move_batch_flush(batch);
+                    continue;
                 }
+                if (batch)
+                    free(batch->src[batch->count]);
+                report_moved(entry->d_name, dst_path, full_report_dir, rename(src_path, dst_path) == 0 ? 0 : errno);
             }
         }
     }
     closedir(dir);
 }
 
-void perform_backup()
+void move_reports()
 {
-    log_message("LOG", "Starting backup process...");
-
-    /* First, move new reports */
-    move_reports();
-
-    /* Not checking for missing reports: that was already done earlier,
-    we only care about backing up what exists and we are showing what is backed up anyway. */
     char date_dir[MAX_PATH_BUFFER];
     get_date_string(date_dir, sizeof(date_dir));
 
+    /* Create a subdirectory under REPORT_DIR for today's reports */
+    char full_report_dir[MAX_PATH_BUFFER];
+    snprintf(full_report_dir, sizeof(full_report_dir), "%s/%s", REPORT_DIR, date_dir);
+    if (ensure_directory(full_report_dir) == -1)
+    {
+        log_message("ERROR", "Failed to create today's reporting directory");
+        return;
+    }
+
+    struct move_batch batch = {.full_report_dir = full_report_dir};
+    batch.ring = uring_create(uring_depth());
+
+    const char *roots[MAX_UPLOAD_ROOTS];
+    int root_count = upload_roots(roots, MAX_UPLOAD_ROOTS);
+    for (int i = 0; i < root_count; i++)
+        move_reports_from(roots[i], full_report_dir, batch.ring ? &batch : NULL);
+
+    if (batch.ring)
+    {
+        move_batch_flush(&batch);
+        uring_log_stats(batch.ring, "move");
+        uring_destroy(batch.ring);
+    }
+}
+
+/* Number of backup worker threads: BACKUP_WORKERS, overridable at runtime,
+   defaulting to the number of online CPUs */
+static int backup_worker_count()
+{
+    long workers = env_long("REPORT_DAEMON_BACKUP_WORKERS", BACKUP_WORKERS);
+    if (workers <= 0)
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0)
+        workers = 1;
+    if (workers > BACKUP_MAX_WORKERS)
+        workers = BACKUP_MAX_WORKERS;
+    return (int)workers;
+}
+
+/* Incremental backup: a cheap stat comparison against the manifest.
+   Returns 1 if name has to be copied; st is filled when the stat worked. */
+static int backup_needed(struct backup_pool *pool, const char *name, struct stat *st, int *have_stat)
+{
+    char src_file[MAX_PATH_BUFFER];
+    snprintf(src_file, sizeof(src_file), "%s/%s", pool->src_dir, name);
+    *have_stat = stat(src_file, st) == 0;
+    if (*have_stat && pool->manifest && manifest_is_current(pool->manifest, name, st))
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->unchanged++;
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+    return 1;
+}
+
+/* Record a finished copy: manifest, catalog, counters and the log line */
+static void backup_copied(struct backup_pool *pool, const char *name, const struct stat *st,
+                          const uint64_t *hash, const char *how)
+{
+    if (st && hash && pool->manifest)
+        manifest_update(pool->manifest, name, st, *hash);
+    if (st && hash)
+        journal_record(pool->journal, name, st, *hash);
+    if (st)
+        catalog_record(CATALOG_BACKED_UP, pool->date, name, st->st_size, hash ? *hash : 0);
+
+    char src_file[MAX_PATH_BUFFER];
+    char dst_file[MAX_PATH_BUFFER];
+    snprintf(src_file, sizeof(src_file), "%s/%s", pool->src_dir, name);
+    snprintf(dst_file, sizeof(dst_file), "%s/%s", pool->dst_dir, name);
+    throttle_drop_cache(src_file, dst_file);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->copied++;
+    pthread_mutex_unlock(&pool->lock);
+
+    char msg[1024];
+    snprintf(msg, sizeof(msg), "Backed up file %s successfully (%s)", name, how);
+    log_event("INFO", "copy_file", msg);
+    struct ipc_event ev = {.task = "copy_file", .result = 1, .message = msg, .file = name};
+    if (st)
+    {
+        ev.size = st->st_size;
+        ev.has |= IPC_HAS_SIZE;
+    }
+    ipc_send_event(ipc_default(), &ev);
+}
+
+/* Log and report a file that could not be backed up (error: errno value or 0) */
+static void backup_copy_failed(struct backup_pool *pool, const char *name, int error)
+{
+    char err[1024];
+    snprintf(err, sizeof(err), "Failed to back up file %s", name);
+    log_event("ERROR", "copy_file", err);
+    struct ipc_event ev = {.task = "copy_file", .message = err, .file = name, .error = error};
+    if (error)
+        ev.has |= IPC_HAS_ERROR;
+    ipc_send_event(ipc_default(), &ev);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->copy_failures++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Publish a finished copy under its real name; a crash before this leaves
+   only a ".<name>.part" file, never a truncated copy that looks complete */
+static int publish_copy(const char *tmp_file, const char *dst_file)
+{
+    if (rename(tmp_file, dst_file) == 0)
+        return 0;
+    char err[MAX_PATH_BUFFER + 64];
+    snprintf(err, sizeof(err), "Failed to publish backup copy %s: %s", dst_file, strerror(errno));
+    log_message("ERROR", err);
+    unlink(tmp_file);
+    return -1;
+}
+
+static void backup_paths(struct backup_pool *pool, const char *name, char *src_file, char *tmp_file, char *dst_file)
+{
+    snprintf(src_file, MAX_PATH_BUFFER, "%s/%s", pool->src_dir, name);
+    snprintf(tmp_file, MAX_PATH_BUFFER, "%s/.%s.part", pool->dst_dir, name);
+    snprintf(dst_file, MAX_PATH_BUFFER, "%s/%s", pool->dst_dir, name);
+}
+
+/* Hash the finished copy for the manifest, with the stat of that same file:
+   the source may change (or shrink) after the copy, the copy does not */
+static int hash_copy(const char *tmp_file, struct stat *st, uint64_t *hash)
+{
+    int fd = open(tmp_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int rc = fstat(fd, st) == 0 && hash_fd(fd, hash) == 0 ? 0 : -1;
+    close(fd);
+    return rc;
+}
+
+/* Copy name with the regular copy engine, then hash the copy for the manifest */
+static void backup_copy(struct backup_pool *pool, const char *name, const struct stat *st)
+{
+    char src_file[MAX_PATH_BUFFER];
+    char tmp_file[MAX_PATH_BUFFER];
+    char dst_file[MAX_PATH_BUFFER];
+    backup_paths(pool, name, src_file, tmp_file, dst_file);
+
+    int strategy;
+    if (copy_file_ex(src_file, tmp_file, &strategy) == 0)
+    {
+        // The copy keeps the source's size and mtime, so its stat serves the manifest
+        struct stat copy_st;
+        uint64_t hash;
+        int hashed = st && hash_copy(tmp_file, &copy_st, &hash) == 0;
+        if (publish_copy(tmp_file, dst_file) == 0)
+            backup_copied(pool, name, hashed ? &copy_st : st, hashed ? &hash : NULL, copy_strategy_name(strategy));
+        else
+            backup_copy_failed(pool, name, errno);
+    }
+    else
+    {
+        int error = errno;
+        unlink(tmp_file);
+        backup_copy_failed(pool, name, error);
+    }
+}
+
+/* Copy a single file from the pool's source to its destination directory */
+static void backup_one(struct backup_pool *pool, const char *name)
+{
+    struct stat st;
+    int have_stat;
+    if (backup_needed(pool, name, &st, &have_stat))
+        backup_copy(pool, name, have_stat ? &st : NULL);
+}
+
+/* Files queued on the io_uring engine by one backup run */
+struct uring_backup
+{
+    struct uring *ring;
+    int count;
+    struct uring_copy jobs[URING_BACKUP_BATCH];
+    struct stat st[URING_BACKUP_BATCH];
+    char src[URING_BACKUP_BATCH][MAX_PATH_BUFFER];
+    char tmp[URING_BACKUP_BATCH][MAX_PATH_BUFFER];
+    char dst[URING_BACKUP_BATCH][MAX_PATH_BUFFER];
+};
+
+/* Run the queued copies on the ring; the ones it could not do go through the copy engine */
+static void uring_backup_flush(struct backup_pool *pool, struct uring_backup *b)
+{
+    uring_copy_batch(b->ring, b->jobs, b->count);
+    for (int i = 0; i < b->count; i++)
+    {
+        const char *name = strrchr(b->src[i], '/') + 1;
+        if (b->jobs[i].error == 0 && publish_copy(b->tmp[i], b->dst[i]) == 0)
+            backup_copied(pool, name, &b->st[i], &b->jobs[i].hash, "io_uring");
+        else
+            backup_copy(pool, name, &b->st[i]);
+    }
+    b->count = 0;
+}
+
+static void uring_backup_add(struct backup_pool *pool, struct uring_backup *b, const char *name)
+{
+    struct stat st;
+    int have_stat;
+    if (!backup_needed(pool, name, &st, &have_stat))
+        return;
+    if (!have_stat)
+    {
+        backup_copy(pool, name, NULL); // let the copy engine report what is wrong
+        return;
+    }
+
+    int i = b->count++;
+    backup_paths(pool, name, b->src[i], b->tmp[i], b->dst[i]);
+    b->st[i] = st;
+    b->jobs[i] = (struct uring_copy){
+        .src = b->src[i],
+        .dst = b->tmp[i],
+        .size = st.st_size,
+        .mode = st.st_mode,
+        .atime = st.st_atim,
+        .mtime = st.st_mtim,
+    };
+    if (b->count == URING_BACKUP_BATCH)
+        uring_backup_flush(pool, b);
+}
+
+static void *backup_worker(void *arg)
+{
+    struct backup_pool *pool = arg;
+    struct backup_job job;
+    throttle_enter();
+
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->closed)
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        if (pool->count == 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % BACKUP_QUEUE_LEN;
+        pool->count--;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        backup_one(pool, job.name);
+    }
+    return NULL;
+}
+
+/* Queue a copy job, waiting while all slots are taken */
+static void backup_enqueue(struct backup_pool *pool, const char *name)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == BACKUP_QUEUE_LEN)
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    struct backup_job *job = &pool->jobs[(pool->head + pool->count) % BACKUP_QUEUE_LEN];
+    strncpy(job->name, name, sizeof(job->name) - 1);
+    job->name[sizeof(job->name) - 1] = '\0';
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Back up src_dir (REPORT_DIR/<date_dir> or a snapshot of it) into BACKUP_DIR/<date_dir> */
+static int backup_reports_of(const char *src_dir, const char *date_dir)
+{
     /* Create a subdirectory in the backup directory for today's backup */
     char backup_date_dir[MAX_PATH_BUFFER];
     snprintf(backup_date_dir, sizeof(backup_date_dir), "%s/%s", BACKUP_DIR, date_dir);
     if (ensure_directory(backup_date_dir) == -1)
     {
-        log_message("ERROR", "Backup directory creation failed for today's date");
-        mqd_t mq = mq_open(MQ_NAME, O_RDWR);
-        if (mq != (mqd_t)-1)
-        {
-            send_task_msg(mq, "backup", 0, "Backup directory creation failed");
-            mq_close(mq);
-        }
-        return;
+        log_event("ERROR", "backup", "Backup directory creation failed for today's date");
+        ipc_send(ipc_default(), "backup", 0, "Backup directory creation failed");
+        return BACKUP_FAILURE;
     }
 
-    /* Source directory: today's reporting folder */
-    char current_report_dir[MAX_PATH_BUFFER];
-    snprintf(current_report_dir, sizeof(current_report_dir), "%s/%s", REPORT_DIR, date_dir);
-
-    DIR *dir = opendir(current_report_dir);
+    DIR *dir = opendir(src_dir);
     if (!dir)
     {
-        log_message("ERROR", "Failed to open today's reporting directory for backup");
-        mqd_t mq = mq_open(MQ_NAME, O_RDWR);
-        if (mq != (mqd_t)-1)
-        {
-            send_task_msg(mq, "backup", 0, "Unable to open reporting directory for backup");
-            mq_close(mq);
-        }
-        return;
+        log_event("ERROR", "backup", "Failed to open today's reporting directory for backup");
+        ipc_send(ipc_default(), "backup", 0, "Unable to open reporting directory for backup");
+        return BACKUP_FAILURE;
+    }
+
+    struct backup_pool pool = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .not_empty = PTHREAD_COND_INITIALIZER,
+        .not_full = PTHREAD_COND_INITIALIZER,
+        .src_dir = src_dir,
+        .dst_dir = backup_date_dir,
+        .date = date_dir,
+        .manifest = manifest_load(backup_date_dir),
+    };
+    pool.journal = journal_open(backup_date_dir, pool.manifest); // replays an interrupted run
+
+    /* Pace this thread and the workers (bandwidth, I/O priority, page cache) */
+    throttle_begin();
+    throttle_enter();
+    struct timespec started_at;
+    clock_gettime(CLOCK_MONOTONIC, &started_at);
+    ipc_hold(ipc_default()); // one message per batch of copy_file events, not per file
+
+    /* With the io_uring engine one thread keeps many copies in flight */
+    struct uring_backup *ub = NULL;
+    int depth = uring_depth();
+    if (depth > 0 && (ub = calloc(1, sizeof(*ub))) != NULL && (ub->ring = uring_create(depth)) == NULL)
+    {
+        free(ub);
+        ub = NULL;
     }
 
-    int copy_failures = 0;
+    /* Otherwise start the workers, then feed them from the directory scan */
+    pthread_t workers[BACKUP_MAX_WORKERS];
+    int wanted = ub ? 0 : backup_worker_count();
+    int started = 0;
+    while (started < wanted && pthread_create(&workers[started], NULL, backup_worker, &pool) == 0)
+        started++;
+
+    char msg[128];
+    if (ub)
+        snprintf(msg, sizeof(msg), "Backing up with io_uring, %d files in flight", depth);
+    else
+        snprintf(msg, sizeof(msg), "Backing up with %d worker thread(s)", started);
+    log_message("INFO", msg);
+
     struct dirent *entry;
     while ((entry = readdir(dir)) != NULL)
     {
-        if (entry->d_type == DT_REG)
+        // Dot files are in-flight ".<name>.part" copies, not reports
+        if (entry->d_type == DT_REG && entry->d_name[0] != '.')
         {
-            char src_file[MAX_PATH_BUFFER];
-            char dst_file[MAX_PATH_BUFFER];
-            snprintf(src_file, sizeof(src_file), "%s/%s", current_report_dir, entry->d_name);
-            snprintf(dst_file, sizeof(dst_file), "%s/%s", backup_date_dir, entry->d_name);
-
-            if (copy_file(src_file, dst_file) == 0)
-            {
-                char msg[1024];
-                snprintf(msg, sizeof(msg), "Backed up file %s successfully", entry->d_name);
-                log_message("INFO", msg);
-                mqd_t mq = mq_open(MQ_NAME, O_RDWR);
-                if (mq != (mqd_t)-1)
-                {
-                    send_task_msg(mq, "copy_file", 1, msg);
-                    mq_close(mq);
-                }
-            }
+            if (ub)
+                uring_backup_add(&pool, ub, entry->d_name);
+            else if (started > 0)
+                backup_enqueue(&pool, entry->d_name);
             else
-            {
-                char err[1024];
-                snprintf(err, sizeof(err), "Failed to back up file %s", entry->d_name);
-                log_message("ERROR", err);
-                mqd_t mq = mq_open(MQ_NAME, O_RDWR);
-                if (mq != (mqd_t)-1)
-                {
-                    send_task_msg(mq, "copy_file", 0, err);
-                    mq_close(mq);
-                }
-                copy_failures++;
-            }
+                backup_one(&pool, entry->d_name); // no threads available: copy inline
         }
     }
     closedir(dir);
 
-    if (copy_failures == 0)
+    if (ub)
+    {
+        uring_backup_flush(&pool, ub);
+        uring_log_stats(ub->ring, "backup");
+        uring_destroy(ub->ring);
+        free(ub);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.closed = 1;
+    pthread_cond_broadcast(&pool.not_empty);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    throttle_end(date_dir);
+    ipc_release(ipc_default());
+
+    /* Once the manifest holds the run the journal is no longer needed */
+    int saved = pool.manifest ? manifest_save(pool.manifest) : 0;
+    journal_close(pool.journal, saved == 0);
+    if (pool.manifest)
+        manifest_free(pool.manifest);
+
+    char summary[128];
+    snprintf(summary, sizeof(summary), "%d copied, %d unchanged, %d failed",
+             pool.copied, pool.unchanged, pool.copy_failures);
+    log_message("INFO", summary);
+
+    struct timespec finished_at;
+    clock_gettime(CLOCK_MONOTONIC, &finished_at);
+    struct ipc_event ev = {.task = "backup", .has = IPC_HAS_DURATION};
+    ev.duration_ms = (finished_at.tv_sec - started_at.tv_sec) * 1000 +
+                     (finished_at.tv_nsec - started_at.tv_nsec) / 1000000;
+    if (pool.copy_failures == 0)
     {
         log_message("LOG", "Backup process completed successfully");
-        mqd_t mq = mq_open(MQ_NAME, O_RDWR);
-        if (mq != (mqd_t)-1)
-        {
-            send_task_msg(mq, "backup", 1, "Backup completed successfully");
-            mq_close(mq);
-        }
+        char done[160];
+        snprintf(done, sizeof(done), "Backup completed successfully (%s)", summary);
+        ev.result = 1;
+        ev.message = done;
+        ipc_send_event(ipc_default(), &ev);
+        return BACKUP_SUCCESS;
     }
     else
     {
-        log_message("ERROR", "Backup process encountered errors");
-        mqd_t mq = mq_open(MQ_NAME, O_RDWR);
-        if (mq != (mqd_t)-1)
-        {
-            send_task_msg(mq, "backup", 0, "Backup completed with errors");
-            mq_close(mq);
-        }
+        log_event("ERROR", "backup", "Backup process encountered errors");
+        ev.message = "Backup completed with errors";
+        ipc_send_event(ipc_default(), &ev);
+        return BACKUP_FAILURE;
     }
-}
\ No newline at end of file
+}
+
+/* Back up the reports filed under date_dir. Without snapshots the caller
+   holds the directory lock for the whole run; with them the directory is
+   frozen by snapshot_take() under a lock held only for the links and the
+   copy runs from the snapshot while uploads continue. */
+static int backup_date(const char *date_dir)
+{
+    char live_dir[MAX_PATH_BUFFER];
+    snprintf(live_dir, sizeof(live_dir), "%s/%s", REPORT_DIR, date_dir);
+    if (!snapshot_enabled())
+        return backup_reports_of(live_dir, date_dir);
+
+    char snap_dir[MAX_PATH_BUFFER];
+    snprintf(snap_dir, sizeof(snap_dir), "%s/%s/%s", REPORT_DIR, SNAPSHOT_SUBDIR, date_dir);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    lock_directories();
+    int count = snapshot_take(live_dir, snap_dir);
+    unlock_directories();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (count == -1)
+    {
+        log_event("WARNING", "snapshot", "Snapshot failed, backing up the live reporting directory with uploads locked");
+        ipc_send(ipc_default(), "snapshot", 0, "Snapshot failed, falling back to a locked backup");
+        lock_directories();
+        int status = backup_reports_of(live_dir, date_dir);
+        unlock_directories();
+        return status;
+    }
+
+    long us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Snapshot of %d reports for %s taken, uploads locked for %ld.%03ld ms",
+             count, date_dir, us / 1000, us % 1000);
+    log_event("INFO", "snapshot", msg);
+    ipc_send(ipc_default(), "snapshot", 1, msg);
+
+    int status = backup_reports_of(snap_dir, date_dir);
+    snapshot_release(snap_dir);
+    return status;
+}
+
+int perform_backup()
+{
+    log_message("LOG", "Starting backup process...");
+
+    /* First, move new reports (with streaming ingest only stragglers are left) */
+    move_reports();
+
+    /* Not checking for missing reports: that was already done earlier,
+    we only care about backing up what exists and we are showing what is backed up anyway. */
+    char date_dir[MAX_PATH_BUFFER];
+    get_date_string(date_dir, sizeof(date_dir));
+    int status = backup_date(date_dir);
+
+    /* Streaming ingest may already have filed reports for the next nightly run
+       (e.g. for a manual backup during the day): back those up as well */
+    char cycle_dir[MAX_PATH_BUFFER];
+    char cycle_path[MAX_PATH_BUFFER];
+    report_cycle_date(cycle_dir, sizeof(cycle_dir));
+    snprintf(cycle_path, sizeof(cycle_path), "%s/%s", REPORT_DIR, cycle_dir);
+    if (status == BACKUP_SUCCESS && ingest_enabled() && strcmp(cycle_dir, date_dir) != 0 &&
+        access(cycle_path, F_OK) == 0)
+        status = backup_date(cycle_dir);
+
+    /* Fold tonight's catalog records into the sorted index */
+    if (catalog_rebuild() == -1)
+        log_message("ERROR", "Failed to rebuild the report catalog index");
+    return status;
+}
+
+/* Finish the backups whose journal says they were interrupted */
+int resume_backups()
+{
+    char dates[BACKUP_RESUME_MAX][16];
+    int count = journal_pending(dates, BACKUP_RESUME_MAX);
+    int status = BACKUP_SUCCESS;
+    for (int i = 0; i < count; i++)
+    {
+        if (backup_date(dates[i]) != BACKUP_SUCCESS)
+            status = BACKUP_FAILURE;
+    }
+    if (count > 0 && catalog_rebuild() == -1)
+        log_message("ERROR", "Failed to rebuild the report catalog index");
+    return status;
+}
+
+static void *backup_thread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&run_lock);
+    int resume = run_resume;
+    pthread_mutex_unlock(&run_lock);
+    int status = resume ? resume_backups() : perform_backup();
+
+    pthread_mutex_lock(&run_lock);
+    run_status = status;
+    run_active = 0;
+    run_finished = 1;
+    if (run_event_fd != -1)
+    {
+        uint64_t one = 1;
+        if (write(run_event_fd, &one, sizeof(one)) == -1)
+            log_message("ERROR", "Failed to signal backup completion");
+    }
+    pthread_mutex_unlock(&run_lock);
+    return NULL;
+}
+
+/* eventfd the main loop polls to learn that a background backup finished */
+int backup_event_fd()
+{
+    pthread_mutex_lock(&run_lock);
+    if (run_event_fd == -1)
+        run_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    int fd = run_event_fd;
+    pthread_mutex_unlock(&run_lock);
+    return fd;
+}
+
+/* Run perform_backup() (or resume_backups() when resume is set) on a
+   background thread so the main loop stays responsive */
+static int start_run(int resume)
+{
+    pthread_mutex_lock(&run_lock);
+    if (run_active)
+    {
+        pthread_mutex_unlock(&run_lock);
+        return -1;
+    }
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    run_resume = resume;
+    if (pthread_create(&thread, &attr, backup_thread, NULL) != 0)
+    {
+        pthread_attr_destroy(&attr);
+        pthread_mutex_unlock(&run_lock);
+        log_message("ERROR", "Failed to start backup thread");
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+    run_active = 1;
+    run_finished = 0;
+    pthread_mutex_unlock(&run_lock);
+    return 0;
+}
+
+int start_backup()
+{
+    return start_run(0);
+}
+
+int start_resume()
+{
+    return start_run(1);
+}
+
+/* Returns 1 while a backup started by start_backup() is still running */
+int backup_in_progress()
+{
+    pthread_mutex_lock(&run_lock);
+    int active = run_active;
+    pthread_mutex_unlock(&run_lock);
+    return active;
+}
+
+/* Returns 1 exactly once after a background backup finishes, with its status */
+int backup_poll(int *status)
+{
+    pthread_mutex_lock(&run_lock);
+    int finished = run_finished;
+    if (finished)
+    {
+        run_finished = 0;
+        if (status)
+            *status = run_status;
+    }
+    pthread_mutex_unlock(&run_lock);
+    return finished;
+}
@@ -0,0 +1,587 @@
+/* binlog.c – Compact binary log segments (REPORT_DAEMON_LOG_FORMAT=binary)
+ *
+ * Instead of appending text lines to LOG_FILE, the logger's flusher hands
+ * its batches to binlog_write(), which appends fixed-header records to
+ * segment files in LOG_SEGMENT_DIR:
+ *
+ *   offset 0                  struct segment_header
+ *   BINLOG_STRINGS_OFFSET     string table: level and event names, interned
+ *                             per segment so every segment decodes on its own
+ *   BINLOG_INDEX_OFFSET       sparse index, one entry per BINLOG_INDEX_STRIDE
+ *                             bytes of records: first wall time, offset and a
+ *                             mask of the string ids used in that block
+ *   data_start                records: struct binlog_record + text, 8-byte aligned
+ *
+ * A segment is preallocated with fallocate() when it is opened and trimmed
+ * to its used length when it is closed. The writer moves on to a new
+ * segment when the current one is full, older than the rotation interval,
+ * or on SIGHUP, and removes the oldest segments beyond the retention count.
+ * A record of length 0 ends a segment, so a crash leaves nothing a reader
+ * could mistake for records.
+ *
+ * "report_daemon log-dump" skips whole segments by their time range, finds
+ * the first block of the range by binary search in the index and skips the
+ * blocks whose mask lacks the requested type.
+ */
+
+#define _GNU_SOURCE
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define BINLOG_MAGIC 0x534c4452u // "RDLS"
+#define BINLOG_VERSION 1
+#define BINLOG_STRINGS 256 // per segment; id 0 is ""
+#define BINLOG_STRING_MAX 32
+#define BINLOG_INDEX_STRIDE (64 * 1024)
+#define BINLOG_STRINGS_OFFSET 4096
+#define BINLOG_INDEX_OFFSET (BINLOG_STRINGS_OFFSET + BINLOG_STRINGS * BINLOG_STRING_MAX)
+#define BINLOG_MAX_SEGMENTS 4096
+#define BINLOG_BATCH (256 * 1024) // records written with one pwrite()
+
+struct segment_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t seq;
+    uint64_t size;       // preallocated length of the file
+    uint64_t data_start; // offset of the first record
+    uint64_t used;       // bytes of records
+    int64_t first_wall_ns;
+    int64_t last_wall_ns;
+    uint32_t index_slots;
+    uint32_t index_count;
+    uint32_t string_count;
+    uint32_t records;
+};
+
+struct index_entry
+{
+    int64_t wall_ns;
+    uint64_t offset; // from data_start
+    uint64_t mask;   // bit (id % 64) of every level and event id in the block
+};
+
+/* On disk; the text follows, the record is padded to 8 bytes */
+struct binlog_record
+{
+    uint32_t length; // header + text + padding, 0 = end of segment
+    uint16_t level;  // string ids
+    uint16_t event;
+    uint32_t pid;
+    uint16_t text_len;
+    uint16_t reserved;
+    int64_t wall_ns; // CLOCK_REALTIME
+    int64_t mono_ns; // CLOCK_MONOTONIC
+};
+
+/* In the logger's ring: same header with the names inline instead of ids */
+struct binlog_pending
+{
+    uint32_t length;
+    uint8_t level_len;
+    uint8_t event_len;
+    uint16_t text_len;
+    uint32_t pid;
+    uint32_t reserved;
+    int64_t wall_ns;
+    int64_t mono_ns;
+};
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+static struct
+{
+    pthread_mutex_t lock;
+    int fd;
+    struct segment_header hdr;
+    char strings[BINLOG_STRINGS][BINLOG_STRING_MAX];
+    struct index_entry *index;
+    int strings_dirty;
+    uint32_t index_written;
+    struct timespec opened; // CLOCK_MONOTONIC
+    char *buf;              // records of the batch being written
+    size_t buf_used;
+    uint64_t buf_offset; // data offset of buf[0]
+} writer = {.lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1};
+
+static int64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int binlog_enabled()
+{
+    static int enabled = -1;
+    if (enabled == -1)
+    {
+        const char *format = config_get("REPORT_DAEMON_LOG_FORMAT");
+        enabled = format && strcmp(format, "binary") == 0;
+    }
+    return enabled;
+}
+
+static uint64_t segment_size()
+{
+    long mb = env_long("REPORT_DAEMON_LOG_SEGMENT_MB", LOG_SEGMENT_MB);
+    if (mb < 1)
+        mb = LOG_SEGMENT_MB;
+    return (uint64_t)mb * 1024 * 1024;
+}
+
+size_t binlog_encode(char *buf, size_t size, const char *level, const char *event, const char *text)
+{
+    size_t level_len = strnlen(level, BINLOG_STRING_MAX - 1);
+    size_t event_len = event ? strnlen(event, BINLOG_STRING_MAX - 1) : 0;
+    size_t text_len = strlen(text);
+    if (text_len > UINT16_MAX)
+        text_len = UINT16_MAX;
+    if (ALIGN8(sizeof(struct binlog_pending) + level_len + event_len + text_len) > size)
+        text_len = size - sizeof(struct binlog_pending) - level_len - event_len - 8; // cut oversized messages
+    struct binlog_pending p = {0};
+    p.length = ALIGN8(sizeof(p) + level_len + event_len + text_len);
+    p.level_len = level_len;
+    p.event_len = event_len;
+    p.text_len = text_len;
+    p.pid = getpid();
+    p.wall_ns = clock_ns(CLOCK_REALTIME);
+    p.mono_ns = clock_ns(CLOCK_MONOTONIC);
+    memcpy(buf, &p, sizeof(p));
+    char *out = buf + sizeof(p);
+    memcpy(out, level, level_len);
+    memcpy(out + level_len, event, event_len);
+    memcpy(out + level_len + event_len, text, text_len);
+    memset(out + level_len + event_len + text_len, 0, p.length - sizeof(p) - level_len - event_len - text_len);
+    return p.length;
+}
+
+/* Write out the batch buffer and the segment metadata. Caller holds writer.lock. */
+static void segment_sync()
+{
+    if (writer.fd == -1)
+        return;
+    if (writer.buf_used > 0 &&
+        pwrite(writer.fd, writer.buf, writer.buf_used, writer.hdr.data_start + writer.buf_offset) != (ssize_t)writer.buf_used)
+        fprintf(stderr, "Error writing to log segment: %s\n", strerror(errno));
+    writer.buf_offset += writer.buf_used;
+    writer.buf_used = 0;
+    if (writer.strings_dirty)
+    {
+        pwrite(writer.fd, writer.strings, sizeof(writer.strings), BINLOG_STRINGS_OFFSET);
+        writer.strings_dirty = 0;
+    }
+    if (writer.index_written < writer.hdr.index_count)
+    {
+        // The last entry's mask may still grow, so it is rewritten with the next batch
+        uint32_t first = writer.index_written > 0 ? writer.index_written - 1 : 0;
+        pwrite(writer.fd, &writer.index[first], (writer.hdr.index_count - first) * sizeof(struct index_entry),
+               BINLOG_INDEX_OFFSET + first * sizeof(struct index_entry));
+        writer.index_written = writer.hdr.index_count;
+    }
+    else if (writer.hdr.index_count > 0)
+    {
+        uint32_t last = writer.hdr.index_count - 1;
+        pwrite(writer.fd, &writer.index[last], sizeof(struct index_entry),
+               BINLOG_INDEX_OFFSET + last * sizeof(struct index_entry));
+    }
+    pwrite(writer.fd, &writer.hdr, sizeof(writer.hdr), 0);
+}
+
+static void segment_close()
+{
+    if (writer.fd == -1)
+        return;
+    segment_sync();
+    // Give back the preallocated tail, keeping one zeroed record header as the end marker
+    uint64_t end = writer.hdr.data_start + writer.hdr.used + sizeof(struct binlog_record);
+    if (end < writer.hdr.size)
+    {
+        writer.hdr.size = end;
+        pwrite(writer.fd, &writer.hdr, sizeof(writer.hdr), 0);
+        ftruncate(writer.fd, end);
+    }
+    close(writer.fd);
+    writer.fd = -1;
+}
+
+static int seq_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Sequence numbers of the segments in LOG_SEGMENT_DIR, sorted; returns how many */
+static int list_segments(uint64_t *seqs, int max)
+{
+    DIR *dir = opendir(LOG_SEGMENT_DIR);
+    if (!dir)
+        return 0;
+    int count = 0;
+    struct dirent *entry;
+    unsigned long long seq;
+    char tail;
+    while (count < max && (entry = readdir(dir)) != NULL)
+    {
+        if (sscanf(entry->d_name, "segment-%llu.rdl%c", &seq, &tail) == 1)
+            seqs[count++] = seq;
+    }
+    closedir(dir);
+    qsort(seqs, count, sizeof(uint64_t), seq_compare);
+    return count;
+}
+
+static void segment_path(char *path, size_t size, uint64_t seq)
+{
+    snprintf(path, size, "%s/segment-%010llu.rdl", LOG_SEGMENT_DIR, (unsigned long long)seq);
+}
+
+/* Start the next segment and drop the oldest beyond the retention count.
+   Caller holds writer.lock. */
+static int segment_open()
+{
+    static uint64_t seqs[BINLOG_MAX_SEGMENTS];
+    segment_close();
+    if (ensure_directory(LOG_SEGMENT_DIR) == -1)
+        return -1;
+    int count = list_segments(seqs, BINLOG_MAX_SEGMENTS);
+    uint64_t seq = count > 0 ? seqs[count - 1] + 1 : 1;
+
+    long keep = env_long("REPORT_DAEMON_LOG_SEGMENTS", LOG_SEGMENT_KEEP);
+    char path[MAX_PATH_BUFFER];
+    for (int i = 0; keep > 0 && i < count - keep + 1; i++)
+    {
+        segment_path(path, sizeof(path), seqs[i]);
+        unlink(path);
+    }
+
+    uint64_t size = segment_size();
+    uint32_t slots = size / BINLOG_INDEX_STRIDE + 1;
+    uint64_t data_start = (BINLOG_INDEX_OFFSET + slots * sizeof(struct index_entry) + 4095) & ~(uint64_t)4095;
+    if (size < data_start * 2)
+        size = data_start * 2;
+
+    segment_path(path, sizeof(path), seq);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Cannot create log segment %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // Reserve the whole segment up front; where that is unsupported a sparse file will do
+    if (fallocate(fd, 0, 0, size) == -1 && ftruncate(fd, size) == -1)
+    {
+        fprintf(stderr, "Cannot allocate log segment %s: %s\n", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    struct index_entry *index = realloc(writer.index, slots * sizeof(struct index_entry));
+    if (!index)
+    {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    writer.index = index;
+    writer.fd = fd;
+    memset(&writer.hdr, 0, sizeof(writer.hdr));
+    writer.hdr.magic = BINLOG_MAGIC;
+    writer.hdr.version = BINLOG_VERSION;
+    writer.hdr.seq = seq;
+    writer.hdr.size = size;
+    writer.hdr.data_start = data_start;
+    writer.hdr.index_slots = slots;
+    writer.hdr.string_count = 1; // id 0: no event
+    memset(writer.strings, 0, sizeof(writer.strings));
+    writer.strings_dirty = 1;
+    writer.index_written = 0;
+    writer.buf_used = 0;
+    writer.buf_offset = 0;
+    clock_gettime(CLOCK_MONOTONIC, &writer.opened);
+    pwrite(fd, &writer.hdr, sizeof(writer.hdr), 0);
+    return 0;
+}
+
+/* Id of a level or event name in the current segment (0 when the table is full) */
+static uint16_t intern(const char *name, size_t len)
+{
+    if (len == 0)
+        return 0;
+    for (uint32_t i = 1; i < writer.hdr.string_count; i++)
+    {
+        if (strncmp(writer.strings[i], name, len) == 0 && writer.strings[i][len] == '\0')
+            return i;
+    }
+    if (writer.hdr.string_count == BINLOG_STRINGS)
+        return 0;
+    uint32_t id = writer.hdr.string_count++;
+    memcpy(writer.strings[id], name, len);
+    writer.strings_dirty = 1;
+    return id;
+}
+
+/* Append one pending record to the current segment. Caller holds writer.lock. */
+static void append_record(const struct binlog_pending *p)
+{
+    const char *names = (const char *)(p + 1);
+    size_t length = ALIGN8(sizeof(struct binlog_record) + p->text_len);
+    long rotate_s = env_long("REPORT_DAEMON_LOG_ROTATE_SECONDS", LOG_ROTATE_SECONDS);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    // Room for this record and a zero header ending the segment
+    if (writer.fd == -1 ||
+        writer.hdr.data_start + writer.hdr.used + length + sizeof(struct binlog_record) > writer.hdr.size ||
+        (rotate_s > 0 && writer.hdr.records > 0 && now.tv_sec - writer.opened.tv_sec >= rotate_s))
+    {
+        if (segment_open() == -1)
+            return;
+    }
+    if (writer.buf_used + length > BINLOG_BATCH)
+        segment_sync();
+
+    struct binlog_record rec = {0};
+    rec.length = length;
+    rec.level = intern(names, p->level_len);
+    rec.event = intern(names + p->level_len, p->event_len);
+    rec.pid = p->pid;
+    rec.text_len = p->text_len;
+    rec.wall_ns = p->wall_ns;
+    rec.mono_ns = p->mono_ns;
+
+    uint32_t n = writer.hdr.index_count;
+    if ((n == 0 || writer.hdr.used - writer.index[n - 1].offset >= BINLOG_INDEX_STRIDE) && n < writer.hdr.index_slots)
+    {
+        writer.index[n] = (struct index_entry){rec.wall_ns, writer.hdr.used, 0};
+        writer.hdr.index_count = ++n;
+    }
+    writer.index[n - 1].mask |= 1ULL << (rec.level % 64) | 1ULL << (rec.event % 64);
+
+    char *out = writer.buf + writer.buf_used;
+    memcpy(out, &rec, sizeof(rec));
+    memcpy(out + sizeof(rec), names + p->level_len + p->event_len, p->text_len);
+    memset(out + sizeof(rec) + p->text_len, 0, length - sizeof(rec) - p->text_len);
+    writer.buf_used += length;
+    writer.hdr.used += length;
+    if (writer.hdr.records++ == 0)
+        writer.hdr.first_wall_ns = rec.wall_ns;
+    writer.hdr.last_wall_ns = rec.wall_ns;
+}
+
+void binlog_write(const char *records, size_t len)
+{
+    pthread_mutex_lock(&writer.lock);
+    if (!writer.buf && !(writer.buf = malloc(BINLOG_BATCH)))
+    {
+        pthread_mutex_unlock(&writer.lock);
+        return;
+    }
+    for (size_t off = 0; off + sizeof(struct binlog_pending) <= len;)
+    {
+        const struct binlog_pending *p = (const struct binlog_pending *)(records + off);
+        if (p->length < sizeof(*p) || off + p->length > len)
+            break;
+        append_record(p);
+        off += p->length;
+    }
+    segment_sync();
+    pthread_mutex_unlock(&writer.lock);
+}
+
+void binlog_rotate()
+{
+    pthread_mutex_lock(&writer.lock);
+    if (writer.fd != -1)
+        segment_open();
+    pthread_mutex_unlock(&writer.lock);
+}
+
+void binlog_close()
+{
+    pthread_mutex_lock(&writer.lock);
+    segment_close();
+    pthread_mutex_unlock(&writer.lock);
+}
+
+/* Decoder */
+
+static void print_record(const struct binlog_record *rec, const char (*strings)[BINLOG_STRING_MAX])
+{
+    time_t seconds = rec->wall_ns / 1000000000LL;
+    struct tm tm_info;
+    char ts[32];
+    localtime_r(&seconds, &tm_info);
+    strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm_info);
+    printf("[%s.%06ld] %-7.*s %6u %-12.*s %.*s\n", ts, (long)(rec->wall_ns % 1000000000LL / 1000),
+           BINLOG_STRING_MAX, strings[rec->level], rec->pid, BINLOG_STRING_MAX, strings[rec->event],
+           rec->text_len, (const char *)(rec + 1));
+}
+
+/* Print the matching records of one segment, returns how many */
+static long dump_segment(const char *path, int64_t from, int64_t to, const char *type, int newest)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    struct stat st;
+    struct segment_header hdr;
+    if (fstat(fd, &st) == -1 || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != BINLOG_MAGIC ||
+        hdr.version != BINLOG_VERSION || hdr.data_start > (uint64_t)st.st_size ||
+        BINLOG_INDEX_OFFSET + (uint64_t)hdr.index_slots * sizeof(struct index_entry) > hdr.data_start)
+    {
+        close(fd);
+        return 0;
+    }
+    // The header of the segment being written lags by at most one batch
+    if (hdr.records == 0 || hdr.index_count == 0 || hdr.first_wall_ns > to || (!newest && hdr.last_wall_ns < from))
+    {
+        close(fd);
+        return 0;
+    }
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    const char(*strings)[BINLOG_STRING_MAX] = (const char(*)[BINLOG_STRING_MAX])(map + BINLOG_STRINGS_OFFSET);
+    const struct index_entry *index = (const struct index_entry *)(map + BINLOG_INDEX_OFFSET);
+    uint32_t index_count = hdr.index_count < hdr.index_slots ? hdr.index_count : hdr.index_slots;
+
+    /* Type filter: the id of the name in this segment's string table */
+    uint64_t type_bit = 0;
+    int type_id = -1;
+    if (type)
+    {
+        for (uint32_t i = 1; i < BINLOG_STRINGS && strings[i][0]; i++)
+        {
+            if (strncmp(strings[i], type, BINLOG_STRING_MAX) == 0)
+                type_id = i;
+        }
+        if (type_id == -1)
+        {
+            munmap((void *)map, st.st_size);
+            return 0;
+        }
+        type_bit = 1ULL << (type_id % 64);
+    }
+
+    /* Last block starting at or before `from` */
+    uint32_t lo = 0, hi = index_count;
+    while (hi - lo > 1)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (index[mid].wall_ns <= from)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    long printed = 0;
+    const char *data = map + hdr.data_start;
+    uint64_t limit = st.st_size - hdr.data_start;
+    for (uint32_t block = lo; block < index_count; block++)
+    {
+        uint64_t off = index[block].offset;
+        uint64_t end = block + 1 < index_count ? index[block + 1].offset : limit;
+        if (index[block].wall_ns > to)
+            break;
+        if (type && !(index[block].mask & type_bit))
+            continue; // nothing of this type in the block
+        while (off + sizeof(struct binlog_record) <= end && off + sizeof(struct binlog_record) <= limit)
+        {
+            const struct binlog_record *rec = (const struct binlog_record *)(data + off);
+            if (rec->length < sizeof(*rec) || off + rec->length > limit)
+                break; // end of the segment
+            off += rec->length;
+            if (rec->wall_ns < from)
+                continue;
+            if (rec->wall_ns > to)
+                break;
+            if (rec->level >= BINLOG_STRINGS || rec->event >= BINLOG_STRINGS)
+                continue;
+            if (type && rec->level != type_id && rec->event != type_id)
+                continue;
+            print_record(rec, strings);
+            printed++;
+        }
+    }
+    munmap((void *)map, st.st_size);
+    return printed;
+}
+
+/* "YYYY-MM-DD HH:MM[:SS]" or "YYYY-MM-DD" local time, in ns; -1 if invalid */
+static int64_t parse_time(const char *text)
+{
+    struct tm tm_info;
+    memset(&tm_info, 0, sizeof(tm_info));
+    const char *end = strptime(text, "%Y-%m-%d %H:%M:%S", &tm_info);
+    if (!end || *end)
+    {
+        memset(&tm_info, 0, sizeof(tm_info));
+        end = strptime(text, "%Y-%m-%d %H:%M", &tm_info);
+    }
+    if (!end || *end)
+    {
+        memset(&tm_info, 0, sizeof(tm_info));
+        end = strptime(text, "%Y-%m-%d", &tm_info);
+    }
+    if (!end || *end)
+        return -1;
+    tm_info.tm_isdst = -1;
+    time_t t = mktime(&tm_info);
+    return t == (time_t)-1 ? -1 : (int64_t)t * 1000000000LL;
+}
+
+int binlog_dump(int argc, char **argv)
+{
+    int64_t from = INT64_MIN, to = INT64_MAX;
+    const char *type = NULL;
+    for (int i = 0; i < argc; i++)
+    {
+        if (i + 1 < argc && (strcmp(argv[i], "--from") == 0 || strcmp(argv[i], "--to") == 0))
+        {
+            int64_t t = parse_time(argv[i + 1]);
+            if (t == -1)
+            {
+                fprintf(stderr, "Invalid time '%s' (expected YYYY-MM-DD [HH:MM[:SS]])\n", argv[i + 1]);
+                return -1;
+            }
+            if (argv[i][2] == 'f')
+                from = t;
+            else
+                to = t;
+            i++;
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "--type") == 0)
+            type = argv[++i];
+        else
+        {
+            fprintf(stderr, "Usage: report_daemon log-dump [--from TIME] [--to TIME] [--type LEVEL|EVENT]\n");
+            return -1;
+        }
+    }
+
+    static uint64_t seqs[BINLOG_MAX_SEGMENTS];
+    int count = list_segments(seqs, BINLOG_MAX_SEGMENTS);
+    if (count == 0)
+    {
+        fprintf(stderr, "No log segments in %s\n", LOG_SEGMENT_DIR);
+        return -1;
+    }
+    long printed = 0;
+    char path[MAX_PATH_BUFFER];
+    for (int i = 0; i < count; i++)
+    {
+        segment_path(path, sizeof(path), seqs[i]);
+        printed += dump_segment(path, from, to, type, i == count - 1);
+    }
+    fprintf(stderr, "%ld record(s) from %d segment(s)\n", printed, count);
+    return 0;
+}
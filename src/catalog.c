@@ -0,0 +1,422 @@
+/* catalog.c – Append-only catalog of filed and backed up reports.
+ *
+ * Every report the daemon files into REPORT_DIR/<date> or copies into
+ * BACKUP_DIR/<date> is recorded in CATALOG_DIR/catalog.log with its date,
+ * name, size and (for backups) content hash. Questions such as "what arrived
+ * on a date" or "which backups hold dept3" are answered from a sorted index
+ * (catalog.idx) mapped read-only, plus a linear pass over the few log
+ * records appended since the index was last built, without reading any
+ * date directory.
+ *
+ * On-disk layout (native endianness, the files never leave the host):
+ *   catalog.log: records of struct catalog_entry (name_off unused) each
+ *                followed by name_len bytes of name (no NUL)
+ *   catalog.idx: struct catalog_index_header, `count` entries sorted by
+ *                (name, date, kind), `count` uint32 entry numbers sorted by
+ *                (date, name, kind), then the string table
+ */
+
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define CATALOG_LOG CATALOG_DIR "/catalog.log"
+#define CATALOG_INDEX CATALOG_DIR "/catalog.idx"
+#define CATALOG_MAGIC 0x49434452u // "RDCI"
+#define CATALOG_VERSION 1
+#define CATALOG_RECORD_MAGIC 0xca7a
+#define CATALOG_NAME_MAX 255
+
+struct catalog_entry
+{
+    uint32_t date;      // YYYYMMDD of the directory the report was filed/backed up under
+    uint16_t magic;     // CATALOG_RECORD_MAGIC, detects a torn record at the end of the log
+    uint8_t kind;       // CATALOG_FILED or CATALOG_BACKED_UP
+    uint8_t name_len;
+    uint32_t name_off;  // index only: offset of the name in the string table
+    uint32_t reserved;
+    uint64_t size;
+    uint64_t hash;      // FNV-1a of the contents, 0 if not hashed
+    int64_t recorded;   // when the record was written
+};
+
+struct catalog_index_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t strings_size;
+    uint64_t log_size; // bytes of catalog.log covered by the index
+};
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_fd = -1;
+
+/* "YYYY-MM-DD" -> YYYYMMDD, 0 if malformed */
+static uint32_t parse_date(const char *date)
+{
+    unsigned y, m, d;
+    if (sscanf(date, "%4u-%2u-%2u", &y, &m, &d) != 3 || m < 1 || m > 12 || d < 1 || d > 31)
+        return 0;
+    return y * 10000 + m * 100 + d;
+}
+
+static void format_date(uint32_t date, char *buffer, size_t size)
+{
+    snprintf(buffer, size, "%04u-%02u-%02u", date / 10000, date / 100 % 100, date % 100);
+}
+
+int catalog_record(int kind, const char *date, const char *name, uint64_t size, uint64_t hash)
+{
+    size_t name_len = strlen(name);
+    uint32_t day = parse_date(date);
+    if (name_len == 0 || name_len > CATALOG_NAME_MAX || day == 0)
+        return -1;
+
+    char record[sizeof(struct catalog_entry) + CATALOG_NAME_MAX];
+    struct catalog_entry entry = {
+        .date = day,
+        .magic = CATALOG_RECORD_MAGIC,
+        .kind = kind,
+        .name_len = name_len,
+        .size = size,
+        .hash = hash,
+        .recorded = time(NULL),
+    };
+    memcpy(record, &entry, sizeof(entry));
+    memcpy(record + sizeof(entry), name, name_len);
+
+    pthread_mutex_lock(&log_lock);
+    if (log_fd == -1)
+    {
+        ensure_directory(CATALOG_DIR);
+        log_fd = open(CATALOG_LOG, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    }
+    int fd = log_fd;
+    pthread_mutex_unlock(&log_lock);
+    if (fd == -1)
+        return -1;
+
+    // One write per record: O_APPEND keeps records from different processes whole
+    ssize_t written = write(fd, record, sizeof(entry) + name_len);
+    return written == (ssize_t)(sizeof(entry) + name_len) ? 0 : -1;
+}
+
+/* In-memory view used both for building the index and for queries */
+struct catalog_view
+{
+    struct catalog_entry *entries;
+    const char *strings;
+    uint32_t count;
+    uint32_t *by_date;
+
+    void *map; // mapped index, if any
+    size_t map_size;
+    uint64_t log_size;
+
+    struct catalog_entry *tail; // log records newer than the index
+    char *tail_strings;
+    uint32_t tail_count;
+};
+
+static const char *entry_name(const struct catalog_view *v, const struct catalog_entry *e, int in_tail)
+{
+    return (in_tail ? v->tail_strings : v->strings) + e->name_off;
+}
+
+static int name_cmp(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    return c ? c : (a_len > b_len) - (a_len < b_len);
+}
+
+/* Map the index, if present and valid */
+static void view_map_index(struct catalog_view *v)
+{
+    int fd = open(CATALOG_INDEX, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct catalog_index_header))
+    {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    const struct catalog_index_header *hdr = map;
+    size_t need = sizeof(*hdr) + (size_t)hdr->count * (sizeof(struct catalog_entry) + sizeof(uint32_t)) +
+                  hdr->strings_size;
+    if (hdr->magic != CATALOG_MAGIC || hdr->version != CATALOG_VERSION || need > (size_t)st.st_size)
+    {
+        munmap(map, st.st_size);
+        return;
+    }
+    v->map = map;
+    v->map_size = st.st_size;
+    v->count = hdr->count;
+    v->log_size = hdr->log_size;
+    v->entries = (struct catalog_entry *)((char *)map + sizeof(*hdr));
+    v->by_date = (uint32_t *)(v->entries + hdr->count);
+    v->strings = (const char *)(v->by_date + hdr->count);
+}
+
+/* Read the log records from offset on. Stops at a torn or corrupt record. */
+static int view_read_tail(struct catalog_view *v, uint64_t offset, uint64_t *log_end)
+{
+    *log_end = offset;
+    int fd = open(CATALOG_LOG, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    if ((uint64_t)st.st_size <= offset)
+    {
+        close(fd);
+        return 0;
+    }
+
+    size_t len = st.st_size - offset;
+    char *buf = malloc(len);
+    uint32_t capacity = len / sizeof(struct catalog_entry) + 1;
+    v->tail = malloc(capacity * sizeof(struct catalog_entry));
+    v->tail_strings = malloc(len);
+    if (!buf || !v->tail || !v->tail_strings || pread(fd, buf, len, offset) != (ssize_t)len)
+    {
+        free(buf);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    size_t pos = 0, strings = 0;
+    while (pos + sizeof(struct catalog_entry) <= len)
+    {
+        struct catalog_entry e;
+        memcpy(&e, buf + pos, sizeof(e));
+        if (e.magic != CATALOG_RECORD_MAGIC || e.name_len == 0 || pos + sizeof(e) + e.name_len > len)
+            break;
+        memcpy(v->tail_strings + strings, buf + pos + sizeof(e), e.name_len);
+        e.name_off = strings;
+        strings += e.name_len;
+        v->tail[v->tail_count++] = e;
+        pos += sizeof(e) + e.name_len;
+    }
+    free(buf);
+    *log_end = offset + pos;
+    return 0;
+}
+
+static void view_free(struct catalog_view *v)
+{
+    if (v->map)
+        munmap(v->map, v->map_size);
+    free(v->tail);
+    free(v->tail_strings);
+}
+
+/* Sort helpers for building the index (qsort has no context argument) */
+static const char *sort_strings;
+static const struct catalog_entry *sort_entries;
+
+static int by_name_cmp(const void *pa, const void *pb)
+{
+    const struct catalog_entry *a = pa, *b = pb;
+    int c = name_cmp(sort_strings + a->name_off, a->name_len, sort_strings + b->name_off, b->name_len);
+    if (c)
+        return c;
+    if (a->date != b->date)
+        return a->date < b->date ? -1 : 1;
+    return (int)a->kind - (int)b->kind;
+}
+
+static int by_date_cmp(const void *pa, const void *pb)
+{
+    const struct catalog_entry *a = &sort_entries[*(const uint32_t *)pa];
+    const struct catalog_entry *b = &sort_entries[*(const uint32_t *)pb];
+    if (a->date != b->date)
+        return a->date < b->date ? -1 : 1;
+    int c = name_cmp(sort_strings + a->name_off, a->name_len, sort_strings + b->name_off, b->name_len);
+    return c ? c : (int)a->kind - (int)b->kind;
+}
+
+int catalog_rebuild()
+{
+    struct catalog_view v = {0};
+    view_map_index(&v);
+    uint64_t log_end;
+    if (view_read_tail(&v, v.log_size, &log_end) == -1)
+    {
+        view_free(&v);
+        return -1;
+    }
+    if (v.map && v.tail_count == 0)
+    {
+        view_free(&v);
+        return v.count; // index already covers the whole log
+    }
+
+    /* Merge the indexed entries and the new tail into one array with one string table */
+    uint32_t count = v.count + v.tail_count;
+    size_t old_strings = v.map ? ((struct catalog_index_header *)v.map)->strings_size : 0;
+    size_t tail_strings = 0;
+    for (uint32_t i = 0; i < v.tail_count; i++)
+        tail_strings += v.tail[i].name_len;
+
+    struct catalog_entry *entries = malloc((count ? count : 1) * sizeof(*entries));
+    uint32_t *by_date = malloc((count ? count : 1) * sizeof(uint32_t));
+    char *strings = malloc(old_strings + tail_strings + 1);
+    if (!entries || !by_date || !strings)
+    {
+        free(entries);
+        free(by_date);
+        free(strings);
+        view_free(&v);
+        return -1;
+    }
+    if (v.count)
+        memcpy(entries, v.entries, v.count * sizeof(*entries));
+    if (old_strings)
+        memcpy(strings, v.strings, old_strings);
+    memcpy(strings + old_strings, v.tail_strings, tail_strings);
+    for (uint32_t i = 0; i < v.tail_count; i++)
+    {
+        entries[v.count + i] = v.tail[i];
+        entries[v.count + i].name_off += old_strings;
+    }
+    view_free(&v);
+
+    sort_strings = strings;
+    qsort(entries, count, sizeof(*entries), by_name_cmp);
+    for (uint32_t i = 0; i < count; i++)
+        by_date[i] = i;
+    sort_entries = entries;
+    qsort(by_date, count, sizeof(uint32_t), by_date_cmp);
+
+    /* Write the new index next to the old one and swap it in atomically */
+    struct catalog_index_header hdr = {
+        .magic = CATALOG_MAGIC,
+        .version = CATALOG_VERSION,
+        .count = count,
+        .strings_size = old_strings + tail_strings,
+        .log_size = log_end,
+    };
+    char tmp_path[] = CATALOG_INDEX ".tmp";
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ok = fd != -1 &&
+             write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+             write(fd, entries, count * sizeof(*entries)) == (ssize_t)(count * sizeof(*entries)) &&
+             write(fd, by_date, count * sizeof(uint32_t)) == (ssize_t)(count * sizeof(uint32_t)) &&
+             write(fd, strings, hdr.strings_size) == (ssize_t)hdr.strings_size &&
+             fdatasync(fd) == 0;
+    if (fd != -1)
+        close(fd);
+    free(entries);
+    free(by_date);
+    free(strings);
+
+    if (!ok || rename(tmp_path, CATALOG_INDEX) == -1)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+    return count;
+}
+
+static void print_entry(const struct catalog_view *v, const struct catalog_entry *e, int in_tail)
+{
+    char date[16];
+    format_date(e->date, date, sizeof(date));
+    const char *name = entry_name(v, e, in_tail);
+    int backed_up = e->kind == CATALOG_BACKED_UP;
+    printf("%s  %-6s  %-24.*s  %10llu  %016llx  %s/%s/%.*s\n", date, backed_up ? "backup" : "filed",
+           e->name_len, name, (unsigned long long)e->size, (unsigned long long)e->hash,
+           backed_up ? BACKUP_DIR : REPORT_DIR, date, e->name_len, name);
+}
+
+int catalog_query(const char *what, const char *arg)
+{
+    int by_date = strcmp(what, "date") == 0;
+    if (!by_date && strcmp(what, "dept") != 0)
+    {
+        fprintf(stderr, "Unknown catalog query '%s' (date YYYY-MM-DD | dept NAME | rebuild)\n", what);
+        return -1;
+    }
+
+    uint32_t day = 0;
+    char name[CATALOG_NAME_MAX + 1] = "";
+    size_t name_len = 0;
+    if (by_date)
+    {
+        day = parse_date(arg);
+        if (day == 0)
+        {
+            fprintf(stderr, "Invalid date '%s'\n", arg);
+            return -1;
+        }
+    }
+    else
+    {
+        // A department matches its report file name
+        const char *ext = strrchr(arg, '.');
+        snprintf(name, sizeof(name), (ext && strcmp(ext, ".xml") == 0) ? "%s" : "%s.xml", arg);
+        name_len = strlen(name);
+    }
+
+    struct catalog_view v = {0};
+    view_map_index(&v);
+    uint64_t log_end;
+    view_read_tail(&v, v.log_size, &log_end);
+
+    unsigned long matches = 0;
+    unsigned long long bytes = 0;
+
+    /* Indexed entries: binary search for the first match, then walk the run */
+    uint32_t lo = 0, hi = v.count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const struct catalog_entry *e = by_date ? &v.entries[v.by_date[mid]] : &v.entries[mid];
+        int before = by_date ? e->date < day
+                             : name_cmp(entry_name(&v, e, 0), e->name_len, name, name_len) < 0;
+        if (before)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (uint32_t i = lo; i < v.count; i++)
+    {
+        const struct catalog_entry *e = by_date ? &v.entries[v.by_date[i]] : &v.entries[i];
+        if (by_date ? e->date != day : name_cmp(entry_name(&v, e, 0), e->name_len, name, name_len) != 0)
+            break;
+        print_entry(&v, e, 0);
+        matches++;
+        bytes += e->size;
+    }
+
+    /* Records appended since the index was built */
+    for (uint32_t i = 0; i < v.tail_count; i++)
+    {
+        const struct catalog_entry *e = &v.tail[i];
+        if (by_date ? e->date != day : name_cmp(entry_name(&v, e, 1), e->name_len, name, name_len) != 0)
+            continue;
+        print_entry(&v, e, 1);
+        matches++;
+        bytes += e->size;
+    }
+
+    fprintf(stderr, "%lu entries, %llu bytes (%u indexed, %u not yet indexed)\n",
+            matches, bytes, v.count, v.tail_count);
+    view_free(&v);
+    return matches;
+}
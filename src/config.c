@@ -0,0 +1,602 @@
+/* config.c – Runtime configuration (CONFIG_FILE, or REPORT_DAEMON_CONFIG).
+ *
+ * The file sets the same knobs as the REPORT_DAEMON_* environment variables,
+ * one "NAME = value" per line (the prefix is optional, '#' starts a comment),
+ * plus the daily schedule (DEADLINE, BACKUP_TIME). A variable set in the
+ * environment takes precedence over the file.
+ *
+ * Every value is checked when the file is read; a file with any error is
+ * rejected as a whole, so the daemon refuses to start with it and a reload
+ * keeps the configuration it has. A valid file becomes a new immutable
+ * snapshot, swapped in with one pointer store. Readers never lock: what they
+ * got from config_get() stays valid because replaced snapshots are never
+ * freed (they are small, and only an operator's reload creates one).
+ *
+ * Settings read when they are used (backup pacing, schedule, upload roots,
+ * departments, log rotation, XML checks) apply from the next use after a
+ * reload; the few fixed at startup are listed as such and a reload that
+ * changes them says it needs a restart.
+ */
+
+#define _GNU_SOURCE
+#include "utils.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#define CONFIG_PREFIX "REPORT_DAEMON_"
+#define CONFIG_LINE_MAX 4096
+#define CONFIG_ERRORS_MAX 4096
+
+enum config_type
+{
+    CONFIG_INT,    // integer within [min, max]
+    CONFIG_BOOL,   // 0 or 1
+    CONFIG_CHOICE, // one of choices, '|' separated
+    CONFIG_TIME,   // HH:MM, local time
+    CONFIG_PATH,   // absolute path
+    CONFIG_ROOTS,  // ':' separated absolute directories
+    CONFIG_CPUS,   // CPU list such as 0-3,6
+    CONFIG_STRING,
+};
+
+struct config_key
+{
+    const char *name; // without CONFIG_PREFIX
+    enum config_type type;
+    int reloadable; // 0: read once at startup
+    long min, max;
+    const char *choices;
+};
+
+static const struct config_key keys[] = {
+    {"BACKUP_DIR", CONFIG_PATH, 0, 0, 0, NULL},
+    {"BACKUP_FADVISE", CONFIG_BOOL, 1, 0, 0, NULL},
+    {"BACKUP_IOPRIO", CONFIG_CHOICE, 1, 0, 0, "be|idle|none"},
+    {"BACKUP_RATE", CONFIG_INT, 1, 0, LONG_MAX, NULL},
+    {"BACKUP_TIME", CONFIG_TIME, 1, 0, 0, NULL},
+    {"BACKUP_WORKERS", CONFIG_INT, 1, 0, BACKUP_MAX_WORKERS, NULL},
+    {"COALESCE_MS", CONFIG_INT, 1, 0, 3600000, NULL},
+    {"DEADLINE", CONFIG_TIME, 1, 0, 0, NULL},
+    {"DEPARTMENTS", CONFIG_PATH, 1, 0, 0, NULL},
+    {"IO_URING", CONFIG_INT, 1, 0, LONG_MAX, NULL},
+    {"IPC", CONFIG_CHOICE, 0, 0, 0, "mq|shm"},
+    {"LOG_FORMAT", CONFIG_CHOICE, 0, 0, 0, "text|binary"},
+    {"LOG_ROTATE_SECONDS", CONFIG_INT, 1, 0, LONG_MAX, NULL},
+    {"LOG_SEGMENT_MB", CONFIG_INT, 1, 1, 4096, NULL},
+    {"LOG_SEGMENTS", CONFIG_INT, 1, 0, 4096, NULL},
+    {"PIPELINE_CPUS", CONFIG_CPUS, 0, 0, 0, NULL},
+    {"PIPELINE_WORKERS", CONFIG_INT, 0, 1, PIPELINE_MAX_WORKERS, NULL},
+    {"REPORT_DIR", CONFIG_PATH, 0, 0, 0, NULL},
+    {"SNAPSHOT", CONFIG_BOOL, 0, 0, 0, NULL},
+    {"STREAM_INGEST", CONFIG_BOOL, 0, 0, 0, NULL},
+    {"UPLOAD_DIR", CONFIG_PATH, 0, 0, 0, NULL},
+    {"UPLOAD_ROOTS", CONFIG_ROOTS, 1, 0, 0, NULL},
+    {"VALIDATE", CONFIG_BOOL, 0, 0, 0, NULL},
+    {"WATCHER_CPU", CONFIG_INT, 0, -1, 4095, NULL},
+    {"XML_DEPT_ATTR", CONFIG_STRING, 1, 0, 0, NULL},
+    {"XML_ROOT", CONFIG_STRING, 1, 0, 0, NULL},
+};
+
+#define CONFIG_KEYS (sizeof(keys) / sizeof(keys[0]))
+
+struct config
+{
+    struct config *retired; // the snapshot this one replaced, kept alive for its readers
+    char *values[CONFIG_KEYS]; // NULL when unset
+    unsigned char from_env[CONFIG_KEYS];
+    const char *roots[MAX_UPLOAD_ROOTS]; // UPLOAD_DIR, then UPLOAD_ROOTS
+    int root_count;
+    char *roots_buf;
+    int deadline_hour, deadline_minute;
+    int backup_hour, backup_minute;
+};
+
+static struct config *current = NULL;
+static struct config *startup = NULL; // the first snapshot: where the data directories stay until a restart
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int key_index(const char *name, size_t len)
+{
+    if (len > strlen(CONFIG_PREFIX) && strncmp(name, CONFIG_PREFIX, strlen(CONFIG_PREFIX)) == 0)
+    {
+        name += strlen(CONFIG_PREFIX);
+        len -= strlen(CONFIG_PREFIX);
+    }
+    for (size_t i = 0; i < CONFIG_KEYS; i++)
+    {
+        if (strlen(keys[i].name) == len && strncmp(keys[i].name, name, len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static const char *config_path()
+{
+    const char *path = getenv(CONFIG_PREFIX "CONFIG");
+    return path && *path ? path : CONFIG_FILE;
+}
+
+/* c's value of a data directory setting, or its default */
+static const char *dir_value(const struct config *c, const char *name)
+{
+    const char *value = c ? c->values[key_index(name, strlen(name))] : NULL;
+    if (value && *value)
+        return value;
+    if (strcmp(name, "UPLOAD_DIR") == 0)
+        return DEFAULT_UPLOAD_DIR;
+    return strcmp(name, "REPORT_DIR") == 0 ? DEFAULT_REPORT_DIR : DEFAULT_BACKUP_DIR;
+}
+
+/* Problems found while reading, one per line */
+struct config_errors
+{
+    char text[CONFIG_ERRORS_MAX];
+    size_t len;
+    int count;
+};
+
+static void add_error(struct config_errors *errors, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void add_error(struct config_errors *errors, const char *fmt, ...)
+{
+    errors->count++;
+    if (errors->len >= sizeof(errors->text) - 1)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(errors->text + errors->len, sizeof(errors->text) - errors->len - 1, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        errors->len += (size_t)n < sizeof(errors->text) - errors->len - 1 ? (size_t)n : sizeof(errors->text) - errors->len - 1;
+    errors->text[errors->len++] = '\n';
+    errors->text[errors->len] = '\0';
+}
+
+static int parse_time(const char *value, int *hour, int *minute)
+{
+    char tail;
+    return sscanf(value, "%d:%d%c", hour, minute, &tail) == 2 && *hour >= 0 && *hour < 24 && *minute >= 0 &&
+           *minute < 60;
+}
+
+/* Is one of a and b the other or below it? */
+static int paths_overlap(const char *a, const char *b)
+{
+    size_t la = strlen(a), lb = strlen(b);
+    size_t n = la < lb ? la : lb;
+    return strncmp(a, b, n) == 0 && (a[n] == '\0' || a[n] == '/') && (b[n] == '\0' || b[n] == '/');
+}
+
+/* Check one value; returns 0 when valid, else describes the problem in why */
+static int check_value(const struct config_key *key, const char *value, char *why, size_t size)
+{
+    char *end;
+    switch (key->type)
+    {
+    case CONFIG_INT:
+    case CONFIG_BOOL:
+    {
+        long min = key->type == CONFIG_BOOL ? 0 : key->min;
+        long max = key->type == CONFIG_BOOL ? 1 : key->max;
+        errno = 0;
+        long parsed = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || errno != 0 || parsed < min || parsed > max)
+        {
+            if (max == LONG_MAX)
+                snprintf(why, size, "expected an integer of at least %ld", min);
+            else
+                snprintf(why, size, "expected an integer from %ld to %ld", min, max);
+            return -1;
+        }
+        return 0;
+    }
+    case CONFIG_CHOICE:
+    {
+        size_t len = strlen(value);
+        for (const char *c = key->choices; *c;)
+        {
+            size_t n = strcspn(c, "|");
+            if (n == len && strncmp(c, value, n) == 0)
+                return 0;
+            c += c[n] ? n + 1 : n;
+        }
+        snprintf(why, size, "expected one of %s", key->choices);
+        return -1;
+    }
+    case CONFIG_TIME:
+    {
+        int hour, minute;
+        if (parse_time(value, &hour, &minute))
+            return 0;
+        snprintf(why, size, "expected HH:MM");
+        return -1;
+    }
+    case CONFIG_PATH:
+        if (value[0] == '/')
+            return 0;
+        snprintf(why, size, "expected an absolute path");
+        return -1;
+    case CONFIG_ROOTS:
+    {
+        char copy[CONFIG_LINE_MAX];
+        // Overlap with UPLOAD_DIR is checked by config_read(), which knows which one applies
+        const char *seen[MAX_UPLOAD_ROOTS];
+        int count = 1;
+        snprintf(copy, sizeof(copy), "%s", value);
+        char *save = NULL;
+        for (char *root = strtok_r(copy, ":", &save); root; root = strtok_r(NULL, ":", &save))
+        {
+            struct stat st;
+            if (root[0] != '/')
+                snprintf(why, size, "%s is not an absolute path", root);
+            else if (stat(root, &st) == -1 || !S_ISDIR(st.st_mode))
+                snprintf(why, size, "%s is not a directory", root);
+            else if (count == MAX_UPLOAD_ROOTS)
+                snprintf(why, size, "more than %d upload roots", MAX_UPLOAD_ROOTS - 1);
+            else
+            {
+                for (int i = 1; i < count; i++)
+                {
+                    if (paths_overlap(root, seen[i]))
+                    {
+                        snprintf(why, size, "%s overlaps upload root %s", root, seen[i]);
+                        return -1;
+                    }
+                }
+                seen[count++] = root;
+                continue;
+            }
+            return -1;
+        }
+        return 0;
+    }
+    case CONFIG_CPUS:
+        if (*value && strspn(value, "0123456789,-") == strlen(value))
+            return 0;
+        snprintf(why, size, "expected a CPU list such as 0-3,6");
+        return -1;
+    case CONFIG_STRING:
+        return 0;
+    }
+    return 0;
+}
+
+static void config_free(struct config *c)
+{
+    for (size_t i = 0; i < CONFIG_KEYS; i++)
+        free(c->values[i]);
+    free(c->roots_buf);
+    free(c);
+}
+
+/* Values derived from the settings: parsed upload roots and schedule */
+static int config_derive(struct config *c)
+{
+    static const char *const dir_keys[] = {"UPLOAD_DIR", "REPORT_DIR", "BACKUP_DIR"};
+    for (size_t i = 0; i < sizeof(dir_keys) / sizeof(dir_keys[0]); i++)
+    {
+        char *dir = c->values[key_index(dir_keys[i], strlen(dir_keys[i]))];
+        size_t len = dir ? strlen(dir) : 0;
+        while (len > 1 && dir[len - 1] == '/')
+            dir[--len] = '\0';
+    }
+
+    const char *upload_dir = dir_value(startup ? startup : c, "UPLOAD_DIR");
+    c->roots[0] = upload_dir;
+    c->root_count = 1;
+    const char *extra = c->values[key_index("UPLOAD_ROOTS", strlen("UPLOAD_ROOTS"))];
+    if (extra && *extra)
+    {
+        if (!(c->roots_buf = strdup(extra)))
+            return -1;
+        char *save = NULL;
+        for (char *root = strtok_r(c->roots_buf, ":", &save); root && c->root_count < MAX_UPLOAD_ROOTS;
+             root = strtok_r(NULL, ":", &save))
+        {
+            size_t len = strlen(root);
+            while (len > 1 && root[len - 1] == '/')
+                root[--len] = '\0';
+            if (strcmp(root, upload_dir) != 0)
+                c->roots[c->root_count++] = root;
+        }
+    }
+
+    const char *deadline = c->values[key_index("DEADLINE", strlen("DEADLINE"))];
+    if (!deadline || !parse_time(deadline, &c->deadline_hour, &c->deadline_minute))
+    {
+        c->deadline_hour = DEADLINE_HOUR;
+        c->deadline_minute = DEADLINE_MINUTE;
+    }
+    const char *backup = c->values[key_index("BACKUP_TIME", strlen("BACKUP_TIME"))];
+    if (!backup || !parse_time(backup, &c->backup_hour, &c->backup_minute))
+    {
+        c->backup_hour = BACKUP_HOUR;
+        c->backup_minute = BACKUP_MINUTE;
+    }
+    return 0;
+}
+
+static char *trim(char *s)
+{
+    while (isspace((unsigned char)*s))
+        s++;
+    size_t len = strlen(s);
+    while (len > 0 && isspace((unsigned char)s[len - 1]))
+        s[--len] = '\0';
+    return s;
+}
+
+/* Read the file (if any) and the environment into a new snapshot. The file's
+   problems go to errors; invalid environment values only to warnings,
+   since they used to fall back to the default silently. */
+static struct config *config_read(const char *path, struct config_errors *errors, struct config_errors *warnings)
+{
+    struct config *c = calloc(1, sizeof(*c));
+    if (!c)
+    {
+        add_error(errors, "out of memory");
+        return NULL;
+    }
+
+    FILE *fp = path ? fopen(path, "r") : NULL;
+    if (path && !fp && errno != ENOENT)
+        add_error(errors, "%s: %s", path, strerror(errno));
+    char line[CONFIG_LINE_MAX];
+    int line_no = 0;
+    while (fp && fgets(line, sizeof(line), fp))
+    {
+        line_no++;
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+        char *text = trim(line);
+        if (*text == '\0')
+            continue;
+        char *eq = strchr(text, '=');
+        if (!eq)
+        {
+            add_error(errors, "%s:%d: expected NAME = value", path, line_no);
+            continue;
+        }
+        *eq = '\0';
+        char *name = trim(text);
+        char *value = trim(eq + 1);
+        int k = key_index(name, strlen(name));
+        char why[MAX_PATH_BUFFER + 64];
+        if (k == -1)
+            add_error(errors, "%s:%d: unknown setting %s", path, line_no, name);
+        else if (c->values[k])
+            add_error(errors, "%s:%d: %s is set twice", path, line_no, name);
+        else if (check_value(&keys[k], value, why, sizeof(why)) == -1)
+            add_error(errors, "%s:%d: %s: %s", path, line_no, name, why);
+        else if (!(c->values[k] = strdup(value)))
+            add_error(errors, "out of memory");
+    }
+    if (fp)
+        fclose(fp);
+
+    /* The environment overrides the file */
+    for (size_t k = 0; k < CONFIG_KEYS; k++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), CONFIG_PREFIX "%s", keys[k].name);
+        const char *value = getenv(name);
+        if (!value || *value == '\0')
+            continue;
+        char why[MAX_PATH_BUFFER + 64];
+        if (check_value(&keys[k], value, why, sizeof(why)) == -1)
+        {
+            add_error(warnings, "%s in the environment ignored: %s", name, why);
+            continue;
+        }
+        if (c->values[k])
+            add_error(warnings, "%s is set in the environment, the file's value is not used", name);
+        free(c->values[k]);
+        c->values[k] = strdup(value);
+        c->from_env[k] = 1;
+    }
+
+    /* No extra root may overlap UPLOAD_DIR (the one in effect, which a reload does not change) */
+    int roots_key = key_index("UPLOAD_ROOTS", strlen("UPLOAD_ROOTS"));
+    if (c->values[roots_key])
+    {
+        const char *upload_dir = dir_value(startup ? startup : c, "UPLOAD_DIR");
+        char copy[CONFIG_LINE_MAX];
+        snprintf(copy, sizeof(copy), "%s", c->values[roots_key]);
+        char *save = NULL;
+        for (char *root = strtok_r(copy, ":", &save); root; root = strtok_r(NULL, ":", &save))
+        {
+            if (!paths_overlap(root, upload_dir))
+                continue;
+            if (c->from_env[roots_key])
+            {
+                add_error(warnings, CONFIG_PREFIX "UPLOAD_ROOTS in the environment ignored: %s overlaps upload root %s",
+                          root, upload_dir);
+                free(c->values[roots_key]);
+                c->values[roots_key] = NULL;
+            }
+            else
+                add_error(errors, "%s: UPLOAD_ROOTS: %s overlaps upload root %s", path, root, upload_dir);
+            break;
+        }
+    }
+
+    if (config_derive(c) == -1)
+        add_error(errors, "out of memory");
+    if (errors->count > 0)
+    {
+        config_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* The current snapshot; the first caller loads it (falling back to the
+   environment alone if the file is invalid, for the command line tools) */
+static struct config *config_current()
+{
+    struct config *c = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+    if (c)
+        return c;
+    pthread_mutex_lock(&config_lock);
+    if (!current)
+    {
+        struct config_errors errors = {0}, warnings = {0};
+        struct config *loaded = config_read(config_path(), &errors, &warnings);
+        if (!loaded)
+        {
+            errors.count = 0;
+            loaded = config_read(NULL, &errors, &warnings);
+        }
+        __atomic_store_n(&current, loaded, __ATOMIC_RELEASE);
+        __atomic_store_n(&startup, loaded, __ATOMIC_RELEASE);
+    }
+    c = current;
+    pthread_mutex_unlock(&config_lock);
+    return c;
+}
+
+const char *config_get(const char *name)
+{
+    int k = key_index(name, strlen(name));
+    if (k == -1)
+        return getenv(name);
+    struct config *c = config_current();
+    return c ? c->values[k] : getenv(name);
+}
+
+int config_check(FILE *out)
+{
+    struct config_errors errors = {0}, warnings = {0};
+    struct config *c = config_read(config_path(), &errors, &warnings);
+    fputs(errors.text, out);
+    fputs(warnings.text, out);
+    if (c)
+        config_free(c);
+    return errors.count;
+}
+
+/* Log one problem per line of text */
+static void log_lines(const char *type, const char *text)
+{
+    char line[MAX_PATH_BUFFER + 128];
+    while (*text)
+    {
+        size_t n = strcspn(text, "\n");
+        snprintf(line, sizeof(line), "Configuration: %.*s", (int)n, text);
+        log_event(type, "config", line);
+        text += text[n] ? n + 1 : n;
+    }
+}
+
+int config_load()
+{
+    struct config_errors errors = {0}, warnings = {0};
+    struct config *fresh = config_read(config_path(), &errors, &warnings);
+    log_lines("WARNING", warnings.text);
+    if (!fresh)
+    {
+        log_lines("ERROR", errors.text);
+        char msg[MAX_PATH_BUFFER + 96];
+        snprintf(msg, sizeof(msg), "Configuration %s rejected with %d error(s), keeping the current one",
+                 config_path(), errors.count);
+        log_event("ERROR", "config", msg);
+        ipc_send(ipc_default(), "config", 0, msg);
+        return -1;
+    }
+
+    pthread_mutex_lock(&config_lock);
+    struct config *old = current;
+    fresh->retired = old;
+    __atomic_store_n(&current, fresh, __ATOMIC_RELEASE);
+    if (!startup)
+        __atomic_store_n(&startup, fresh, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&config_lock);
+
+    /* Say what changed, and which changes wait for a restart */
+    char changed[512] = "", restart[512] = "";
+    size_t changed_len = 0, restart_len = 0;
+    int set = 0;
+    for (size_t k = 0; k < CONFIG_KEYS; k++)
+    {
+        const char *a = old ? old->values[k] : NULL;
+        const char *b = fresh->values[k];
+        set += b != NULL;
+        if (old && ((a == NULL) != (b == NULL) || (a && strcmp(a, b) != 0)))
+        {
+            if (keys[k].reloadable)
+                changed_len += snprintf(changed + changed_len, sizeof(changed) - changed_len, "%s%s",
+                                        changed_len ? ", " : "", keys[k].name);
+            else
+                restart_len += snprintf(restart + restart_len, sizeof(restart) - restart_len, "%s%s",
+                                        restart_len ? ", " : "", keys[k].name);
+            if (changed_len >= sizeof(changed))
+                changed_len = sizeof(changed) - 1;
+            if (restart_len >= sizeof(restart))
+                restart_len = sizeof(restart) - 1;
+        }
+    }
+
+    char msg[MAX_PATH_BUFFER + 1100];
+    if (!old)
+        snprintf(msg, sizeof(msg), "Configuration loaded from %s: %d setting(s), deadline %02d:%02d, backup %02d:%02d, "
+                                   "%d upload root(s)",
+                 config_path(), set, fresh->deadline_hour, fresh->deadline_minute, fresh->backup_hour,
+                 fresh->backup_minute, fresh->root_count);
+    else
+        snprintf(msg, sizeof(msg), "Configuration reloaded from %s: %s%s", config_path(),
+                 changed_len ? "changed " : "no changes", changed);
+    log_event("INFO", "config", msg);
+    if (old)
+        ipc_send(ipc_default(), "config", 1, msg);
+    if (restart_len)
+    {
+        snprintf(msg, sizeof(msg), "Configuration: %s changed, takes effect at the next restart", restart);
+        log_event("WARNING", "config", msg);
+    }
+    return 0;
+}
+
+int upload_roots(const char **roots, int max)
+{
+    struct config *c = config_current();
+    if (!c)
+    {
+        if (max > 0)
+            roots[0] = UPLOAD_DIR;
+        return max > 0;
+    }
+    int count = c->root_count < max ? c->root_count : max;
+    for (int i = 0; i < count; i++)
+        roots[i] = c->roots[i];
+    return count;
+}
+
+const char *config_dir(const char *name)
+{
+    struct config *c = __atomic_load_n(&startup, __ATOMIC_ACQUIRE);
+    if (!c)
+    {
+        config_current();
+        c = __atomic_load_n(&startup, __ATOMIC_ACQUIRE);
+    }
+    return dir_value(c, name);
+}
+
+void config_deadline(int *hour, int *minute)
+{
+    struct config *c = config_current();
+    *hour = c ? c->deadline_hour : DEADLINE_HOUR;
+    *minute = c ? c->deadline_minute : DEADLINE_MINUTE;
+}
+
+void config_backup_time(int *hour, int *minute)
+{
+    struct config *c = config_current();
+    *hour = c ? c->backup_hour : BACKUP_HOUR;
+    *minute = c ? c->backup_minute : BACKUP_MINUTE;
+}
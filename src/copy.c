@@ -0,0 +1,302 @@
+/* copy.c – File copy engine used by backups.
+ *
+ * Tries the cheapest kernel-side path first and falls back step by step:
+ *   1. FICLONE reflink (btrfs, xfs, ...): shares extents, no data is copied
+ *   2. copy_file_range(): in-kernel copy, may be offloaded by the filesystem
+ *   3. sendfile(): in-kernel copy through the page cache
+ *   4. read()/write() with a large userspace buffer
+ * The strategy that worked is remembered per (source fs, destination fs) pair
+ * so later copies skip the probes that are known to fail. Data is paced
+ * through throttle_wait() when the calling thread belongs to a backup run.
+ */
+
+#define _GNU_SOURCE
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define COPY_CHUNK_SIZE (64L * 1024 * 1024) // per copy_file_range()/sendfile() call
+#define COPY_CACHE_SLOTS 16
+
+static const char *strategy_names[] = {"reflink", "copy_file_range", "sendfile", "userspace"};
+
+struct strategy_cache_entry
+{
+    dev_t src_dev;
+    dev_t dst_dev;
+    int strategy;
+    int used;
+};
+
+static struct strategy_cache_entry strategy_cache[COPY_CACHE_SLOTS];
+static int strategy_cache_next = 0;
+static pthread_mutex_t strategy_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *copy_strategy_name(int strategy)
+{
+    if (strategy < COPY_REFLINK || strategy > COPY_USERSPACE)
+        return "unknown";
+    return strategy_names[strategy];
+}
+
+static int cached_strategy(dev_t src_dev, dev_t dst_dev)
+{
+    int strategy = COPY_REFLINK;
+    pthread_mutex_lock(&strategy_cache_lock);
+    for (int i = 0; i < COPY_CACHE_SLOTS; i++)
+    {
+        if (strategy_cache[i].used && strategy_cache[i].src_dev == src_dev &&
+            strategy_cache[i].dst_dev == dst_dev)
+        {
+            strategy = strategy_cache[i].strategy;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&strategy_cache_lock);
+    return strategy;
+}
+
+static void remember_strategy(dev_t src_dev, dev_t dst_dev, int strategy)
+{
+    pthread_mutex_lock(&strategy_cache_lock);
+    struct strategy_cache_entry *slot = NULL;
+    for (int i = 0; i < COPY_CACHE_SLOTS; i++)
+    {
+        if (strategy_cache[i].used && strategy_cache[i].src_dev == src_dev &&
+            strategy_cache[i].dst_dev == dst_dev)
+        {
+            slot = &strategy_cache[i];
+            break;
+        }
+    }
+    if (!slot)
+    {
+        // Round-robin replacement; there are only ever a handful of filesystem pairs
+        slot = &strategy_cache[strategy_cache_next];
+        strategy_cache_next = (strategy_cache_next + 1) % COPY_CACHE_SLOTS;
+    }
+    if (!slot->used || slot->strategy != strategy)
+    {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Copy engine using %s for device %lu -> %lu",
+                 copy_strategy_name(strategy), (unsigned long)src_dev, (unsigned long)dst_dev);
+        log_message("INFO", msg);
+    }
+    slot->src_dev = src_dev;
+    slot->dst_dev = dst_dev;
+    slot->strategy = strategy;
+    slot->used = 1;
+    pthread_mutex_unlock(&strategy_cache_lock);
+}
+
+/* Errors meaning "this mechanism does not work here", as opposed to I/O errors */
+static int is_unsupported(int err)
+{
+    return err == EOPNOTSUPP || err == ENOTTY || err == EXDEV || err == EINVAL ||
+           err == ENOSYS || err == EPERM || err == ENOTSUP || err == EBADF;
+}
+
+/* Each strategy returns 0 on success, 1 if it is unsupported and nothing was
+   written yet (so the next one can be tried), and -1 on a real error. */
+static int copy_reflink(int in, int out)
+{
+    if (ioctl(out, FICLONE, in) == 0)
+        return 0;
+    return is_unsupported(errno) ? 1 : -1;
+}
+
+static int copy_range(int in, int out, off_t size)
+{
+    off_t done = 0;
+    while (done < size)
+    {
+        size_t chunk = throttle_chunk(size - done > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : size - done);
+        ssize_t n = copy_file_range(in, NULL, out, NULL, chunk, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return (done == 0 && is_unsupported(errno)) ? 1 : -1;
+        }
+        if (n == 0)
+        {
+            errno = EIO; // source shrank underneath us: never publish a short copy
+            return -1;
+        }
+        done += n;
+        throttle_wait(n);
+    }
+    return 0;
+}
+
+static int copy_sendfile(int in, int out, off_t size)
+{
+    off_t done = 0;
+    while (done < size)
+    {
+        size_t chunk = throttle_chunk(size - done > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : size - done);
+        ssize_t n = sendfile(out, in, NULL, chunk);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return (done == 0 && is_unsupported(errno)) ? 1 : -1;
+        }
+        if (n == 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+        done += n;
+        throttle_wait(n);
+    }
+    return 0;
+}
+
+static int copy_userspace(int in, int out, off_t size)
+{
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (!buffer)
+        return -1;
+
+    int ret = 0;
+    off_t done = 0;
+    ssize_t bytes;
+    while ((bytes = read(in, buffer, throttle_chunk(COPY_BUFFER_SIZE))) != 0)
+    {
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ret = -1;
+            break;
+        }
+        ssize_t off = 0;
+        while (off < bytes)
+        {
+            ssize_t n = write(out, buffer + off, bytes - off);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                ret = -1;
+                break;
+            }
+            off += n;
+        }
+        if (ret == -1)
+            break;
+        done += bytes;
+        throttle_wait(bytes);
+    }
+    free(buffer);
+    if (ret == 0 && done < size)
+    {
+        errno = EIO; // source shrank underneath us: never publish a short copy
+        ret = -1;
+    }
+    return ret;
+}
+
+// Function to copy a file from src to dst, keeping its mode and mtime
+int copy_file_ex(const char *src, const char *dst, int *strategy_used)
+{
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        char err[256];
+        snprintf(err, sizeof(err), "Failed to open source file %s: %s", src, strerror(errno));
+        log_message("ERROR", err);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(in, &st) == -1)
+    {
+        char err[256];
+        snprintf(err, sizeof(err), "Failed to stat source file %s: %s", src, strerror(errno));
+        log_message("ERROR", err);
+        close(in);
+        return -1;
+    }
+
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+    if (out < 0)
+    {
+        char err[256];
+        snprintf(err, sizeof(err), "Failed to open destination file %s: %s", dst, strerror(errno));
+        log_message("ERROR", err);
+        close(in);
+        return -1;
+    }
+
+    struct stat dst_st;
+    dev_t dst_dev = fstat(out, &dst_st) == 0 ? dst_st.st_dev : 0;
+    int strategy = cached_strategy(st.st_dev, dst_dev);
+    int rc = 1;
+
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (rc == 1 && strategy <= COPY_USERSPACE)
+    {
+        switch (strategy)
+        {
+        case COPY_REFLINK:
+            rc = copy_reflink(in, out);
+            break;
+        case COPY_RANGE:
+            rc = copy_range(in, out, st.st_size);
+            break;
+        case COPY_SENDFILE:
+            rc = copy_sendfile(in, out, st.st_size);
+            break;
+        default:
+            rc = copy_userspace(in, out, st.st_size);
+            break;
+        }
+        if (rc == 1)
+            strategy++;
+    }
+
+    if (rc == 0)
+    {
+        remember_strategy(st.st_dev, dst_dev, strategy);
+
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        if (fchmod(out, st.st_mode & 07777) == -1 || futimens(out, times) == -1)
+        {
+            char err[256];
+            snprintf(err, sizeof(err), "Failed to preserve attributes on %s: %s", dst, strerror(errno));
+            log_message("WARNING", err);
+        }
+    }
+    else
+    {
+        char err[256];
+        snprintf(err, sizeof(err), "Error writing data during file copy (%s): %s",
+                 copy_strategy_name(strategy), strerror(errno));
+        log_message("ERROR", err);
+    }
+
+    close(in);
+    if (close(out) == -1 && rc == 0)
+    {
+        char err[256];
+        snprintf(err, sizeof(err), "Failed to close destination file %s: %s", dst, strerror(errno));
+        log_message("ERROR", err);
+        rc = -1;
+    }
+
+    if (strategy_used)
+        *strategy_used = strategy;
+    return rc == 0 ? 0 : -1;
+}
+
+int copy_file(const char *src, const char *dst)
+{
+    return copy_file_ex(src, dst, NULL);
+}
@@ -8,27 +8,29 @@
 #include <string.h>
 #include <errno.h>
 #include <mqueue.h>
-#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <stdint.h>
 
 #define PID_FILE "/tmp/report_daemon.pid"
+#define MAX_EVENTS 8
 
-volatile sig_atomic_t backup_requested = 0;
-
-/* Signal handler for SIGUSR1 - sets a flag to trigger manual backup */
-void handle_signal(int sig)
+/* Signals delivered through the main loop's signalfd instead of handlers */
+static void daemon_signal_set(sigset_t *set)
 {
-    if (sig == SIGUSR1)
-    {
-        log_message("INFO", "SIGUSR1 received: scheduling manual backup");
-        backup_requested = 1;
-    }
+    sigemptyset(set);
+    sigaddset(set, SIGUSR1);
+    sigaddset(set, SIGUSR2);
+    sigaddset(set, SIGHUP);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGINT);
 }
 
-/* Signal handler for SIGCHLD - reap zombie processes */
-void handle_child(int sig)
+static int add_to_epoll(int epfd, int fd)
 {
-    while (waitpid(-1, NULL, WNOHANG) > 0)
-        ;
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
 }
 
 /* Write the daemon's PID to a file so that the client mode can find it */
@@ -47,8 +49,9 @@ void write_pid_file()
     }
 }
 
-/* Client mode: read the PID file and send SIGUSR1 to trigger manual backup */
-int send_signal_to_daemon(const char *pid_file)
+/* Client mode: read the PID file and send sig (SIGUSR1: manual backup,
+   SIGUSR2: reconcile the upload roots) */
+int send_signal_to_daemon(const char *pid_file, int sig, const char *what)
 {
     FILE *fp = fopen(pid_file, "r");
     if (!fp)
@@ -64,12 +67,13 @@ int send_signal_to_daemon(const char *pid_file)
         return -1;
     }
     fclose(fp);
-    if (kill(pid, SIGUSR1) == -1)
+    const char *sig_name = sig == SIGUSR1 ? "SIGUSR1" : "SIGUSR2";
+    if (kill(pid, sig) == -1)
     {
-        fprintf(stderr, "Failed to send SIGUSR1 to PID %d: %s\n", pid, strerror(errno));
+        fprintf(stderr, "Failed to send %s to PID %d: %s\n", sig_name, pid, strerror(errno));
         return -1;
     }
-    printf("Sent SIGUSR1 to daemon (PID %d) to trigger manual backup.\n", pid);
+    printf("Sent %s to daemon (PID %d) to trigger %s.\n", sig_name, pid, what);
     return 0;
 }
 
@@ -102,16 +106,30 @@ void make_daemon()
     close(STDIN_FILENO);
     close(STDOUT_FILENO);
     close(STDERR_FILENO);
-
-    // Set up signal handlers after daemonizing
-    signal(SIGCHLD, handle_child);
-    signal(SIGUSR1, handle_signal);
 }
 
 static void cleanup(void)
 {
     unlink(PID_FILE);
     log_message("INFO", "Daemon shutting down, cleaned up PID file");
+    ipc_shutdown();
+    log_flush();
+}
+
+/* Arm the deadline and backup timers (-1 skips one) for the configured times */
+static void arm_schedule(int deadline_tfd, int backup_tfd)
+{
+    int hour, minute;
+    if (deadline_tfd != -1)
+    {
+        config_deadline(&hour, &minute);
+        daily_timer_arm(deadline_tfd, hour, minute);
+    }
+    if (backup_tfd != -1)
+    {
+        config_backup_time(&hour, &minute);
+        daily_timer_arm(backup_tfd, hour, minute);
+    }
 }
 
 int main(int argc, char *argv[])
@@ -119,15 +137,77 @@ int main(int argc, char *argv[])
     /* If a command-line argument "manual-backup" is provided, run in client mode */
     if (argc > 1 && strcmp(argv[1], "manual-backup") == 0)
     {
-        if (send_signal_to_daemon(PID_FILE) == 0)
+        if (send_signal_to_daemon(PID_FILE, SIGUSR1, "manual backup") == 0)
             return 0;
         else
             return EXIT_FAILURE;
     }
 
+    /* "reconcile" makes the running daemon rescan the upload roots for missed events */
+    if (argc > 1 && strcmp(argv[1], "reconcile") == 0)
+        return send_signal_to_daemon(PID_FILE, SIGUSR2, "upload reconciliation") == 0 ? 0 : EXIT_FAILURE;
+
+    /* "missing" lists the expected reports that have not arrived yet this cycle */
+    if (argc > 1 && strcmp(argv[1], "missing") == 0)
+        return list_missing_reports() == 0 ? 0 : EXIT_FAILURE;
+
+    /* "verify-backup [YYYY-MM-DD]" re-hashes a backup against its manifest */
+    if (argc > 1 && strcmp(argv[1], "verify-backup") == 0)
+    {
+        char date_dir[64];
+        char backup_date_dir[MAX_PATH_BUFFER];
+        if (argc > 2)
+            snprintf(date_dir, sizeof(date_dir), "%s", argv[2]);
+        else
+            get_date_string(date_dir, sizeof(date_dir));
+        snprintf(backup_date_dir, sizeof(backup_date_dir), "%s/%s", BACKUP_DIR, date_dir);
+        return manifest_verify(backup_date_dir) == 0 ? 0 : EXIT_FAILURE;
+    }
+
+    /* "catalog date YYYY-MM-DD | dept NAME | rebuild" queries the report catalog */
+    if (argc > 1 && strcmp(argv[1], "catalog") == 0)
+    {
+        if (argc > 2 && strcmp(argv[2], "rebuild") == 0)
+        {
+            int count = catalog_rebuild();
+            if (count >= 0)
+                printf("%d entries indexed\n", count);
+            return count >= 0 ? 0 : EXIT_FAILURE;
+        }
+        if (argc < 4)
+        {
+            fprintf(stderr, "Usage: %s catalog date YYYY-MM-DD | dept NAME | rebuild\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return catalog_query(argv[2], argv[3]) > 0 ? 0 : EXIT_FAILURE;
+    }
+
+    /* "log-dump [--from TIME] [--to TIME] [--type NAME]" decodes the binary log */
+    if (argc > 1 && strcmp(argv[1], "log-dump") == 0)
+        return binlog_dump(argc - 2, argv + 2) == 0 ? 0 : EXIT_FAILURE;
+
+    /* "check-config" validates the configuration file without starting */
+    if (argc > 1 && strcmp(argv[1], "check-config") == 0)
+        return config_check(stderr) == 0 ? 0 : EXIT_FAILURE;
+
+    /* Refuse to start with an invalid configuration while stderr is still a terminal */
+    if (config_check(stderr) > 0)
+    {
+        fprintf(stderr, "Not starting: fix the configuration or run %s check-config\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
     /* Daemonize first */
     make_daemon();
 
+    /* Block the signals we handle before any thread exists, so every thread
+       inherits the mask and they are only ever consumed by the signalfd */
+    sigset_t handled;
+    daemon_signal_set(&handled);
+    sigprocmask(SIG_BLOCK, &handled, NULL);
+
+    config_load(); // logs, which starts the logger thread: only now that the mask is set
+
     /* Initialize the POSIX message queue for IPC */
     mqd_t mq = init_msg_queue();
     if (mq == (mqd_t)-1)
@@ -139,67 +219,192 @@ int main(int argc, char *argv[])
         close_msg_queue(mq);
     }
 
+    /* Optional shared-memory transport, created before any process publishes */
+    if (ipc_transport() == IPC_TRANSPORT_SHM)
+    {
+        struct shm_ring *ring = shm_ring_create(SHM_RING_NAME);
+        if (ring)
+        {
+            log_message("INFO", "Using shared-memory event ring " SHM_RING_NAME " for IPC");
+            shm_ring_detach(ring); // each process attaches through its own IPC context
+        }
+        else
+        {
+            log_message("ERROR", "Failed to create shared-memory event ring");
+        }
+    }
+
     log_message("INFO", "Daemon started");
 
     /* Write PID file after daemonization */
     write_pid_file();
 
-    time_t last_missing_check = 0;
-    time_t last_backup_check = 0;
+    /* Start the upload watcher and its workers after the daemon is fully initialized */
+    if (pipeline_start() == -1)
+        return EXIT_FAILURE;
+
+    /* Set up cleanup handler */
+    atexit(cleanup);
 
-    /* Fork monitor process after daemon is fully initialized */
-    pid_t monitor_pid = fork();
-    if (monitor_pid == 0)
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    int sigfd = signalfd(-1, &handled, SFD_CLOEXEC | SFD_NONBLOCK);
+    int deadline_tfd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+    int backup_tfd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+    int backup_done_fd = backup_event_fd();
+    if (epfd == -1 || sigfd == -1 || deadline_tfd == -1 || backup_tfd == -1 || backup_done_fd == -1 ||
+        add_to_epoll(epfd, sigfd) == -1 || add_to_epoll(epfd, deadline_tfd) == -1 ||
+        add_to_epoll(epfd, backup_tfd) == -1 || add_to_epoll(epfd, backup_done_fd) == -1)
     {
-        monitor_directory();
-        exit(EXIT_SUCCESS);
+        char err[256];
+        snprintf(err, sizeof(err), "Failed to set up main event loop: %s", strerror(errno));
+        log_message("ERROR", err);
+        pipeline_stop();
+        return EXIT_FAILURE;
     }
-    else if (monitor_pid < 0)
+
+    arm_schedule(deadline_tfd, backup_tfd);
+
+    /* A backup cut short by a crash or restart continues from its journal */
+    char interrupted[1][16];
+    if (journal_pending(interrupted, 1) > 0)
     {
-        log_message("ERROR", "Failed to fork monitor process");
-        return EXIT_FAILURE;
+        log_message("INFO", "Found an interrupted backup, resuming it");
+        start_resume();
     }
 
-    /* Set up cleanup handler */
-    atexit(cleanup);
+    int unlock_pending = 0;    // directories stay locked until the running backup ends
+    int scheduled_pending = 0; // scheduled backup fired while another backup was running
+    int manual_pending = 0;    // SIGUSR1 arrived while another backup was running
+    int running = 1;
 
-    /* Main daemon loop */
-    while (1)
+    /* Main daemon loop: sleeps in epoll_wait until a timer, signal or backup completion */
+    while (running || backup_in_progress())
     {
-        time_t now = time(NULL);
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            log_message("ERROR", "epoll_wait failed in main loop");
+            break;
+        }
 
-        /* Check for missing reports at 23:30 */
-        if (is_time(23, 30) && (now - last_missing_check) > 60)
+        for (int i = 0; i < n; i++)
         {
-            log_message("INFO", "Checking for missing reports at deadline");
-            lock_directories();
-            check_missing_reports();
-            last_missing_check = now;
-            // Don't unlock - directories stay locked until backup at 1am
+            int fd = events[i].data.fd;
+
+            if (fd == sigfd)
+            {
+                struct signalfd_siginfo info;
+                while (read(sigfd, &info, sizeof(info)) == sizeof(info))
+                {
+                    switch (info.ssi_signo)
+                    {
+                    case SIGUSR1:
+                        log_message("INFO", "SIGUSR1 received: scheduling manual backup");
+                        manual_pending = 1;
+                        break;
+                    case SIGUSR2:
+                        log_message("INFO", "SIGUSR2 received: reconciling the upload roots");
+                        if (pipeline_control(PIPELINE_RECONCILE) == -1)
+                            log_message("ERROR", "Upload watcher not running, cannot reconcile");
+                        break;
+                    case SIGHUP:
+                        log_message("INFO", "SIGHUP received: reopening log file and reloading configuration");
+                        log_reopen();
+                        if (config_load() == 0)
+                        {
+                            arm_schedule(deadline_tfd, backup_tfd);
+                            if (pipeline_control(PIPELINE_RECONFIGURE) == -1)
+                                log_message("WARNING", "Upload watcher not running, upload roots not reconfigured");
+                        }
+                        break;
+                    case SIGTERM:
+                    case SIGINT:
+                        log_message("INFO", "Termination requested, stopping daemon");
+                        running = 0;
+                        manual_pending = 0;
+                        scheduled_pending = 0;
+                        break;
+                    }
+                }
+            }
+            else if (fd == deadline_tfd)
+            {
+                /* Check for missing reports at the deadline */
+                if (daily_timer_read(deadline_tfd) == 1)
+                {
+                    log_message("INFO", "Checking for missing reports at deadline");
+                    if (!snapshot_enabled())
+                        lock_directories(); // stay locked until the scheduled backup ends
+                    // The watcher owns the presence index; only without it do the scan here
+                    if (pipeline_control(PIPELINE_CHECK_MISSING) == -1)
+                        check_missing_reports();
+                }
+                arm_schedule(deadline_tfd, -1);
+            }
+            else if (fd == backup_tfd)
+            {
+                if (daily_timer_read(backup_tfd) == 1)
+                    scheduled_pending = 1;
+                arm_schedule(-1, backup_tfd);
+            }
+            else if (fd == backup_done_fd)
+            {
+                /* Background backup finished */
+                uint64_t count;
+                int status;
+                if (read(backup_done_fd, &count, sizeof(count)) > 0 && backup_poll(&status))
+                {
+                    if (unlock_pending)
+                    {
+                        unlock_directories();
+                        unlock_pending = 0;
+                    }
+                    ipc_flush(ipc_default());
+                    log_flush();
+                }
+            }
         }
 
-        /* Scheduled backup at 1:00 */
-        if (is_time(1, 0) && (now - last_backup_check) > 60)
+        if (!running || backup_in_progress())
+            continue;
+
+        /* Scheduled backup, run in the background so signals are still handled */
+        if (scheduled_pending)
         {
+            scheduled_pending = 0;
             log_message("INFO", "Starting scheduled backup");
-            perform_backup();
-            unlock_directories(); // Only unlock after backup
-            last_backup_check = now;
-            sleep(60); // Sleep for a minute to avoid multiple triggers
+            if (snapshot_enabled())
+                start_backup(); // locks only while taking its snapshot
+            else if (start_backup() == 0)
+                unlock_pending = 1; // Only unlock after backup
+            else
+                unlock_directories();
         }
-
         /* Manual backup triggered by SIGUSR1 */
-        if (backup_requested)
+        else if (manual_pending)
         {
+            manual_pending = 0;
             log_message("INFO", "Performing manual backup as requested");
-            lock_directories();
-            perform_backup();
-            unlock_directories();
-            backup_requested = 0;
+            if (snapshot_enabled())
+                start_backup();
+            else
+            {
+                lock_directories();
+                if (start_backup() == 0)
+                    unlock_pending = 1;
+                else
+                    unlock_directories();
+            }
         }
-
-        sleep(1); // Check every second
     }
 
+    pipeline_stop();
+    close(backup_tfd);
+    close(deadline_tfd);
+    close(sigfd);
+    close(epfd);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,342 @@
+/* departments.c – Expected department reports and presence scanning */
+
+#define _GNU_SOURCE
+#include "utils.h"
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+
+/*
+ * The set of expected reports is read from DEPT_LIST_FILE (one department
+ * or report file name per line, '#' starts a comment) into an
+ * open-addressing hash set, so checking a directory entry is one hash probe
+ * however many departments there are. Without the file the built-in
+ * FILE_PREFIX1..FILE_PREFIX<DEPT_COUNT> names are expected.
+ *
+ * Presence is established by reading whole directories with getdents64()
+ * into a large buffer and setting one bit per expected report found, rather
+ * than issuing one access() per department.
+ */
+
+#define DEPT_SCAN_BUFFER (256 * 1024)
+#define DEPT_SCAN_MAX_DEPTH 16
+
+struct dept_set
+{
+    int count;
+    char **names;        // report file names, e.g. "dept1.xml"
+    uint32_t *table;     // index + 1, 0 = empty
+    uint32_t capacity;   // power of two, at least twice count
+    struct timespec mtime; // of DEPT_LIST_FILE when loaded (0 for the built-in set)
+    ino_t inode;
+    uint64_t fingerprint; // hash of the names in index order
+};
+
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static struct dept_set *current_set = NULL;
+
+static uint32_t dept_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int dept_set_find(const struct dept_set *set, const char *name, size_t len)
+{
+    uint32_t mask = set->capacity - 1;
+    for (uint32_t idx = dept_hash(name, len) & mask;; idx = (idx + 1) & mask)
+    {
+        uint32_t entry = set->table[idx];
+        if (entry == 0)
+            return -1;
+        const char *candidate = set->names[entry - 1];
+        if (strncmp(candidate, name, len) == 0 && candidate[len] == '\0')
+            return entry - 1;
+    }
+}
+
+int dept_set_count(const struct dept_set *set)
+{
+    return set->count;
+}
+
+const char *dept_set_name(const struct dept_set *set, int index)
+{
+    return set->names[index];
+}
+
+uint64_t dept_set_fingerprint(const struct dept_set *set)
+{
+    return set->fingerprint;
+}
+
+static void dept_set_free(struct dept_set *set)
+{
+    if (!set)
+        return;
+    for (int i = 0; i < set->count; i++)
+        free(set->names[i]);
+    free(set->names);
+    free(set->table);
+    free(set);
+}
+
+/* Add a report name unless already present; the table must have room */
+static int dept_set_add(struct dept_set *set, const char *name)
+{
+    size_t len = strlen(name);
+    uint32_t mask = set->capacity - 1;
+    uint32_t idx = dept_hash(name, len) & mask;
+    while (set->table[idx] != 0)
+    {
+        if (strcmp(set->names[set->table[idx] - 1], name) == 0)
+            return 0;
+        idx = (idx + 1) & mask;
+    }
+    set->names[set->count] = strdup(name);
+    if (!set->names[set->count])
+        return -1;
+    set->table[idx] = ++set->count;
+    return 0;
+}
+
+static struct dept_set *dept_set_build(char **names, int count)
+{
+    struct dept_set *set = calloc(1, sizeof(*set));
+    if (!set)
+        return NULL;
+    set->capacity = 16;
+    while (set->capacity < (uint32_t)count * 2)
+        set->capacity <<= 1;
+    set->names = calloc(count > 0 ? count : 1, sizeof(char *));
+    set->table = calloc(set->capacity, sizeof(uint32_t));
+    if (!set->names || !set->table)
+    {
+        dept_set_free(set);
+        return NULL;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (dept_set_add(set, names[i]) == -1)
+        {
+            dept_set_free(set);
+            return NULL;
+        }
+    }
+
+    // Lets other processes check that an index refers to the same list
+    uint64_t h = 1469598103934665603ULL;
+    for (int i = 0; i < set->count; i++)
+    {
+        for (const char *c = set->names[i]; *c; c++)
+            h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+        h = (h ^ '\n') * 1099511628211ULL;
+    }
+    set->fingerprint = h;
+    return set;
+}
+
+/* Built-in list used when DEPT_LIST_FILE does not exist */
+static struct dept_set *dept_set_builtin()
+{
+    char *names[DEPT_COUNT];
+    char storage[DEPT_COUNT][64];
+    for (int i = 0; i < DEPT_COUNT; i++)
+    {
+        snprintf(storage[i], sizeof(storage[i]), "%s%d.xml", FILE_PREFIX, i + 1);
+        names[i] = storage[i];
+    }
+    return dept_set_build(names, DEPT_COUNT);
+}
+
+static struct dept_set *dept_set_load(const char *path, const struct stat *st)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return NULL;
+
+    char **names = NULL;
+    int count = 0, capacity = 0, failed = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    while (!failed && getline(&line, &line_size, fp) != -1)
+    {
+        char *start = line;
+        char *hash = strchr(start, '#');
+        if (hash)
+            *hash = '\0';
+        while (*start == ' ' || *start == '\t')
+            start++;
+        size_t len = strcspn(start, " \t\r\n");
+        if (len == 0)
+            continue;
+        start[len] = '\0';
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            char **grown = realloc(names, capacity * sizeof(char *));
+            if (!grown)
+            {
+                failed = 1;
+                break;
+            }
+            names = grown;
+        }
+        // Departments may be listed by name or by report file name
+        size_t name_len = len + 5;
+        names[count] = malloc(name_len);
+        if (!names[count])
+        {
+            failed = 1;
+            break;
+        }
+        if (len > 4 && strcmp(start + len - 4, ".xml") == 0)
+            snprintf(names[count], name_len, "%s", start);
+        else
+            snprintf(names[count], name_len, "%s.xml", start);
+        count++;
+    }
+    free(line);
+    fclose(fp);
+
+    struct dept_set *set = failed ? NULL : dept_set_build(names, count);
+    for (int i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    if (set)
+    {
+        set->mtime = st->st_mtim;
+        set->inode = st->st_ino;
+    }
+    return set;
+}
+
+struct dept_set *dept_set_get()
+{
+    const char *path = config_get("REPORT_DAEMON_DEPARTMENTS");
+    if (!path || *path == '\0')
+        path = DEPT_LIST_FILE;
+
+    struct stat st;
+    if (stat(path, &st) == -1)
+    {
+        if (!current_set || current_set->inode != 0)
+        {
+            char msg[MAX_PATH_BUFFER + 64];
+            snprintf(msg, sizeof(msg), "No department list at %s, expecting %d built-in reports", path, DEPT_COUNT);
+            log_message("INFO", msg);
+            dept_set_free(current_set);
+            current_set = dept_set_builtin();
+        }
+        return current_set;
+    }
+
+    if (current_set && current_set->inode == st.st_ino &&
+        current_set->mtime.tv_sec == st.st_mtim.tv_sec && current_set->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        return current_set;
+
+    struct dept_set *loaded = dept_set_load(path, &st);
+    if (!loaded)
+    {
+        char msg[MAX_PATH_BUFFER + 64];
+        snprintf(msg, sizeof(msg), "Failed to load department list %s: %s", path, strerror(errno));
+        log_message("ERROR", msg);
+        return current_set; // keep using the previous list
+    }
+    dept_set_free(current_set);
+    current_set = loaded;
+
+    char msg[MAX_PATH_BUFFER + 64];
+    snprintf(msg, sizeof(msg), "Loaded %d departments from %s", loaded->count, path);
+    log_message("INFO", msg);
+    return current_set;
+}
+
+/* Mark expected reports found in dirfd and below; subdirectories are read
+   after the directory itself so one buffer serves the whole walk */
+static int scan_dir(const struct dept_set *set, int dirfd, char *buf, uint64_t *present, int depth)
+{
+    char **subdirs = NULL;
+    int sub_count = 0, sub_capacity = 0, found = 0;
+
+    long n;
+    while ((n = syscall(SYS_getdents64, dirfd, buf, DEPT_SCAN_BUFFER)) > 0)
+    {
+        for (long off = 0; off < n;)
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+            off += d->d_reclen;
+            if (d->d_name[0] == '.')
+                continue;
+
+            if (d->d_type == DT_DIR)
+            {
+                if (depth >= DEPT_SCAN_MAX_DEPTH)
+                    continue;
+                if (sub_count == sub_capacity)
+                {
+                    sub_capacity = sub_capacity ? sub_capacity * 2 : 16;
+                    char **grown = realloc(subdirs, sub_capacity * sizeof(char *));
+                    if (!grown)
+                        continue;
+                    subdirs = grown;
+                }
+                if ((subdirs[sub_count] = strdup(d->d_name)) != NULL)
+                    sub_count++;
+                continue;
+            }
+
+            int idx = dept_set_find(set, d->d_name, strlen(d->d_name));
+            if (idx >= 0 && !(present[idx / 64] & (1ULL << (idx % 64))))
+            {
+                present[idx / 64] |= 1ULL << (idx % 64);
+                found++;
+            }
+        }
+    }
+
+    for (int i = 0; i < sub_count; i++)
+    {
+        int fd = openat(dirfd, subdirs[i], O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd != -1)
+        {
+            found += scan_dir(set, fd, buf, present, depth + 1);
+            close(fd);
+        }
+        free(subdirs[i]);
+    }
+    free(subdirs);
+    return found;
+}
+
+int dept_mark_present(const struct dept_set *set, const char *dir, uint64_t *present)
+{
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    char *buf = malloc(DEPT_SCAN_BUFFER);
+    if (!buf)
+    {
+        close(fd);
+        return -1;
+    }
+    int found = scan_dir(set, fd, buf, present, 0);
+    free(buf);
+    close(fd);
+    return found;
+}
@@ -0,0 +1,288 @@
+/* enrich.c – Attach owner and stat metadata to upload events */
+
+#define _GNU_SOURCE // O_PATH
+#include "utils.h"
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pwd.h>
+#include <pthread.h>
+
+/*
+ * Event enrichment.
+ *
+ * Files are stat'ed with fstatat() relative to a small LRU of directory fds
+ * instead of resolving the full path each time (dir_cache_at() offers the
+ * same held fds to other *at() operations), and owners are resolved
+ * through a bounded uid -> name cache. getpwuid() may go to NSS/LDAP and cost
+ * milliseconds per call, so both successful and failed lookups are cached
+ * (failures for a shorter time). With a handful of uploader accounts the
+ * passwd database is consulted once per account per OWNER_CACHE_TTL.
+ */
+
+#define DIR_CACHE_SLOTS 16
+#define OWNER_CACHE_SLOTS 256 // power of two
+#define OWNER_CACHE_PROBE 8   // slots searched before evicting
+
+#define OWNER_EMPTY 0
+#define OWNER_KNOWN 1
+#define OWNER_UNKNOWN 2 // negative entry: uid has no passwd record (or lookup failed)
+
+struct dir_slot
+{
+    char *dir;
+    int fd;
+    unsigned long used; // LRU clock
+};
+
+struct owner_slot
+{
+    int state;
+    uid_t uid;
+    time_t expires; // CLOCK_MONOTONIC seconds
+    char name[64];
+};
+
+static pthread_mutex_t enrich_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dir_slot dirs[DIR_CACHE_SLOTS];
+static unsigned long dir_clock = 0;
+static struct owner_slot owners[OWNER_CACHE_SLOTS];
+static unsigned long owner_hits = 0, owner_misses = 0, owner_negative = 0;
+
+static time_t monotonic_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* Cache slot of dir, NULL if it is not cached. Caller must hold enrich_lock. */
+static struct dir_slot *dir_find_locked(const char *dir)
+{
+    for (int i = 0; i < DIR_CACHE_SLOTS; i++)
+        if (dirs[i].dir && strcmp(dirs[i].dir, dir) == 0)
+            return &dirs[i];
+    return NULL;
+}
+
+/* Private duplicate of dir's cached O_PATH fd, opening dir (and evicting the
+   least recently used) if needed; the caller closes it. The lock is held only
+   to look up and duplicate, so a slow operation on one directory does not
+   stall the others. *cached receives the cache's own fd for dir_forget(). */
+static int dir_fd(const char *dir, int *cached)
+{
+    pthread_mutex_lock(&enrich_lock);
+    struct dir_slot *slot = dir_find_locked(dir);
+    if (slot)
+    {
+        slot->used = ++dir_clock;
+        *cached = slot->fd;
+        int fd = fcntl(slot->fd, F_DUPFD_CLOEXEC, 0);
+        pthread_mutex_unlock(&enrich_lock);
+        return fd;
+    }
+    pthread_mutex_unlock(&enrich_lock);
+
+    int fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    char *copy = strdup(dir);
+    if (!copy)
+    {
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&enrich_lock);
+    slot = dir_find_locked(dir);
+    if (slot)
+    {
+        // Another thread cached it meanwhile: use theirs
+        close(fd);
+        free(copy);
+    }
+    else
+    {
+        slot = &dirs[0];
+        for (int i = 0; i < DIR_CACHE_SLOTS; i++)
+        {
+            if (!dirs[i].dir)
+                slot = &dirs[i];
+            else if (slot->dir && dirs[i].used < slot->used)
+                slot = &dirs[i];
+        }
+        if (slot->dir)
+        {
+            close(slot->fd);
+            free(slot->dir);
+        }
+        slot->dir = copy;
+        slot->fd = fd;
+    }
+    slot->used = ++dir_clock;
+    *cached = slot->fd;
+    fd = fcntl(slot->fd, F_DUPFD_CLOEXEC, 0);
+    pthread_mutex_unlock(&enrich_lock);
+    return fd;
+}
+
+/* Forget dir's cached fd, e.g. after the directory was removed and recreated;
+   a slot already reopened by another thread (a different fd) is kept */
+static void dir_forget(const char *dir, int cached)
+{
+    pthread_mutex_lock(&enrich_lock);
+    struct dir_slot *slot = dir_find_locked(dir);
+    if (slot && slot->fd == cached)
+    {
+        close(slot->fd);
+        free(slot->dir);
+        slot->dir = NULL;
+    }
+    pthread_mutex_unlock(&enrich_lock);
+}
+
+/* Cached name of uid into username, 0 if found. Caller must hold enrich_lock. */
+static int owner_find_locked(uid_t uid, time_t now, char *username, size_t size)
+{
+    unsigned long idx = ((unsigned long)uid * 2654435761UL) & (OWNER_CACHE_SLOTS - 1);
+    for (int probe = 0; probe < OWNER_CACHE_PROBE; probe++)
+    {
+        struct owner_slot *slot = &owners[(idx + probe) & (OWNER_CACHE_SLOTS - 1)];
+        if (slot->state != OWNER_EMPTY && slot->uid == uid && slot->expires > now)
+        {
+            snprintf(username, size, "%s", slot->name);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Resolve uid to a name through the cache. The NSS lookup runs without
+   enrich_lock, so one slow LDAP answer does not stall every other worker. */
+static void owner_name(uid_t uid, char *username, size_t size)
+{
+    time_t now = monotonic_seconds();
+    pthread_mutex_lock(&enrich_lock);
+    int found = owner_find_locked(uid, now, username, size) == 0;
+    if (found)
+        owner_hits++;
+    else
+        owner_misses++;
+    pthread_mutex_unlock(&enrich_lock);
+    if (found)
+        return;
+
+    struct passwd pwd, *result = NULL;
+    char buf[4096];
+    int err = getpwuid_r(uid, &pwd, buf, sizeof(buf), &result);
+    int known = err == 0 && result;
+    char name[sizeof(owners[0].name)];
+    if (known)
+        snprintf(name, sizeof(name), "%s", result->pw_name);
+    else
+        snprintf(name, sizeof(name), "%u", (unsigned)uid);
+    snprintf(username, size, "%s", name);
+
+    pthread_mutex_lock(&enrich_lock);
+    // Another worker may have resolved the same uid meanwhile: keep its entry
+    char cached[sizeof(owners[0].name)];
+    if (owner_find_locked(uid, now, cached, sizeof(cached)) == 0)
+    {
+        pthread_mutex_unlock(&enrich_lock);
+        return;
+    }
+    unsigned long idx = ((unsigned long)uid * 2654435761UL) & (OWNER_CACHE_SLOTS - 1);
+    struct owner_slot *victim = NULL;
+    for (int probe = 0; probe < OWNER_CACHE_PROBE; probe++)
+    {
+        struct owner_slot *slot = &owners[(idx + probe) & (OWNER_CACHE_SLOTS - 1)];
+        // Prefer an empty slot, then the entry that expires first
+        if (!victim || (victim->state != OWNER_EMPTY &&
+                        (slot->state == OWNER_EMPTY || slot->expires < victim->expires)))
+            victim = slot;
+    }
+    victim->uid = uid;
+    if (known)
+    {
+        victim->state = OWNER_KNOWN;
+        victim->expires = now + OWNER_CACHE_TTL;
+    }
+    else
+    {
+        // Unknown uids (and NSS failures) are remembered briefly so they do not hit NSS per event
+        owner_negative++;
+        victim->state = OWNER_UNKNOWN;
+        victim->expires = now + OWNER_NEGATIVE_TTL;
+    }
+    snprintf(victim->name, sizeof(victim->name), "%s", name);
+    pthread_mutex_unlock(&enrich_lock);
+}
+
+int dir_cache_at(const char *path, int (*op)(int dirfd, const char *name, void *arg), void *arg)
+{
+    char dir[MAX_PATH_BUFFER];
+    const char *slash = strrchr(path, '/');
+    const char *name = slash ? slash + 1 : path;
+    if (!slash)
+        snprintf(dir, sizeof(dir), ".");
+    else if (slash == path)
+        snprintf(dir, sizeof(dir), "/");
+    else
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+
+    int rc = -1;
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        int cached;
+        int dfd = dir_fd(dir, &cached);
+        if (dfd < 0)
+            break;
+        rc = op(dfd, name, arg);
+        int saved_errno = errno;
+        if (rc == 0)
+        {
+            close(dfd);
+            break;
+        }
+
+        // Retry only if the cached fd refers to a directory that has since been removed
+        struct stat dir_st;
+        int removed = saved_errno == ESTALE ||
+                      (saved_errno == ENOENT && fstat(dfd, &dir_st) == 0 && dir_st.st_nlink == 0);
+        close(dfd);
+        if (!removed)
+        {
+            errno = saved_errno;
+            break;
+        }
+        dir_forget(dir, cached);
+    }
+    return rc;
+}
+
+static int stat_at(int dirfd, const char *name, void *arg)
+{
+    return fstatat(dirfd, name, (struct stat *)arg, 0);
+}
+
+int enrich_file(const char *path, struct file_meta *meta)
+{
+    int rc = dir_cache_at(path, stat_at, &meta->st);
+    if (rc == 0)
+        owner_name(meta->st.st_uid, meta->owner, sizeof(meta->owner));
+    else
+        snprintf(meta->owner, sizeof(meta->owner), "unknown");
+    return rc;
+}
+
+void enrich_stats(unsigned long *hits, unsigned long *misses, unsigned long *negative)
+{
+    pthread_mutex_lock(&enrich_lock);
+    if (hits)
+        *hits = owner_hits;
+    if (misses)
+        *misses = owner_misses;
+    if (negative)
+        *negative = owner_negative;
+    pthread_mutex_unlock(&enrich_lock);
+}
@@ -1,4 +1,9 @@
-/* file_monitor.c – Monitor the upload directory and report events via IPC */
+/* file_monitor.c – Monitor the upload directory and report events via IPC
+ *
+ * monitor_directory() is the watcher thread of the upload pipeline (see
+ * pipeline.c): it coalesces raw events and submits one job per reportable
+ * event; the workers enrich, log and report it.
+ */
 
 #include "utils.h"
 #include <sys/inotify.h>
@@ -8,206 +13,726 @@
 #include <string.h>
 #include <time.h>
 #include <sys/stat.h>
-#include <pwd.h>
 #include <errno.h>
 #include <mqueue.h> // Needed for POSIX message queues
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "ipc_wire.h"
 
 #define EVENT_SIZE (sizeof(struct inotify_event))
 #define BUFFER_LEN (1024 * (EVENT_SIZE + 16))
-#define DEPT_COUNT 4
-#define FILE_PREFIX "dept"
+
+// Files with an event still being coalesced; beyond this events are reported directly
+#define PENDING_SLOTS 1024
+
+/* A created file nobody closes (a hard link, a writer that keeps it open but
+   idle) is reported after this long without events, like the reconciler's
+   settle time, instead of holding its slot and the timer forever */
+#ifndef PENDING_WRITING_TIMEOUT_MS
+#define PENDING_WRITING_TIMEOUT_MS 60000
+#endif
+
+/* Coalescing state of one file name */
+#define PENDING_FREE 0
+#define PENDING_WRITING 1 // created and still open for writing: wait for IN_CLOSE_WRITE
+#define PENDING_MODIFY 2  // modified in place: report once it has been quiet for the window
+#define PENDING_DELETED 3 // tombstone so probe chains stay intact
+
+struct pending_event
+{
+    int state;
+    struct timespec last; // CLOCK_MONOTONIC time of the most recent event
+    char *path;           // absolute path of the file
+    size_t display;       // offset of the name relative to its upload root
+};
+
+static struct pending_event pending[PENDING_SLOTS];
+static int pending_live = 0; // slots in WRITING or MODIFY state
 
 struct file_event
 {
-    char username[256];
-    char filename[256];
+    char username[64];
+    char filename[PATH_MAX];
     time_t timestamp;
 };
 
-/* Helper function to get file owner using stat */
-static void get_file_owner(const char *filepath, char *username, size_t size)
-{
-    struct stat file_stat;
-    if (stat(filepath, &file_stat) == 0)
-    {
-        struct passwd *pw = getpwuid(file_stat.st_uid);
-        if (pw)
-        {
-            strncpy(username, pw->pw_name, size - 1);
-            username[size - 1] = '\0';
-        }
-        else
-        {
-            snprintf(username, size, "%d", file_stat.st_uid);
-        }
-    }
-    else
-    {
-        strncpy(username, "unknown", size - 1);
-    }
-}
+// CLOCK_MONOTONIC time of the batch of events being processed
+static struct timespec batch_now;
+static long window_ms = COALESCE_WINDOW_MS;
 
-/* Helper function that logs the event and reports it via IPC */
-static void log_file_event(const char *event_type, const char *filename)
+// Presence index needs a full rescan (overflow, a report went away)
+static int presence_stale = 0;
+
+// Last known state of the upload trees; a rescan is due after an overflow or on request
+static struct reconcile *reconciler = NULL;
+static const char *reconcile_due = NULL; // reason, NULL when none is due
+
+// Owner cache counters are logged at most this often, in seconds
+#ifndef ENRICH_STATS_INTERVAL
+#define ENRICH_STATS_INTERVAL 3600
+#endif
+
+/* Log the event and report it via IPC (runs on a pipeline worker).
+   path + display is the name shown, relative to its upload root (e.g. "deptA/dept1.xml"). */
+void report_file_event(const char *event_type, const char *path, size_t display, time_t when)
 {
     struct file_event event;
-    char filepath[PATH_MAX];
-    event.timestamp = time(NULL);
-
-    /* Construct full filepath from the upload directory */
-    snprintf(filepath, sizeof(filepath), "%s/%s", UPLOAD_DIR, filename);
+    struct file_meta meta;
+    event.timestamp = when;
 
     /* Get file owner */
-    get_file_owner(filepath, event.username, sizeof(event.username));
-    strncpy(event.filename, filename, sizeof(event.filename) - 1);
+    int have_meta = enrich_file(path, &meta) == 0;
+    snprintf(event.username, sizeof(event.username), "%s", meta.owner);
+    strncpy(event.filename, path + display, sizeof(event.filename) - 1);
     event.filename[sizeof(event.filename) - 1] = '\0';
 
     char log_entry[1024]; // Buffer for log message
     char timestamp_str[32];
-    strftime(timestamp_str, sizeof(timestamp_str), "%Y-%m-%d %H:%M:%S", localtime(&event.timestamp));
+    struct tm tm_event;
+    strftime(timestamp_str, sizeof(timestamp_str), "%Y-%m-%d %H:%M:%S", localtime_r(&event.timestamp, &tm_event));
 
     snprintf(log_entry, sizeof(log_entry),
              "%s - File: %s, Owner: %s, Time: %s",
              event_type, event.filename, event.username, timestamp_str);
 
     /* Log the event locally */
-    log_message("LOG", log_entry);
+    log_event("LOG", event_type, log_entry);
 
-    /* Report the event via IPC */
-    mqd_t mq = init_msg_queue();
-    if (mq != (mqd_t)-1)
+    /* Report the event via IPC, with the department for a report ("dept7.xml" -> "dept7") */
+    struct ipc_event ev = {.task = event_type, .result = 1, .message = log_entry};
+    char dept[NAME_MAX + 1];
+    const char *base = strrchr(event.filename, '/');
+    base = base ? base + 1 : event.filename;
+    size_t base_len = strlen(base);
+    if (base_len > 4 && base_len <= NAME_MAX && strcmp(base + base_len - 4, ".xml") == 0)
+    {
+        snprintf(dept, sizeof(dept), "%.*s", (int)(base_len - 4), base);
+        ev.dept = dept;
+    }
+    ev.file = event.filename;
+    ev.owner = event.username;
+    if (have_meta)
     {
-        /* Send IPC message with event details; result 1 indicates success in processing the event */
-        send_task_msg(mq, event_type, 1, log_entry);
-        /* Clean up the message queue (close and unlink) */
-        close_msg_queue(mq);
+        ev.size = meta.st.st_size;
+        ev.has |= IPC_HAS_SIZE;
+    }
+    ipc_send_event(ipc_default(), &ev);
+
+    if (strcmp(event_type, "CREATE") == 0 && report_is_late(when))
+    {
+        // Past the deadline the upload is still accepted, only flagged
+        char msg[MAX_PATH_BUFFER + 64];
+        snprintf(msg, sizeof(msg), "Late upload %s arrived after the missing report deadline", event.filename);
+        log_event("WARNING", "late_upload", msg);
+        ipc_send(ipc_default(), "late_upload", 1, msg);
     }
 }
 
-void check_missing_reports()
+/* Log the owner cache counters if they changed and the interval has passed */
+static void log_enrich_stats(int force)
 {
-    char filename[PATH_MAX];
-    int missing_count = 0;
-    char missing_files[DEPT_COUNT * 32] = ""; // Buffer to accumulate missing filenames
+    static time_t last_logged = 0;
+    static unsigned long last_lookups = 0;
+    unsigned long hits, misses, negative;
+
+    if (last_logged == 0)
+        last_logged = batch_now.tv_sec; // first interval starts with the first batch
+    if (!force && batch_now.tv_sec - last_logged < ENRICH_STATS_INTERVAL)
+        return;
+    enrich_stats(&hits, &misses, &negative);
+    if (hits + misses == last_lookups)
+        return;
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Owner cache: %lu hits, %lu misses (%lu unknown uids)", hits, misses, negative);
+    log_message("INFO", msg);
+    last_logged = batch_now.tv_sec;
+    last_lookups = hits + misses;
+}
+
+// Text of one IPC event (well within a ring record) and of one log line of the missing list
+#define MISSING_IPC_CHUNK 512
+#define MISSING_LOG_CHUNK 1024
+
+// While streaming the list, wait for the reader once this many messages are held back,
+// for at most MISSING_IPC_WAIT_MS in total so a missing reader cannot stall the deadline
+#define MISSING_IPC_BACKLOG 128
+#define MISSING_IPC_WAIT_MS 2000
 
-    /* Check each department file in the upload directory */
-    for (int i = 1; i <= DEPT_COUNT; i++)
+static long elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/* Send one chunk, first waiting for the reader while the backlog is full
+   and the CLOCK_MONOTONIC time `started` is less than MISSING_IPC_WAIT_MS ago */
+static void send_missing_chunk(const char *text, const struct timespec *started)
+{
+    struct timespec now;
+    while (ipc_flush(ipc_default()) >= MISSING_IPC_BACKLOG)
     {
-        snprintf(filename, sizeof(filename), "%s/%s%d.xml",
-                 UPLOAD_DIR, FILE_PREFIX, i);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (elapsed_ms(started, &now) >= MISSING_IPC_WAIT_MS)
+            break;
+        usleep(1000);
+    }
+    ipc_send(ipc_default(), "missing_reports", 0, text);
+}
+
+/* Send the names of missing reports in as many messages as it takes:
+   the first starts with the total, later ones are marked as continued */
+static void stream_missing(const struct dept_set *set, const uint64_t *present, int missing_count,
+                           size_t chunk, int to_ipc)
+{
+    char buf[MISSING_LOG_CHUNK];
+    int count = dept_set_count(set);
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    size_t len = snprintf(buf, chunk, "Missing %d reports:", missing_count);
+    if (to_ipc)
+        ipc_hold(ipc_default()); // pack the chunks into as few messages as possible
 
-        if (access(filename, F_OK) == -1)
+    for (int i = 0; i < count; i++)
+    {
+        if (present[i / 64] & (1ULL << (i % 64)))
+            continue;
+        const char *name = dept_set_name(set, i);
+        size_t name_len = strlen(name);
+        if (len + 1 + name_len >= chunk && len > 0)
         {
-            if (strlen(missing_files) < sizeof(missing_files) - 32)
-            {
-                char temp[32];
-                snprintf(temp, sizeof(temp), "dept%d.xml ", i);
-                strcat(missing_files, temp);
-            }
-            missing_count++;
+            if (to_ipc)
+                send_missing_chunk(buf, &started);
+            else
+                log_event("ERROR", "missing_reports", buf);
+            len = snprintf(buf, chunk, "Missing (cont.):");
         }
+        len += snprintf(buf + len, chunk - len, " %s", name);
+        if (len >= chunk)
+            len = chunk - 1; // a single name longer than a chunk is cut
     }
 
+    if (to_ipc)
+    {
+        send_missing_chunk(buf, &started);
+        ipc_release(ipc_default());
+    }
+    else
+        log_event("ERROR", "missing_reports", buf);
+}
+
+/* Fill present for set, from the monitor's live index when it is current and
+   by scanning otherwise. Returns the number of missing reports. */
+static int collect_presence(const struct dept_set *set, uint64_t *present)
+{
+    int count = dept_set_count(set);
+    int missing = presence_snapshot(set, present);
+    if (missing >= 0)
+        return missing;
+
+    /* Reports already filed by streaming ingest count as uploaded */
+    char cycle_date[16];
+    char cycle_dir[MAX_PATH_BUFFER];
+    report_cycle_date(cycle_date, sizeof(cycle_date));
+    snprintf(cycle_dir, sizeof(cycle_dir), "%s/%s", REPORT_DIR, cycle_date);
+    int found = 0;
+    int scanned = dept_mark_present(set, cycle_dir, present);
+    if (scanned > 0)
+        found += scanned;
+
+    const char *roots[MAX_UPLOAD_ROOTS];
+    int root_count = upload_roots(roots, MAX_UPLOAD_ROOTS);
+    for (int i = 0; i < root_count && found < count; i++)
+    {
+        scanned = dept_mark_present(set, roots[i], present);
+        if (scanned > 0)
+            found += scanned;
+    }
+    return count - found;
+}
+
+void check_missing_reports()
+{
+    struct dept_set *set = dept_set_get();
+    if (!set)
+    {
+        log_event("ERROR", "missing_reports", "No department list available, cannot check for missing reports");
+        ipc_send(ipc_default(), "missing_reports", 0, "Department list unavailable");
+        return;
+    }
+
+    int count = dept_set_count(set);
+    uint64_t *present = calloc((count + 63) / 64 + 1, sizeof(uint64_t));
+    if (!present)
+    {
+        log_message("ERROR", "Out of memory checking for missing reports");
+        return;
+    }
+
+    int missing_count = collect_presence(set, present);
     if (missing_count > 0)
     {
-        char log_entry[DEPT_COUNT * 32 + 64];
-        snprintf(log_entry, sizeof(log_entry),
-                 "Missing %d reports: %s",
-                 missing_count, missing_files);
-        log_message("ERROR", log_entry);
+        stream_missing(set, present, missing_count, MISSING_LOG_CHUNK, 0);
 
         /* Report missing file event via IPC */
-        mqd_t mq = init_msg_queue();
-        if (mq != (mqd_t)-1)
+        stream_missing(set, present, missing_count, MISSING_IPC_CHUNK, 1);
+    }
+    else
+    {
+        log_event("INFO", "missing_reports", "All department reports present");
+        ipc_send(ipc_default(), "missing_reports", 1, "All reports present");
+    }
+    free(present);
+}
+
+int list_missing_reports()
+{
+    struct dept_set *set = dept_set_get();
+    if (!set)
+    {
+        fprintf(stderr, "No department list available\n");
+        return -1;
+    }
+
+    int count = dept_set_count(set);
+    uint64_t *present = calloc((count + 63) / 64 + 1, sizeof(uint64_t));
+    if (!present)
+        return -1;
+
+    int missing_count = collect_presence(set, present);
+    for (int i = 0; i < count; i++)
+    {
+        if (!(present[i / 64] & (1ULL << (i % 64))))
+            printf("%s\n", dept_set_name(set, i));
+    }
+    fprintf(stderr, "%d of %d reports missing\n", missing_count, count);
+    free(present);
+    return missing_count;
+}
+
+/* Should this name be reported at all? Filters temporary and editor files. */
+static int is_reportable(const char *name)
+{
+    return name[0] != '.' && strstr(name, "~") == NULL && strstr(name, ".swp") == NULL;
+}
+
+static unsigned long name_hash(const char *name)
+{
+    unsigned long h = 1469598103934665603UL;
+    for (; *name; name++)
+    {
+        h ^= (unsigned char)*name;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/* Find the slot for a path; with create, claim one if missing. NULL if absent/full. */
+static struct pending_event *pending_lookup(const char *path, int create)
+{
+    unsigned long idx = name_hash(path) % PENDING_SLOTS;
+    struct pending_event *reuse = NULL;
+
+    for (int probe = 0; probe < PENDING_SLOTS; probe++)
+    {
+        struct pending_event *slot = &pending[(idx + probe) % PENDING_SLOTS];
+        if (slot->state == PENDING_FREE)
+        {
+            if (!create)
+                return NULL;
+            if (!reuse)
+                reuse = slot;
+            break;
+        }
+        if (slot->state == PENDING_DELETED)
         {
-            send_task_msg(mq, "missing_reports", 0, log_entry);
-            close_msg_queue(mq);
+            if (!reuse)
+                reuse = slot;
+            continue;
         }
+        if (strcmp(slot->path, path) == 0)
+            return slot;
     }
-    else
+
+    if (!create || !reuse)
+        return NULL;
+    char *copy = strdup(path);
+    if (!copy)
+        return NULL;
+    free(reuse->path);
+    reuse->path = copy;
+    reuse->state = PENDING_DELETED; // caller sets the real state
+    pending_live++;
+    return reuse;
+}
+
+static void pending_clear()
+{
+    for (int i = 0; i < PENDING_SLOTS; i++)
     {
-        log_message("INFO", "All department reports present");
-        mqd_t mq = init_msg_queue();
-        if (mq != (mqd_t)-1)
+        free(pending[i].path);
+        pending[i].path = NULL;
+        pending[i].state = PENDING_FREE;
+    }
+    pending_live = 0;
+}
+
+static void pending_remove(struct pending_event *slot)
+{
+    slot->state = PENDING_DELETED;
+    pending_live--;
+    if (pending_live == 0)
+        pending_clear(); // nothing pending: drop all tombstones at once
+}
+
+/* Turn raw inotify masks into at most one report per file and window:
+   a file being uploaded produces a single CREATE when it is closed or moved
+   in, and a burst of in-place writes produces a single MODIFY once quiet. */
+static void coalesce_event(const char *path, size_t display, uint32_t mask, const struct timespec *now)
+{
+    if (mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+    {
+        struct pending_event *slot = pending_lookup(path, 0);
+        if (slot)
+            pending_remove(slot);
+        pipeline_submit("CREATE", path, display); // workers report it, then ingest it if enabled
+    }
+    else if (mask & IN_DELETE)
+    {
+        struct pending_event *slot = pending_lookup(path, 0);
+        if (slot)
+            pending_remove(slot);
+        pipeline_submit("DELETE", path, display);
+    }
+    else if (mask & IN_MOVED_FROM)
+    {
+        // Moved out of the upload tree (e.g. by move_reports): nothing to report
+        struct pending_event *slot = pending_lookup(path, 0);
+        if (slot)
+            pending_remove(slot);
+    }
+    else if (mask & (IN_CREATE | IN_MODIFY))
+    {
+        // symlink() and mknod() create names no writer will ever close
+        struct stat st;
+        if ((mask & IN_CREATE) && (lstat(path, &st) == -1 || !S_ISREG(st.st_mode)))
+            return;
+        struct pending_event *slot = pending_lookup(path, 1);
+        if (!slot)
+        {
+            // Table full: report without coalescing rather than lose the event
+            if (mask & IN_MODIFY)
+                pipeline_submit("MODIFY", path, display);
+            return;
+        }
+        if (slot->state == PENDING_DELETED)
         {
-            send_task_msg(mq, "missing_reports", 1, "All reports present");
-            close_msg_queue(mq);
+            slot->state = (mask & IN_CREATE) ? PENDING_WRITING : PENDING_MODIFY;
+            slot->display = display;
         }
+        slot->last = *now;
+    }
+}
+
+/* Report MODIFY for files that have been quiet for the whole window, and
+   CREATE for files still unclosed after PENDING_WRITING_TIMEOUT_MS. Returns
+   the milliseconds until the next slot is due, 0 when nothing is pending. */
+static long flush_pending(const struct timespec *now)
+{
+    long next = 0;
+    for (int i = 0; i < PENDING_SLOTS && pending_live > 0; i++)
+    {
+        struct pending_event *slot = &pending[i];
+        if (slot->state != PENDING_MODIFY && slot->state != PENDING_WRITING)
+            continue;
+        long due = (slot->state == PENDING_MODIFY ? window_ms : PENDING_WRITING_TIMEOUT_MS) -
+                   elapsed_ms(&slot->last, now);
+        if (due > 0)
+        {
+            if (next == 0 || due < next)
+                next = due;
+            continue;
+        }
+
+        int modified = slot->state == PENDING_MODIFY;
+        char path[MAX_PATH_BUFFER];
+        snprintf(path, sizeof(path), "%s", slot->path);
+        size_t display = slot->display;
+        pending_remove(slot);
+        struct stat st;
+        if (modified)
+            pipeline_submit("MODIFY", path, display);
+        else if (lstat(path, &st) == 0 && S_ISREG(st.st_mode))
+            pipeline_submit("CREATE", path, display); // gone or replaced: nothing to report
+    }
+    return next;
+}
+
+/* Arm (or disarm, with 0) the one-shot coalescing timer */
+static void arm_coalesce_timer(int tfd, long window_ms)
+{
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = window_ms / 1000;
+    spec.it_value.tv_nsec = (window_ms % 1000) * 1000000L;
+    timerfd_settime(tfd, 0, &spec, NULL);
+}
+
+/* Rebuild the presence index if it is stale, the department list changed or a
+   new reporting cycle started */
+static void refresh_presence()
+{
+    struct dept_set *set = dept_set_get();
+    if (!set || (!presence_stale && presence_current(set)))
+        return;
+    presence_stale = 0;
+
+    int found = presence_rebuild(set);
+    if (found >= 0)
+    {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Presence index rebuilt: %d of %d reports present", found, dept_set_count(set));
+        log_message("INFO", msg);
+    }
+}
+
+/* Watch manager callback: one file event (or an overflow) from any upload root */
+static void on_watch_event(const char *dir, const char *name, uint32_t mask, size_t root_len, void *arg)
+{
+    (void)arg;
+    if (mask & IN_Q_OVERFLOW)
+    {
+        /* The kernel dropped events: whatever we were coalescing is unreliable,
+           and the rescan replays what the lost events would have reported */
+        log_event("WARNING", "overflow", "Inotify queue overflowed, rescanning the upload roots");
+        ipc_send(ipc_default(), "overflow", 0, "Inotify queue overflow in upload monitor");
+        pending_clear();
+        presence_stale = 1;
+        reconcile_due = "overflow";
+        return;
+    }
+    reconcile_note(reconciler, dir, name, mask);
+    if (!is_reportable(name))
+        return;
+
+    /* Keep the presence index in step before coalescing: it only cares whether the report exists */
+    if (mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+        presence_mark(name);
+    else if ((mask & (IN_DELETE | IN_MOVED_FROM)) && presence_gone(name))
+        presence_stale = 1;
+
+    char path[MAX_PATH_BUFFER];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    coalesce_event(path, root_len + 1, mask, &batch_now);
+}
+
+static void read_window()
+{
+    window_ms = env_long("REPORT_DAEMON_COALESCE_MS", COALESCE_WINDOW_MS);
+    if (window_ms < 0)
+        window_ms = COALESCE_WINDOW_MS;
+}
+
+static void arm_cycle_timer(int cycle_tfd)
+{
+    int hour, minute;
+    config_backup_time(&hour, &minute);
+    if (cycle_tfd != -1)
+        daily_timer_arm(cycle_tfd, hour, minute);
+}
+
+static int has_root(const char **roots, int count, const char *root)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (strcmp(roots[i], root) == 0)
+            return 1;
     }
+    return 0;
 }
 
-void monitor_directory()
+/* Apply a reloaded configuration: only the upload roots that changed are
+   unwatched or watched, so pending events, the presence index and the
+   reconciler's state of the other roots carry over */
+static void reconfigure(struct watch_manager *wm, const char **roots, int *root_count, int cycle_tfd)
 {
-    int fd, wd;
-    char buffer[BUFFER_LEN];
+    read_window();
+    arm_cycle_timer(cycle_tfd);
 
-    fd = inotify_init1(IN_NONBLOCK); // Use non-blocking mode
-    if (fd < 0)
+    const char *fresh[MAX_UPLOAD_ROOTS];
+    int count = upload_roots(fresh, MAX_UPLOAD_ROOTS);
+    int added = 0, removed = 0;
+    for (int i = 0; i < *root_count; i++)
+    {
+        if (!has_root(fresh, count, roots[i]) && watch_remove_root(wm, roots[i]) == 0)
+            removed++;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (!has_root(roots, *root_count, fresh[i]) && watch_add_root(wm, fresh[i]) == 0)
+            added++;
+    }
+    int changed = count != *root_count;
+    for (int i = 0; !changed && i < count; i++)
+        changed = strcmp(roots[i], fresh[i]) != 0;
+    memcpy(roots, fresh, count * sizeof(*roots));
+    *root_count = count;
+    if (!changed)
+        return;
+
+    char msg[160];
+    snprintf(msg, sizeof(msg), "Upload roots reconfigured: %d added, %d removed, %zu directories watched",
+             added, removed, watch_count(wm));
+    log_event("INFO", "config", msg);
+    reconcile_set_roots(reconciler, roots, count, on_watch_event, NULL);
+    presence_stale = 1;
+}
+
+void monitor_directory(int control_fd)
+{
+    read_window();
+
+    struct watch_manager *wm = watch_manager_create(on_watch_event, NULL);
+    if (!wm)
     {
         log_message("ERROR", "Error initializing inotify");
         return;
     }
 
-    wd = inotify_add_watch(fd, UPLOAD_DIR,
-                           IN_CREATE | IN_MODIFY | IN_DELETE |
-                               IN_MOVED_TO | IN_CLOSE_WRITE); // Simplified watch flags
-    if (wd < 0)
+    const char *roots[MAX_UPLOAD_ROOTS];
+    int root_count = upload_roots(roots, MAX_UPLOAD_ROOTS);
+    int watched_roots = 0;
+    for (int i = 0; i < root_count; i++)
+    {
+        if (watch_add_root(wm, roots[i]) == 0)
+            watched_roots++;
+    }
+    if (watched_roots == 0)
     {
         log_message("ERROR", "Error adding watch on upload directory");
-        close(fd);
+        watch_manager_destroy(wm);
         return;
     }
 
-    log_message("INFO", "Started monitoring upload directory");
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    int inotify_fd = watch_manager_inotify_fd(wm);
+    int fanotify_fd = -1;
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = inotify_fd};
+    if (epfd == -1 || tfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, inotify_fd, &ev) == -1)
+    {
+        log_message("ERROR", "Error setting up epoll for the upload directory watch");
+        watch_manager_destroy(wm);
+        return;
+    }
+    ev.data.fd = tfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+    ev.data.fd = control_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, control_fd, &ev);
+
+    /* A new reporting cycle starts with the nightly backup: rebuild the presence index then */
+    int cycle_tfd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (cycle_tfd != -1)
+    {
+        ev.data.fd = cycle_tfd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, cycle_tfd, &ev);
+        arm_cycle_timer(cycle_tfd);
+    }
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Started monitoring %d upload root(s), %zu directories",
+             watched_roots, watch_count(wm));
+    log_message("INFO", msg);
 
-    while (1)
+    /* Watches are in place, so nothing that arrives during the initial scans is
+       missed: replay what happened while the daemon was down, then index presence */
+    reconciler = reconcile_create(roots, root_count);
+    clock_gettime(CLOCK_MONOTONIC, &batch_now);
+    reconcile_run(reconciler, "startup", on_watch_event, NULL);
+    arm_coalesce_timer(tfd, flush_pending(&batch_now));
+    refresh_presence();
+
+    int stop = 0;
+    while (!stop)
     {
-        usleep(100000); // 100ms delay
+        /* The watch manager may have switched to fanotify while adding directories */
+        if (fanotify_fd == -1 && watch_manager_fanotify_fd(wm) != -1)
+        {
+            fanotify_fd = watch_manager_fanotify_fd(wm);
+            ev.data.fd = fanotify_fd;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fanotify_fd, &ev);
+        }
 
-        ssize_t length;
-        while ((length = read(fd, buffer, BUFFER_LEN)) > 0)
+        struct epoll_event events[4];
+        int n = epoll_wait(epfd, events, 4, -1);
+        if (n == -1)
         {
-            char dbg_msg[256];
-            snprintf(dbg_msg, sizeof(dbg_msg), "Received event data: %zd bytes", length);
-            log_message("DEBUG", dbg_msg);
+            if (errno == EINTR)
+                continue;
+            log_message("ERROR", "epoll_wait failed while monitoring upload directory");
+            break;
+        }
 
-            char *ptr = buffer;
-            while (ptr < buffer + length)
-            {
-                struct inotify_event *event = (struct inotify_event *)ptr;
+        clock_gettime(CLOCK_MONOTONIC, &batch_now);
 
-                if (event->len > 0 && !(event->mask & IN_ISDIR))
+        int failed = 0, check_missing = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.fd == control_fd)
+            {
+                unsigned requests = pipeline_requests();
+                stop = (requests & PIPELINE_STOP) != 0;
+                check_missing = (requests & PIPELINE_CHECK_MISSING) != 0;
+                if (requests & PIPELINE_RECONCILE)
+                    reconcile_due = "requested";
+                if ((requests & PIPELINE_RECONFIGURE) && !stop)
+                    reconfigure(wm, roots, &root_count, cycle_tfd);
+            }
+            else if (events[i].data.fd == cycle_tfd)
+            {
+                if (daily_timer_read(cycle_tfd) == 1)
                 {
-                    // Filter out temporary files and backup files
-                    if (event->name[0] != '.' &&
-                        strstr(event->name, "~") == NULL &&
-                        strstr(event->name, ".swp") == NULL)
-                    {
-                        if (event->mask & IN_CLOSE_WRITE || event->mask & IN_MOVED_TO)
-                        {
-                            log_file_event("CREATE", event->name);
-                        }
-                        else if (event->mask & IN_DELETE)
-                        {
-                            log_file_event("DELETE", event->name);
-                        }
-                        else if (event->mask & IN_MODIFY)
-                        {
-                            log_file_event("MODIFY", event->name);
-                        }
-                    }
+                    presence_stale = 1;
+                    reconcile_save(reconciler);
                 }
-                ptr += sizeof(struct inotify_event) + event->len;
+                arm_cycle_timer(cycle_tfd);
             }
+            else if (events[i].data.fd != tfd && watch_manager_process(wm, events[i].data.fd) == -1)
+                failed = 1;
         }
-
-        if (length == -1 && errno != EAGAIN)
+        if (failed)
         {
             log_message("ERROR", "Error reading inotify events");
             break;
         }
+
+        if (reconcile_due && !stop)
+        {
+            reconcile_run(reconciler, reconcile_due, on_watch_event, NULL);
+            reconcile_due = NULL;
+        }
+
+        /* Report files whose window has closed, then sleep until the next one could */
+        uint64_t expirations;
+        if (read(tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+            log_message("ERROR", "Error reading coalescing timer");
+        arm_coalesce_timer(tfd, flush_pending(&batch_now));
+
+        refresh_presence();
+        if (check_missing && !stop)
+            check_missing_reports(); // deadline check asked for by the main thread
+        ipc_flush(ipc_default()); // retry messages held back while the queue was full
+        log_enrich_stats(0);
+        pipeline_log_stats(0);
     }
 
-    inotify_rm_watch(fd, wd);
-    close(fd);
-}
\ No newline at end of file
+    log_enrich_stats(1);
+    presence_close();
+    reconcile_destroy(reconciler); // saves the state for the startup scan of the next run
+    reconciler = NULL;
+
+    if (cycle_tfd != -1)
+        close(cycle_tfd);
+    close(tfd);
+    close(epfd);
+    watch_manager_destroy(wm);
+}
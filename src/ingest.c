@@ -0,0 +1,148 @@
+/* ingest.c – Streaming ingestion: file reports as soon as they are uploaded */
+
+#include "utils.h"
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <limits.h>
+
+/*
+ * With REPORT_DAEMON_STREAM_INGEST=1 the upload monitor hands every finished
+ * .xml upload to ingest_report(), which renames it into the reporting
+ * directory of the current cycle (see report_cycle_date()) straight away.
+ * The nightly move_reports() sweep then only picks up stragglers, and the
+ * backup window is left with the copy alone.
+ *
+ * The source directory fd comes from the enrichment directory cache and the
+ * destination fd is held until the cycle date changes, so a move is a single
+ * renameat() with no path resolution of either directory.
+ */
+
+static pthread_mutex_t ingest_lock = PTHREAD_MUTEX_INITIALIZER;
+static char dest_date[16] = "";
+static char dest_path[MAX_PATH_BUFFER];
+static int dest_fd = -1;
+
+int ingest_enabled()
+{
+    static int enabled = -1;
+    if (enabled == -1)
+        enabled = env_long("REPORT_DAEMON_STREAM_INGEST", 0) != 0;
+    return enabled;
+}
+
+/* Held fd of REPORT_DIR/<cycle date>, reopened when the date changes or the
+   directory was removed. Caller must hold ingest_lock. */
+static int dest_dir_fd_locked()
+{
+    char date[16];
+    report_cycle_date(date, sizeof(date));
+
+    struct stat st;
+    if (dest_fd != -1 && strcmp(date, dest_date) == 0 && fstat(dest_fd, &st) == 0 && st.st_nlink > 0)
+        return dest_fd;
+
+    if (dest_fd != -1)
+    {
+        close(dest_fd);
+        dest_fd = -1;
+    }
+    snprintf(dest_path, sizeof(dest_path), "%s/%s", REPORT_DIR, date);
+    if (ensure_directory(dest_path) == -1)
+        return -1;
+    dest_fd = open(dest_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dest_fd != -1)
+        snprintf(dest_date, sizeof(dest_date), "%s", date);
+    return dest_fd;
+}
+
+static int rename_into_dest(int dirfd, const char *name, void *arg)
+{
+    return renameat(dirfd, name, *(int *)arg, name);
+}
+
+static int unlink_at(int dirfd, const char *name, void *arg)
+{
+    (void)arg;
+    return unlinkat(dirfd, name, 0);
+}
+
+/* Cross-filesystem ingest: copy to a ".<name>.part" file beside the final
+   name and rename it into place, so nothing ever sees a half-written report,
+   then drop the upload. A failed copy leaves nothing behind. */
+static int copy_into_dest(const char *path, int dfd, const char *dir, const char *name)
+{
+    char tmp_name[NAME_MAX + 8];
+    char tmp[MAX_PATH_BUFFER];
+    snprintf(tmp_name, sizeof(tmp_name), ".%s.part", name);
+    snprintf(tmp, sizeof(tmp), "%s/%s", dir, tmp_name);
+
+    if (copy_file(path, tmp) == -1 || renameat(dfd, tmp_name, dfd, name) == -1)
+    {
+        int saved_errno = errno;
+        unlinkat(dfd, tmp_name, 0);
+        errno = saved_errno;
+        return -1;
+    }
+    return dir_cache_at(path, unlink_at, NULL);
+}
+
+int ingest_report(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    const char *name = slash ? slash + 1 : path;
+    const char *ext = strrchr(name, '.');
+    if (!ext || strcmp(ext, ".xml") != 0)
+        return 0;
+
+    if (report_rejected(path))
+        return -1; // malformed: quarantined instead of filed
+
+    /* The lock only covers the held directory: each ingest works on its own
+       duplicate, so a slow cross-device copy does not hold up the others */
+    char date[16];
+    char dir[MAX_PATH_BUFFER];
+    pthread_mutex_lock(&ingest_lock);
+    int dfd = dest_dir_fd_locked();
+    if (dfd != -1)
+        dfd = fcntl(dfd, F_DUPFD_CLOEXEC, 0);
+    snprintf(date, sizeof(date), "%s", dest_date);
+    snprintf(dir, sizeof(dir), "%s", dest_path);
+    pthread_mutex_unlock(&ingest_lock);
+    if (dfd == -1)
+    {
+        log_event("ERROR", "ingest", "Failed to open the reporting directory for streaming ingest");
+        ipc_send(ipc_default(), "ingest", 0, "Reporting directory unavailable");
+        return -1;
+    }
+
+    int rc = dir_cache_at(path, rename_into_dest, &dfd);
+    if (rc == -1 && errno == EXDEV)
+        rc = copy_into_dest(path, dfd, dir, name); // upload root on another filesystem
+    int saved_errno = errno;
+
+    char msg[1024];
+    if (rc == 0)
+    {
+        struct stat st;
+        int late = 0;
+        if (fstatat(dfd, name, &st, 0) == 0)
+        {
+            catalog_record(CATALOG_FILED, date, name, st.st_size, 0);
+            late = report_is_late(st.st_mtime);
+        }
+        close(dfd);
+        snprintf(msg, sizeof(msg), "Ingested %sfile %s into reporting directory %s", late ? "late " : "", name, dir);
+        log_event("INFO", "ingest", msg);
+        ipc_send(ipc_default(), "ingest", 1, msg);
+        return 0;
+    }
+
+    close(dfd);
+    if (saved_errno == ENOENT)
+        return 0; // already moved or deleted by someone else (e.g. the nightly sweep)
+    snprintf(msg, sizeof(msg), "Failed to ingest file %s: %s", name, strerror(saved_errno));
+    log_event("ERROR", "ingest", msg);
+    ipc_send(ipc_default(), "ingest", 0, msg);
+    return -1;
+}
@@ -5,29 +5,63 @@
 #include <errno.h>
 #include <time.h>
 #include <string.h>
+#include <pthread.h>
+#include "ipc_wire.h"
 
-#define MQ_MAX_MSG 10
-#define MQ_MSG_SIZE sizeof(struct task_msg)
+// Encoded events kept locally while the queue is full or the context is held,
+// before the oldest are dropped
+#define IPC_PENDING_BYTES (64 * 1024)
 
-struct task_msg
+// A held context still sends a partial batch once its oldest event waited this long
+#ifndef IPC_BATCH_MS
+#define IPC_BATCH_MS 100
+#endif
+
+/* A queue handle opened once per process and reused for every message */
+struct ipc_ctx
 {
-    pid_t pid;         // PID of reporting process
-    char task[64];     // Task identifier (e.g., "backup", "move_reports")
-    int result;        // 1 for success, 0 for failure
-    char message[128]; // Additional details
-    time_t timestamp;
+    pthread_mutex_t lock;
+    pid_t owner;
+    mqd_t mq;
+    struct shm_ring *ring; // shared-memory transport, NULL when using the queue
+    int nonblocking;
+    size_t max_msg; // largest message the transport takes
+    int holds;      // ipc_hold() calls not released yet
+    char pending[IPC_PENDING_BYTES]; // encoded events waiting, oldest at pending_start
+    size_t pending_start;
+    size_t pending_len;
+    int pending_count;
+    struct timespec pending_since; // CLOCK_MONOTONIC, when the oldest waiting event was queued
+    unsigned long sent;
+    unsigned long messages; // queue messages / ring records the sent events took
+    unsigned long deferred; // waited in the local buffer because the queue was full
+    unsigned long dropped;  // overwritten while the local buffer was full
 };
 
+_Static_assert(IPC_WIRE_MAX <= IPC_PENDING_BYTES, "a message must fit the local buffer");
+
+static struct ipc_ctx *default_ctx = NULL;
+static pthread_mutex_t default_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Initialize the POSIX message queue (create if necessary) */
 mqd_t init_msg_queue()
 {
     struct mq_attr attr;
     attr.mq_flags = 0; // blocking by default
     attr.mq_maxmsg = MQ_MAX_MSG;
-    attr.mq_msgsize = MQ_MSG_SIZE;
+    attr.mq_msgsize = IPC_WIRE_MAX;
     attr.mq_curmsgs = 0;
 
     mqd_t mq = mq_open(MQ_NAME, O_CREAT | O_RDWR, 0666, &attr);
+    struct mq_attr current;
+    if (mq != (mqd_t)-1 && mq_getattr(mq, &current) == 0 && current.mq_msgsize < IPC_WIRE_MAX)
+    {
+        /* Left over from a version sending fixed-size records: messages no longer fit */
+        mq_close(mq);
+        mq_unlink(MQ_NAME);
+        mq = mq_open(MQ_NAME, O_CREAT | O_RDWR, 0666, &attr);
+        log_message("INFO", "Recreated the message queue for the variable-length message format");
+    }
     if (mq == (mqd_t)-1)
     {
         log_message("ERROR", "Failed to open POSIX message queue");
@@ -35,19 +69,28 @@ mqd_t init_msg_queue()
     return mq;
 }
 
+static void fill_event(struct ipc_event *ev, const char *task, int result, const char *msg_text)
+{
+    memset(ev, 0, sizeof(*ev));
+    ev->task = task;
+    ev->result = result;
+    ev->message = msg_text;
+}
+
 /* Send a task message via the POSIX message queue */
 int send_task_msg(mqd_t mq, const char *task, int result, const char *msg_text)
 {
-    struct task_msg message;
-    message.pid = getpid();
-    strncpy(message.task, task, sizeof(message.task) - 1);
-    message.task[sizeof(message.task) - 1] = '\0';
-    message.result = result;
-    strncpy(message.message, msg_text, sizeof(message.message) - 1);
-    message.message[sizeof(message.message) - 1] = '\0';
-    message.timestamp = time(NULL);
+    struct ipc_event ev;
+    fill_event(&ev, task, result, msg_text);
+    ev.pid = getpid();
+    ev.timestamp = time(NULL);
 
-    if (mq_send(mq, (const char *)&message, sizeof(message), 0) == -1)
+    char event[IPC_WIRE_MAX];
+    char message[IPC_WIRE_MAX];
+    size_t used;
+    size_t event_len = ipc_wire_encode(event, sizeof(event) - sizeof(struct ipc_wire_header), &ev);
+    size_t len = ipc_wire_batch(message, sizeof(message), event, event_len, &used);
+    if (mq_send(mq, message, len, 0) == -1)
     {
         char err[256];
         snprintf(err, sizeof(err), "Failed to send task message: %s", strerror(errno));
@@ -69,4 +112,297 @@ void cleanup_msg_queue(mqd_t mq)
 {
     mq_close(mq);
     mq_unlink(MQ_NAME);
-}
\ No newline at end of file
+}
+
+/* Transport chosen at startup through REPORT_DAEMON_IPC ("mq" or "shm") */
+int ipc_transport()
+{
+    const char *value = config_get("REPORT_DAEMON_IPC");
+    if (value && strcmp(value, "shm") == 0)
+        return IPC_TRANSPORT_SHM;
+    return IPC_TRANSPORT_MQ;
+}
+
+/* Hand one message to the transport; -1 with errno EAGAIN means "full".
+   A deadline makes the queue wait for room until then. */
+static int transport_send(struct ipc_ctx *ctx, const char *msg, size_t len, const struct timespec *deadline)
+{
+    if (ctx->ring)
+        return shm_ring_publish(ctx->ring, msg, len);
+    if (deadline)
+        return mq_timedsend(ctx->mq, msg, len, 0, deadline);
+    return mq_send(ctx->mq, msg, len, 0);
+}
+
+/* Open an IPC context. In non-blocking mode a full queue never stalls the
+   caller: messages wait in a local buffer instead. */
+struct ipc_ctx *ipc_open(int nonblocking)
+{
+    struct ipc_ctx *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx)
+        return NULL;
+
+    if (ipc_transport() == IPC_TRANSPORT_SHM)
+    {
+        /* The shared ring never blocks producers, so the nonblocking flag does not apply */
+        ctx->ring = shm_ring_attach(SHM_RING_NAME);
+        if (ctx->ring)
+        {
+            pthread_mutex_init(&ctx->lock, NULL);
+            ctx->owner = getpid();
+            ctx->nonblocking = 1;
+            ctx->max_msg = SHM_RING_PAYLOAD;
+            return ctx;
+        }
+        log_message("ERROR", "Failed to attach shared-memory event ring, using the message queue");
+    }
+
+    ctx->mq = init_msg_queue();
+    if (ctx->mq == (mqd_t)-1)
+    {
+        free(ctx);
+        return NULL;
+    }
+    if (nonblocking)
+    {
+        struct mq_attr attr = {.mq_flags = O_NONBLOCK};
+        mq_setattr(ctx->mq, &attr, NULL);
+    }
+    pthread_mutex_init(&ctx->lock, NULL);
+    ctx->owner = getpid();
+    ctx->nonblocking = nonblocking;
+    ctx->max_msg = IPC_WIRE_MAX;
+    return ctx;
+}
+
+/* Queue one encoded event behind the others, dropping the oldest when the
+   buffer is full. Returns how many were dropped. Caller holds ctx->lock. */
+static int pending_append_locked(struct ipc_ctx *ctx, const char *event, size_t len)
+{
+    int dropped = 0;
+    while (ctx->pending_len + len > IPC_PENDING_BYTES)
+    {
+        struct ipc_wire_event oldest;
+        memcpy(&oldest, ctx->pending + ctx->pending_start, sizeof(oldest));
+        ctx->pending_start += oldest.length;
+        ctx->pending_len -= oldest.length;
+        ctx->pending_count--;
+        ctx->dropped++;
+        dropped++;
+    }
+    if (ctx->pending_start + ctx->pending_len + len > IPC_PENDING_BYTES)
+    {
+        memmove(ctx->pending, ctx->pending + ctx->pending_start, ctx->pending_len);
+        ctx->pending_start = 0;
+    }
+    if (ctx->pending_count == 0)
+        clock_gettime(CLOCK_MONOTONIC, &ctx->pending_since);
+    memcpy(ctx->pending + ctx->pending_start + ctx->pending_len, event, len);
+    ctx->pending_len += len;
+    ctx->pending_count++;
+    return dropped;
+}
+
+/* Send waiting events in order, as many per message as fit, until the
+   transport fills up. While the context is held only full batches go out,
+   unless force is set or the oldest event has waited IPC_BATCH_MS.
+   Caller must hold ctx->lock. */
+static void drain_pending_locked(struct ipc_ctx *ctx, int force, const struct timespec *deadline)
+{
+    char msg[IPC_WIRE_MAX];
+    while (ctx->pending_count > 0)
+    {
+        size_t used;
+        size_t len = ipc_wire_batch(msg, ctx->max_msg, ctx->pending + ctx->pending_start, ctx->pending_len, &used);
+        if (!force && ctx->holds > 0 && used == ctx->pending_len)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long waited_ms = (now.tv_sec - ctx->pending_since.tv_sec) * 1000 +
+                             (now.tv_nsec - ctx->pending_since.tv_nsec) / 1000000;
+            if (waited_ms < IPC_BATCH_MS)
+                break; // room left in the batch: wait for more events
+        }
+
+        int sent = 0;
+        if (transport_send(ctx, msg, len, deadline) == 0)
+            sent = 1;
+        else if (errno == EAGAIN || errno == ETIMEDOUT)
+            break;
+        else
+        {
+            char err[256];
+            snprintf(err, sizeof(err), "Failed to send task message: %s", strerror(errno));
+            log_message("ERROR", err); // the logger never sends IPC, so this cannot recurse
+        }
+
+        struct ipc_wire_header header;
+        memcpy(&header, msg, sizeof(header));
+        if (sent)
+        {
+            ctx->sent += header.count;
+            ctx->messages++;
+        }
+        else
+            ctx->dropped += header.count;
+        ctx->pending_start += used;
+        ctx->pending_len -= used;
+        ctx->pending_count -= header.count;
+        if (ctx->pending_count == 0)
+            ctx->pending_start = 0;
+        else
+            clock_gettime(CLOCK_MONOTONIC, &ctx->pending_since);
+    }
+}
+
+int ipc_send(struct ipc_ctx *ctx, const char *task, int result, const char *msg_text)
+{
+    struct ipc_event ev;
+    fill_event(&ev, task, result, msg_text);
+    return ipc_send_event(ctx, &ev);
+}
+
+int ipc_send_event(struct ipc_ctx *ctx, const struct ipc_event *ev)
+{
+    if (!ctx)
+        return -1;
+
+    struct ipc_event event = *ev;
+    event.pid = getpid();
+    event.timestamp = time(NULL);
+    char encoded[IPC_WIRE_MAX];
+    size_t len = ipc_wire_encode(encoded, ctx->max_msg - sizeof(struct ipc_wire_header), &event);
+    if (len == 0)
+        return -1;
+
+    pthread_mutex_lock(&ctx->lock);
+    int dropped = pending_append_locked(ctx, encoded, len);
+    drain_pending_locked(ctx, 0, NULL);
+    if (ctx->holds == 0 && ctx->pending_count > 0)
+        ctx->deferred++; // the queue is full: this one (the newest) waits locally
+    unsigned long total_dropped = ctx->dropped;
+    pthread_mutex_unlock(&ctx->lock);
+
+    // Report the first drop and then every 100th, not every message
+    if (dropped && (total_dropped == 1 || total_dropped / 100 != (total_dropped - dropped) / 100))
+    {
+        char warn[128];
+        snprintf(warn, sizeof(warn), "IPC queue full, %lu message(s) dropped so far", total_dropped);
+        log_message("WARNING", warn);
+    }
+    return dropped ? -1 : 0;
+}
+
+void ipc_hold(struct ipc_ctx *ctx)
+{
+    if (!ctx)
+        return;
+    pthread_mutex_lock(&ctx->lock);
+    ctx->holds++;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void ipc_release(struct ipc_ctx *ctx)
+{
+    if (!ctx)
+        return;
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->holds > 0)
+        ctx->holds--;
+    drain_pending_locked(ctx, 0, NULL);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Retry waiting events (a held context only sends full or expired batches);
+   returns how many events are still waiting */
+int ipc_flush(struct ipc_ctx *ctx)
+{
+    if (!ctx)
+        return 0;
+    pthread_mutex_lock(&ctx->lock);
+    drain_pending_locked(ctx, 0, NULL);
+    int pending = ctx->pending_count;
+    pthread_mutex_unlock(&ctx->lock);
+    return pending;
+}
+
+void ipc_stats(struct ipc_ctx *ctx, unsigned long *sent, unsigned long *deferred, unsigned long *dropped)
+{
+    pthread_mutex_lock(&ctx->lock);
+    *sent = ctx->sent;
+    *deferred = ctx->deferred;
+    *dropped = ctx->dropped;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Flush what we can (waiting briefly for a reader) and release the context */
+void ipc_close(struct ipc_ctx *ctx)
+{
+    if (!ctx)
+        return;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->ring)
+        drain_pending_locked(ctx, 1, NULL); // the ring cannot be waited on by producers
+    else if (ctx->pending_count > 0)
+    {
+        if (ctx->nonblocking)
+        {
+            struct mq_attr attr = {.mq_flags = 0};
+            mq_setattr(ctx->mq, &attr, NULL);
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1; // no reader within a second: give up on the rest
+        drain_pending_locked(ctx, 1, &deadline);
+    }
+
+    if (ctx->pending_count > 0 || ctx->dropped > 0)
+    {
+        char warn[160];
+        snprintf(warn, sizeof(warn), "IPC closed with %d undelivered and %lu dropped message(s)",
+                 ctx->pending_count, ctx->dropped);
+        log_message("WARNING", warn);
+    }
+    if (ctx->messages > 0)
+    {
+        char info[160];
+        snprintf(info, sizeof(info), "IPC sent %lu event(s) in %lu message(s)", ctx->sent, ctx->messages);
+        log_message("INFO", info);
+    }
+    if (ctx->ring)
+        shm_ring_detach(ctx->ring);
+    else
+        mq_close(ctx->mq);
+    pthread_mutex_unlock(&ctx->lock);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+/* Process-wide non-blocking context, opened on first use. A forked child
+   gets its own context instead of sharing the parent's overflow buffer. */
+struct ipc_ctx *ipc_default()
+{
+    pthread_mutex_lock(&default_ctx_lock);
+    if (!default_ctx || default_ctx->owner != getpid())
+    {
+        if (default_ctx && !default_ctx->ring)
+            mq_close(default_ctx->mq); // inherited across fork; the parent still owns the struct
+        default_ctx = ipc_open(1);
+    }
+    struct ipc_ctx *ctx = default_ctx;
+    pthread_mutex_unlock(&default_ctx_lock);
+    return ctx;
+}
+
+/* Flush and close the process-wide context (at shutdown) */
+void ipc_shutdown()
+{
+    pthread_mutex_lock(&default_ctx_lock);
+    if (default_ctx && default_ctx->owner == getpid())
+    {
+        ipc_close(default_ctx);
+        default_ctx = NULL;
+    }
+    pthread_mutex_unlock(&default_ctx_lock);
+}
@@ -1,4 +1,18 @@
-/* ipc_monitor.c – A simple POSIX message queue monitor */
+/* ipc_monitor.c – A simple POSIX message queue monitor
+ *
+ * Usage: ipc_monitor [--aggregate [SECONDS]] [--transport mq|shm]
+ *
+ * By default every message is printed. With --aggregate the monitor keeps
+ * rolling per-task counters and prints one summary line per interval
+ * (default 10 seconds), which is cheap enough to leave running next to a
+ * busy daemon. --transport must match the daemon's REPORT_DAEMON_IPC
+ * setting, which may come from its configuration file; without it the
+ * monitor falls back to REPORT_DAEMON_IPC in its own environment, then mq.
+ * The monitor blocks until a message arrives: on the message
+ * queue descriptor through epoll, or on the shared-memory ring's futex.
+ * Messages are decoded with the daemon's own ipc_wire.c; each may carry
+ * several events.
+ */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,31 +23,231 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include "utils.h"
+#include "ipc_wire.h"
 
-#define MQ_MSG_SIZE sizeof(struct task_msg)
+#define MAX_TASKS 32
+#define DEFAULT_INTERVAL 10
 
-struct task_msg
+/* Rolling counters for one task name */
+struct task_stats
 {
-    pid_t pid;         // PID of reporting process
-    char task[64];     // Task identifier (e.g., "backup", "move_reports")
-    int result;        // 1 for success, 0 for failure
-    char message[128]; // Additional details
-    time_t timestamp;
+    char task[64];
+    unsigned long interval_ok;
+    unsigned long interval_failed;
+    unsigned long total_ok;
+    unsigned long total_failed;
 };
 
-int main(void)
+static int aggregate = 0;
+static int interval = DEFAULT_INTERVAL;
+static struct task_stats stats[MAX_TASKS];
+static int task_count = 0;
+static unsigned long ring_skipped = 0;
+static unsigned long undecodable = 0; // malformed, or from an incompatible daemon version
+
+/* Tasks the daemon reports, listed first so the summary columns stay stable */
+static const char *known_tasks[] = {"CREATE", "MODIFY", "DELETE", "move_reports", "copy_file", "backup"};
+
+static struct task_stats *stats_for(const char *task)
 {
-    mqd_t mq;
-    struct mq_attr attr;
-    char buffer[MQ_MSG_SIZE];
-    ssize_t bytes_read;
-    struct task_msg msg;
-    time_t t;
+    for (int i = 0; i < task_count; i++)
+    {
+        if (strcmp(stats[i].task, task) == 0)
+            return &stats[i];
+    }
+    if (task_count == MAX_TASKS)
+        return &stats[MAX_TASKS - 1]; // everything unexpected lands in the last slot
+    struct task_stats *entry = &stats[task_count++];
+    snprintf(entry->task, sizeof(entry->task), "%s", task);
+    return entry;
+}
+
+static void print_event(const struct ipc_event *ev)
+{
+    time_t t = ev->timestamp;
     char time_str[64];
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("PID: %d | Task: %s | Result: %s | Time: %s\n", ev->pid, ev->task, ev->result ? "SUCCESS" : "FAILURE",
+           time_str);
+
+    /* Typed fields, when the event has any */
+    int fields = 0;
+    if (ev->file)
+        fields += printf("File: %s", ev->file);
+    if (ev->owner)
+        fields += printf("%sOwner: %s", fields ? " | " : "", ev->owner);
+    if (ev->dept)
+        fields += printf("%sDepartment: %s", fields ? " | " : "", ev->dept);
+    if (ev->has & IPC_HAS_SIZE)
+        fields += printf("%sSize: %llu", fields ? " | " : "", (unsigned long long)ev->size);
+    if (ev->has & IPC_HAS_DURATION)
+        fields += printf("%sDuration: %llu ms", fields ? " | " : "", (unsigned long long)ev->duration_ms);
+    if (ev->has & IPC_HAS_ERROR)
+        fields += printf("%sError: %s", fields ? " | " : "", strerror(ev->error));
+    if (fields)
+        printf("\n");
+    printf("Message: %s\n\n", ev->message);
+}
+
+static void handle_event(const struct ipc_event *ev)
+{
+    if (!aggregate)
+    {
+        print_event(ev);
+        return;
+    }
+
+    struct task_stats *entry = stats_for(ev->task);
+    if (ev->result)
+        entry->interval_ok++;
+    else
+        entry->interval_failed++;
+}
+
+/* Every event of one queue message or ring record */
+static void handle_msg(const char *msg, size_t len)
+{
+    struct ipc_event ev;
+    size_t offset = 0;
+    int rc;
+    while ((rc = ipc_wire_decode(msg, len, &offset, &ev)) == 1)
+        handle_event(&ev);
+    if (rc == -1)
+    {
+        undecodable++;
+        if (!aggregate)
+            printf("(undecodable message of %zu bytes: malformed or from another daemon version)\n\n", len);
+    }
+    if (!aggregate)
+        fflush(stdout);
+}
+
+/* One line per interval: count, rate and success ratio for every task seen */
+static void print_summary()
+{
+    char time_str[64];
+    time_t now = time(NULL);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+    unsigned long interval_total = 0;
+    char line[2048];
+    int len = 0;
+    for (int i = 0; i < task_count; i++)
+    {
+        struct task_stats *entry = &stats[i];
+        unsigned long n = entry->interval_ok + entry->interval_failed;
+        unsigned long total = entry->total_ok + entry->total_failed + n;
+        if (total == 0)
+            continue;
+
+        double ok_ratio = n ? 100.0 * entry->interval_ok / n : 100.0;
+        len += snprintf(line + len, sizeof(line) - len, " | %s %lu (%.1f/s, %.0f%% ok, total %lu)",
+                        entry->task, n, (double)n / interval, ok_ratio, total);
+        if (len >= (int)sizeof(line))
+            len = sizeof(line) - 1;
+
+        interval_total += n;
+        entry->total_ok += entry->interval_ok;
+        entry->total_failed += entry->interval_failed;
+        entry->interval_ok = 0;
+        entry->interval_failed = 0;
+    }
+
+    printf("[%s] %ds: %lu msgs (%.1f/s)%s", time_str, interval, interval_total,
+           (double)interval_total / interval, len ? line : "");
+    if (ring_skipped)
+        printf(" | skipped %lu", ring_skipped);
+    if (undecodable)
+        printf(" | undecodable %lu", undecodable);
+    printf("\n");
+    fflush(stdout);
+}
+
+/* Read the shared-memory event ring: records are copied straight out of the
+   mapping, the futex is only touched when the ring runs empty */
+static int monitor_ring()
+{
+    struct shm_ring *ring;
+    while ((ring = shm_ring_attach(SHM_RING_NAME)) == NULL)
+    {
+        fprintf(stderr, "Waiting for the daemon to create %s...\n", SHM_RING_NAME);
+        sleep(1);
+    }
+    printf("Monitoring shared-memory event ring '%s'...\n", SHM_RING_NAME);
+    printf("Capacity: %d records, Record size: %d bytes\n\n", SHM_RING_CAPACITY, SHM_RING_PAYLOAD);
+
+    struct timespec next_summary;
+    clock_gettime(CLOCK_MONOTONIC, &next_summary);
+    next_summary.tv_sec += interval;
+
+    uint64_t expected = 0;
+    int first = 1;
+    while (1)
+    {
+        char msg[SHM_RING_PAYLOAD];
+        uint64_t seq;
+        size_t len = shm_ring_consume(ring, msg, sizeof(msg), &seq);
+        if (len > 0)
+        {
+            if (!first && seq != expected)
+            {
+                ring_skipped += seq - expected;
+                if (!aggregate)
+                    printf("(skipped %llu record(s))\n\n", (unsigned long long)(seq - expected));
+            }
+            first = 0;
+            expected = seq + 1;
+            handle_msg(msg, len);
+            continue;
+        }
+
+        /* Sleep until a record is published, or until the next summary is due */
+        int timeout_ms = 1000;
+        if (aggregate)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long remaining = (next_summary.tv_sec - now.tv_sec) * 1000 +
+                             (next_summary.tv_nsec - now.tv_nsec) / 1000000;
+            if (remaining <= 0)
+            {
+                print_summary();
+                next_summary.tv_sec += interval;
+                continue;
+            }
+            if (remaining < timeout_ms)
+                timeout_ms = remaining;
+        }
+
+        shm_ring_wait(ring, timeout_ms);
+        if (shm_ring_replaced(ring, SHM_RING_NAME))
+        {
+            /* The daemon restarted and created a fresh ring */
+            shm_ring_detach(ring);
+            while ((ring = shm_ring_attach(SHM_RING_NAME)) == NULL)
+                sleep(1);
+            first = 1;
+            if (!aggregate)
+                printf("Event ring was recreated, reattached\n\n");
+        }
+    }
+
+    shm_ring_detach(ring);
+    return 0;
+}
+
+/* Read the POSIX queue: epoll on the queue descriptor plus a timerfd for summaries */
+static int monitor_queue()
+{
+    mqd_t mq;
+    struct mq_attr attr = {.mq_maxmsg = MQ_MAX_MSG, .mq_msgsize = IPC_WIRE_MAX};
 
-    /* Open (or create) the message queue for reading in non-blocking mode */
-    mq = mq_open(MQ_NAME, O_RDONLY | O_NONBLOCK | O_CREAT, 0666, NULL);
+    /* Open (or create) the queue non-blocking: epoll does the waiting, reads drain it */
+    mq = mq_open(MQ_NAME, O_RDONLY | O_NONBLOCK | O_CREAT, 0666, &attr);
     if (mq == (mqd_t)-1)
     {
         perror("mq_open");
@@ -47,28 +261,96 @@ int main(void)
     }
     printf("Monitoring POSIX message queue '%s'...\n", MQ_NAME);
     printf("Max messages: %ld, Message size: %ld bytes\n\n", attr.mq_maxmsg, attr.mq_msgsize);
+    fflush(stdout);
+    char *buffer = malloc(attr.mq_msgsize); // mq_receive() wants room for the largest message
+    if (!buffer)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = (int)mq};
+    if (epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, (int)mq, &ev) == -1)
+    {
+        perror("epoll");
+        exit(EXIT_FAILURE);
+    }
+
+    int tfd = -1;
+    if (aggregate)
+    {
+        struct itimerspec spec = {{interval, 0}, {interval, 0}};
+        tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        ev.data.fd = tfd;
+        if (tfd == -1 || timerfd_settime(tfd, 0, &spec, NULL) == -1 ||
+            epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev) == -1)
+        {
+            perror("timerfd");
+            exit(EXIT_FAILURE);
+        }
+    }
 
     while (1)
     {
-        bytes_read = mq_receive(mq, buffer, MQ_MSG_SIZE, NULL);
-        if (bytes_read >= 0)
+        struct epoll_event events[2];
+        int n = epoll_wait(epfd, events, 2, -1);
+        if (n == -1)
         {
-            memcpy(&msg, buffer, sizeof(msg));
-            t = msg.timestamp;
-            strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&t));
-            printf("PID: %d | Task: %s | Result: %s | Time: %s\nMessage: %s\n\n",
-                   msg.pid, msg.task, msg.result ? "SUCCESS" : "FAILURE", time_str, msg.message);
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
         }
-        else
+
+        for (int i = 0; i < n; i++)
         {
-            if (errno != EAGAIN)
+            if (events[i].data.fd == tfd)
             {
-                perror("mq_receive");
+                uint64_t expirations;
+                if (read(tfd, &expirations, sizeof(expirations)) > 0)
+                    print_summary();
+                continue;
             }
-            usleep(500000); // 500ms
+
+            ssize_t len;
+            while ((len = mq_receive(mq, buffer, attr.mq_msgsize, NULL)) >= 0)
+                handle_msg(buffer, len);
+            if (errno != EAGAIN)
+                perror("mq_receive");
         }
     }
 
+    free(buffer);
     mq_close(mq);
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[])
+{
+    const char *transport = getenv("REPORT_DAEMON_IPC");
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--aggregate") == 0)
+        {
+            aggregate = 1;
+            if (i + 1 < argc && atoi(argv[i + 1]) > 0)
+                interval = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--transport") == 0 && i + 1 < argc &&
+                 (strcmp(argv[i + 1], "mq") == 0 || strcmp(argv[i + 1], "shm") == 0))
+            transport = argv[++i];
+        else
+        {
+            fprintf(stderr, "Usage: %s [--aggregate [SECONDS]] [--transport mq|shm]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(known_tasks) / sizeof(known_tasks[0]); i++)
+        stats_for(known_tasks[i]);
+
+    if (transport && strcmp(transport, "shm") == 0)
+        return monitor_ring();
+    return monitor_queue();
+}
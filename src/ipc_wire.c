@@ -0,0 +1,181 @@
+/* ipc_wire.c – Encoding and decoding of IPC messages (see ipc_wire.h).
+ *
+ * Linked into both the daemon and ipc_monitor, so it must not depend on
+ * the daemon's logging or IPC state.
+ */
+
+#include "ipc_wire.h"
+#include <string.h>
+
+/* Append one field if it fits; returns the new length of the event */
+static size_t put_field(char *buf, size_t size, size_t len, int type, const void *value, size_t value_len)
+{
+    struct ipc_wire_field field = {type, 0, value_len};
+    if (len + sizeof(field) + value_len > size)
+        return len;
+    memcpy(buf + len, &field, sizeof(field));
+    memcpy(buf + len + sizeof(field), value, value_len);
+    return len + sizeof(field) + value_len;
+}
+
+static size_t put_string(char *buf, size_t size, size_t len, int type, const char *value)
+{
+    if (!value)
+        return len;
+    size_t value_len = strnlen(value, UINT16_MAX - 1);
+    if (len + sizeof(struct ipc_wire_field) + value_len + 1 > size)
+        return len;
+    char *out = buf + len + sizeof(struct ipc_wire_field);
+    struct ipc_wire_field field = {type, 0, value_len + 1};
+    memcpy(buf + len, &field, sizeof(field));
+    memcpy(out, value, value_len);
+    out[value_len] = '\0';
+    return len + sizeof(field) + value_len + 1;
+}
+
+size_t ipc_wire_encode(char *buf, size_t size, const struct ipc_event *ev)
+{
+    if (size > UINT16_MAX)
+        size = UINT16_MAX;
+    if (size < sizeof(struct ipc_wire_event))
+        return 0;
+
+    size_t len = sizeof(struct ipc_wire_event);
+    len = put_string(buf, size, len, IPC_FIELD_TASK, ev->task);
+    len = put_string(buf, size, len, IPC_FIELD_FILE, ev->file);
+    len = put_string(buf, size, len, IPC_FIELD_OWNER, ev->owner);
+    len = put_string(buf, size, len, IPC_FIELD_DEPT, ev->dept);
+    if (ev->has & IPC_HAS_SIZE)
+        len = put_field(buf, size, len, IPC_FIELD_SIZE, &ev->size, sizeof(ev->size));
+    if (ev->has & IPC_HAS_DURATION)
+        len = put_field(buf, size, len, IPC_FIELD_DURATION, &ev->duration_ms, sizeof(ev->duration_ms));
+    if (ev->has & IPC_HAS_ERROR)
+        len = put_field(buf, size, len, IPC_FIELD_ERROR, &ev->error, sizeof(ev->error));
+
+    // The text goes last and takes whatever room is left
+    if (ev->message && len + sizeof(struct ipc_wire_field) + 1 <= size)
+    {
+        size_t room = size - len - sizeof(struct ipc_wire_field) - 1;
+        size_t text_len = strnlen(ev->message, room);
+        char *out = buf + len + sizeof(struct ipc_wire_field);
+        struct ipc_wire_field field = {IPC_FIELD_MESSAGE, 0, text_len + 1};
+        memcpy(buf + len, &field, sizeof(field));
+        memcpy(out, ev->message, text_len);
+        out[text_len] = '\0';
+        len += sizeof(field) + text_len + 1;
+    }
+
+    struct ipc_wire_event header = {len, ev->result ? 1 : 0, 0, ev->pid, ev->timestamp};
+    memcpy(buf, &header, sizeof(header));
+    return len;
+}
+
+size_t ipc_wire_batch(char *msg, size_t size, const char *events, size_t len, size_t *used)
+{
+    size_t out = sizeof(struct ipc_wire_header);
+    size_t taken = 0;
+    int count = 0;
+    while (taken + sizeof(struct ipc_wire_event) <= len && count < UINT8_MAX)
+    {
+        struct ipc_wire_event ev;
+        memcpy(&ev, events + taken, sizeof(ev));
+        if (out + ev.length > size)
+            break;
+        memcpy(msg + out, events + taken, ev.length);
+        out += ev.length;
+        taken += ev.length;
+        count++;
+    }
+    struct ipc_wire_header header = {IPC_WIRE_MAGIC, IPC_WIRE_VERSION, count, out};
+    memcpy(msg, &header, sizeof(header));
+    *used = taken;
+    return out;
+}
+
+int ipc_wire_decode(const char *msg, size_t len, size_t *offset, struct ipc_event *ev)
+{
+    struct ipc_wire_header header;
+    if (len < sizeof(header))
+        return -1;
+    memcpy(&header, msg, sizeof(header));
+    if (header.magic != IPC_WIRE_MAGIC || header.version != IPC_WIRE_VERSION || header.length > len)
+        return -1;
+    if (*offset == 0)
+        *offset = sizeof(header);
+    if (*offset >= header.length)
+        return 0;
+
+    struct ipc_wire_event event;
+    if (*offset + sizeof(event) > header.length)
+        return -1;
+    memcpy(&event, msg + *offset, sizeof(event));
+    if (event.length < sizeof(event) || *offset + event.length > header.length)
+        return -1;
+
+    memset(ev, 0, sizeof(*ev));
+    ev->pid = event.pid;
+    ev->result = event.result;
+    ev->timestamp = event.timestamp;
+
+    const char *end = msg + *offset + event.length;
+    const char *p = msg + *offset + sizeof(event);
+    while (p + sizeof(struct ipc_wire_field) <= end)
+    {
+        struct ipc_wire_field field;
+        memcpy(&field, p, sizeof(field));
+        const char *value = p + sizeof(field);
+        if (value + field.length > end)
+            return -1;
+        p = value + field.length;
+
+        // Strings must carry their NUL; anything else is ignored like an unknown field
+        const char *text = field.length > 0 && value[field.length - 1] == '\0' ? value : NULL;
+        switch (field.type)
+        {
+        case IPC_FIELD_TASK:
+            ev->task = text;
+            break;
+        case IPC_FIELD_MESSAGE:
+            ev->message = text;
+            break;
+        case IPC_FIELD_FILE:
+            ev->file = text;
+            break;
+        case IPC_FIELD_OWNER:
+            ev->owner = text;
+            break;
+        case IPC_FIELD_DEPT:
+            ev->dept = text;
+            break;
+        case IPC_FIELD_SIZE:
+            if (field.length == sizeof(ev->size))
+            {
+                memcpy(&ev->size, value, sizeof(ev->size));
+                ev->has |= IPC_HAS_SIZE;
+            }
+            break;
+        case IPC_FIELD_DURATION:
+            if (field.length == sizeof(ev->duration_ms))
+            {
+                memcpy(&ev->duration_ms, value, sizeof(ev->duration_ms));
+                ev->has |= IPC_HAS_DURATION;
+            }
+            break;
+        case IPC_FIELD_ERROR:
+            if (field.length == sizeof(ev->error))
+            {
+                memcpy(&ev->error, value, sizeof(ev->error));
+                ev->has |= IPC_HAS_ERROR;
+            }
+            break;
+        default:
+            break; // a newer field
+        }
+    }
+    if (!ev->task)
+        ev->task = "";
+    if (!ev->message)
+        ev->message = "";
+    *offset += event.length;
+    return 1;
+}
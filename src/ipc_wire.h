@@ -0,0 +1,101 @@
+/* ipc_wire.h – Wire format of the messages the daemon sends to its monitors.
+ *
+ * Shared by the daemon (ipc.c) and ipc_monitor so the two cannot drift apart.
+ * One queue message or ring record carries a batch of events:
+ *
+ *   struct ipc_wire_header   magic, version, event count, total length
+ *   event 1                  struct ipc_wire_event, then TLV fields
+ *   event 2 ...
+ *
+ * Every field is a struct ipc_wire_field followed by `length` bytes of
+ * value: strings include their NUL, numbers are native-endian uint64_t or
+ * int32_t (the messages never leave the host). Fields may appear in any
+ * order and a decoder skips the types it does not know, so adding a field
+ * does not need a new version; changing the layout of the headers does.
+ * Nothing is aligned: read values with memcpy().
+ */
+
+#ifndef IPC_WIRE_H
+#define IPC_WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define IPC_WIRE_MAGIC 0x5249 // "IR"
+#define IPC_WIRE_VERSION 2    // 1 was the fixed 200-byte struct task_msg
+#define IPC_WIRE_MAX 4096     // largest message, and the queue's mq_msgsize
+
+struct ipc_wire_header
+{
+    uint16_t magic;
+    uint8_t version;
+    uint8_t count;   // events in this message
+    uint32_t length; // header included
+};
+
+struct ipc_wire_event
+{
+    uint16_t length; // this header and its fields
+    uint8_t result;  // 1 for success, 0 for failure
+    uint8_t reserved;
+    uint32_t pid;
+    int64_t timestamp; // seconds since the epoch
+};
+
+struct ipc_wire_field
+{
+    uint8_t type; // IPC_FIELD_*
+    uint8_t reserved;
+    uint16_t length;
+};
+
+enum
+{
+    IPC_FIELD_TASK = 1,     // string: "CREATE", "backup", ...
+    IPC_FIELD_MESSAGE = 2,  // string: human readable text
+    IPC_FIELD_FILE = 3,     // string: file name, relative to its upload root
+    IPC_FIELD_SIZE = 4,     // uint64_t: bytes
+    IPC_FIELD_OWNER = 5,    // string: user name
+    IPC_FIELD_DEPT = 6,     // string: department id
+    IPC_FIELD_DURATION = 7, // uint64_t: milliseconds
+    IPC_FIELD_ERROR = 8,    // int32_t: errno value
+};
+
+// Optional numeric fields present in an ipc_event
+#define IPC_HAS_SIZE 0x1
+#define IPC_HAS_DURATION 0x2
+#define IPC_HAS_ERROR 0x4
+
+/* One event, decoded. Optional strings are NULL when absent; decoded
+   strings point into the message buffer. */
+struct ipc_event
+{
+    pid_t pid;
+    int result;
+    int64_t timestamp;
+    const char *task;
+    const char *message;
+    const char *file;
+    const char *owner;
+    const char *dept;
+    unsigned has; // IPC_HAS_*
+    uint64_t size;
+    uint64_t duration_ms;
+    int32_t error;
+};
+
+/* Encode one event into buf, cutting the message text if the event would
+   not fit in size bytes. Returns its length, 0 if it cannot fit at all. */
+size_t ipc_wire_encode(char *buf, size_t size, const struct ipc_event *ev);
+
+/* Pack whole encoded events from events[0..len) behind a header in msg.
+   Returns the message length and sets *used to the bytes of events taken. */
+size_t ipc_wire_batch(char *msg, size_t size, const char *events, size_t len, size_t *used);
+
+/* Decode the next event of a message, starting with *offset = 0.
+   Returns 1 for an event, 0 at the end, -1 for a malformed message or an
+   unsupported version. */
+int ipc_wire_decode(const char *msg, size_t len, size_t *offset, struct ipc_event *ev);
+
+#endif
@@ -0,0 +1,256 @@
+/* journal.c – Write-ahead journal of a backup run in progress.
+ *
+ * The manifest of BACKUP_DIR/<date> is only saved when a run ends, so a
+ * daemon that dies half way used to start over. While a run is in progress
+ * its directory also holds JOURNAL_FILE, to which every published copy is
+ * appended (name, size, mtime, hash - what the manifest needs). Records are
+ * buffered and written in checkpoints of JOURNAL_BATCH copies or
+ * JOURNAL_INTERVAL_MS: syncfs() makes the copies and their renames durable,
+ * then the records are appended and the journal fdatasync()ed, so whatever
+ * the journal holds is on disk. A completed run saves the manifest and
+ * removes the journal; a journal found later belongs to an interrupted run,
+ * and replaying it into the manifest lets the next run skip what was done.
+ *
+ * On-disk layout (native endianness, the file never leaves the host):
+ *   struct journal_header, then records of struct journal_record followed
+ *   by name_len bytes of name (no NUL). `check` covers record and name, so
+ *   a record torn by a crash ends the replay.
+ */
+
+#define _GNU_SOURCE
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+
+#define JOURNAL_MAGIC 0x4e4a4452u // "RDJN"
+#define JOURNAL_VERSION 1
+#define JOURNAL_BUFFER (64 * 1024)
+
+struct journal_header
+{
+    uint32_t magic;
+    uint32_t version;
+    int64_t started;
+};
+
+struct journal_record
+{
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint16_t name_len;
+    uint16_t reserved;
+    uint64_t hash;
+    uint64_t check; // FNV-1a of the record (with check = 0) and the name
+};
+
+struct journal
+{
+    pthread_mutex_t lock;
+    char path[MAX_PATH_BUFFER];
+    int fd;
+    int dir_fd;
+    char buffer[JOURNAL_BUFFER];
+    size_t used;
+    int pending; // records buffered since the last checkpoint
+    struct timespec checkpointed;
+};
+
+static uint64_t record_check(const struct journal_record *rec, const char *name)
+{
+    struct journal_record copy = *rec;
+    copy.check = 0;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const unsigned char *p = (const unsigned char *)&copy;
+    for (size_t i = 0; i < sizeof(copy); i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    for (size_t i = 0; i < rec->name_len; i++)
+        h = (h ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+/* Replay the records of an existing journal into m; returns how many */
+static int journal_replay(const char *path, struct manifest *m)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return 0;
+    struct journal_header header;
+    int replayed = 0;
+    if (fread(&header, sizeof(header), 1, fp) == 1 && header.magic == JOURNAL_MAGIC &&
+        header.version == JOURNAL_VERSION)
+    {
+        struct journal_record rec;
+        char name[NAME_MAX + 1];
+        while (fread(&rec, sizeof(rec), 1, fp) == 1 && rec.name_len > 0 && rec.name_len <= NAME_MAX &&
+               fread(name, 1, rec.name_len, fp) == rec.name_len && rec.check == record_check(&rec, name))
+        {
+            name[rec.name_len] = '\0';
+            struct stat st;
+            memset(&st, 0, sizeof(st));
+            st.st_size = rec.size;
+            st.st_mtim.tv_sec = rec.mtime_sec;
+            st.st_mtim.tv_nsec = rec.mtime_nsec;
+            manifest_update(m, name, &st, rec.hash);
+            replayed++;
+        }
+    }
+    fclose(fp);
+    return replayed;
+}
+
+/* Remove ".<name>.part" copies left behind by an interrupted run */
+static void remove_partial_copies(int dir_fd)
+{
+    DIR *dir = fdopendir(dup(dir_fd));
+    if (!dir)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(entry->d_name);
+        if (entry->d_name[0] == '.' && len > 6 && strcmp(entry->d_name + len - 5, ".part") == 0)
+            unlinkat(dirfd(dir), entry->d_name, 0);
+    }
+    closedir(dir);
+}
+
+struct journal *journal_open(const char *backup_dir, struct manifest *m)
+{
+    struct journal *j = calloc(1, sizeof(*j));
+    if (!j)
+        return NULL;
+    pthread_mutex_init(&j->lock, NULL);
+    snprintf(j->path, sizeof(j->path), "%s/%s", backup_dir, JOURNAL_FILE);
+    j->dir_fd = open(backup_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (j->dir_fd == -1)
+    {
+        free(j);
+        return NULL;
+    }
+
+    if (access(j->path, F_OK) == 0)
+    {
+        int replayed = m ? journal_replay(j->path, m) : 0;
+        remove_partial_copies(j->dir_fd);
+        char msg[MAX_PATH_BUFFER + 96];
+        snprintf(msg, sizeof(msg), "Resuming interrupted backup of %s: %d file(s) already copied", backup_dir, replayed);
+        log_event("INFO", "backup", msg);
+        ipc_send(ipc_default(), "backup", 1, msg);
+    }
+
+    /* Start a fresh journal: the replayed state now lives in the manifest
+       and is checkpointed again below before anything new is recorded */
+    char tmp_path[MAX_PATH_BUFFER + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", j->path);
+    j->fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    struct journal_header header = {JOURNAL_MAGIC, JOURNAL_VERSION, time(NULL)};
+    if (j->fd == -1 || write(j->fd, &header, sizeof(header)) != sizeof(header))
+        goto fail;
+    if (m && manifest_save(m) == -1) // replayed entries must survive the old journal
+        goto fail;
+    if (fdatasync(j->fd) == -1 || rename(tmp_path, j->path) == -1)
+        goto fail;
+    fsync(j->dir_fd);
+    clock_gettime(CLOCK_MONOTONIC, &j->checkpointed);
+    return j;
+
+fail:
+    {
+        char err[MAX_PATH_BUFFER + 64];
+        snprintf(err, sizeof(err), "Failed to start backup journal %s: %s", j->path, strerror(errno));
+        log_message("ERROR", err);
+    }
+    if (j->fd != -1)
+    {
+        close(j->fd);
+        unlink(tmp_path);
+    }
+    close(j->dir_fd);
+    free(j);
+    return NULL;
+}
+
+/* Make buffered records durable. Caller holds j->lock. */
+static int checkpoint_locked(struct journal *j)
+{
+    if (j->used == 0)
+        return 0;
+    int ok = syncfs(j->dir_fd) == 0 && write(j->fd, j->buffer, j->used) == (ssize_t)j->used &&
+             fdatasync(j->fd) == 0;
+    if (!ok)
+    {
+        char err[MAX_PATH_BUFFER + 64];
+        snprintf(err, sizeof(err), "Failed to checkpoint backup journal %s: %s", j->path, strerror(errno));
+        log_message("ERROR", err);
+    }
+    j->used = 0;
+    j->pending = 0;
+    clock_gettime(CLOCK_MONOTONIC, &j->checkpointed);
+    return ok ? 0 : -1;
+}
+
+void journal_record(struct journal *j, const char *name, const struct stat *st, uint64_t hash)
+{
+    if (!j)
+        return;
+    size_t name_len = strlen(name);
+    struct journal_record rec = {st->st_size, st->st_mtim.tv_sec, (uint32_t)st->st_mtim.tv_nsec,
+                                 (uint16_t)name_len, 0, hash, 0};
+    rec.check = record_check(&rec, name);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&j->lock);
+    if (j->used + sizeof(rec) + name_len > sizeof(j->buffer))
+        checkpoint_locked(j);
+    memcpy(j->buffer + j->used, &rec, sizeof(rec));
+    memcpy(j->buffer + j->used + sizeof(rec), name, name_len);
+    j->used += sizeof(rec) + name_len;
+    j->pending++;
+
+    long elapsed_ms = (now.tv_sec - j->checkpointed.tv_sec) * 1000 + (now.tv_nsec - j->checkpointed.tv_nsec) / 1000000;
+    if (j->pending >= JOURNAL_BATCH || elapsed_ms >= JOURNAL_INTERVAL_MS)
+        checkpoint_locked(j);
+    pthread_mutex_unlock(&j->lock);
+}
+
+void journal_close(struct journal *j, int complete)
+{
+    if (!j)
+        return;
+    pthread_mutex_lock(&j->lock);
+    if (complete)
+        unlink(j->path); // the manifest now holds everything
+    else
+        checkpoint_locked(j);
+    pthread_mutex_unlock(&j->lock);
+    close(j->fd);
+    close(j->dir_fd);
+    pthread_mutex_destroy(&j->lock);
+    free(j);
+}
+
+int journal_pending(char dates[][16], int max)
+{
+    DIR *dir = opendir(BACKUP_DIR);
+    if (!dir)
+        return 0;
+    int count = 0;
+    struct dirent *entry;
+    while (count < max && (entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.' || strlen(entry->d_name) >= 16)
+            continue;
+        char path[MAX_PATH_BUFFER];
+        snprintf(path, sizeof(path), "%s/%s/%s", BACKUP_DIR, entry->d_name, JOURNAL_FILE);
+        if (access(path, F_OK) == 0)
+            snprintf(dates[count++], 16, "%s", entry->d_name);
+    }
+    closedir(dir);
+    return count;
+}
@@ -3,31 +3,355 @@
 #include <string.h>
 #include <errno.h>
 #include <syslog.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
-void log_message(const char *type, const char *message)
+/*
+ * Asynchronous logger.
+ *
+ * Every process keeps LOG_FILE open once and formats records into an in-memory
+ * ring. A background flusher thread drains the ring with a single writev() per
+ * batch, either when LOG_FLUSH_INTERVAL_MS elapses or when the ring passes
+ * LOG_FLUSH_THRESHOLD. Producers only block when the ring is completely full.
+ *
+ * With REPORT_DAEMON_LOG_FORMAT=binary the ring holds binary records instead
+ * of text lines and the flusher hands each batch to binlog_write(), which
+ * appends them to rotating segments in LOG_SEGMENT_DIR (see binlog.c).
+ */
+
+#define LOG_RING_SIZE (256 * 1024)
+#define LOG_FLUSH_THRESHOLD (LOG_RING_SIZE / 4)
+#define LOG_FLUSH_INTERVAL_MS 200
+#define LOG_LINE_MAX 2048
+
+static struct
+{
+    pid_t owner;          // process the flusher thread belongs to (0 = not started)
+    int fd;               // LOG_FILE, opened O_APPEND once per process (text format)
+    int binary;           // records go to binlog segments instead of LOG_FILE
+    int threaded;         // 1 when the flusher thread is running
+    int stop;             // asks the flusher to drain and exit
+    int flush_requested;  // asks the flusher to write without waiting for the interval
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // producer -> flusher
+    pthread_cond_t drained; // flusher -> producers waiting for space or a flush
+    unsigned long head;     // bytes ever written into the ring
+    unsigned long tail;     // bytes ever written to the file
+    time_t ts_second;       // second the cached timestamp was formatted for
+    char ts_cached[32];
+    char ring[LOG_RING_SIZE];
+    char batch[LOG_RING_SIZE]; // binary format: the drained records, made contiguous
+} logger = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .drained = PTHREAD_COND_INITIALIZER,
+};
+
+static int atfork_registered = 0;
+
+/* Format the current time, reusing the previous string within the same second.
+   Caller must hold logger.lock. */
+static const char *cached_timestamp()
 {
-    FILE *log = fopen(LOG_FILE, "a");
-    if (log)
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts); // time() may lag by a tick and mislabel timer-driven records
+    time_t now = ts.tv_sec;
+    if (now != logger.ts_second || logger.ts_cached[0] == '\0')
+    {
+        struct tm tm_info;
+        localtime_r(&now, &tm_info);
+        strftime(logger.ts_cached, sizeof(logger.ts_cached), "%Y-%m-%d %H:%M:%S", &tm_info);
+        logger.ts_second = now;
+    }
+    return logger.ts_cached;
+}
+
+/* Write [tail, head) to the log file. The lock is released during the syscall
+   so producers can keep appending behind the region being written. */
+static void drain_ring_locked()
+{
+    if (logger.binary)
+    {
+        /* Records never wrap in binlog_write(): hand it a contiguous copy */
+        while (logger.tail != logger.head)
+        {
+            unsigned long start = logger.tail;
+            unsigned long used = logger.head - logger.tail;
+            size_t offset = start % LOG_RING_SIZE;
+            size_t first = offset + used <= LOG_RING_SIZE ? used : LOG_RING_SIZE - offset;
+            memcpy(logger.batch, logger.ring + offset, first);
+            memcpy(logger.batch + first, logger.ring, used - first);
+
+            pthread_mutex_unlock(&logger.lock);
+            binlog_write(logger.batch, used);
+            pthread_mutex_lock(&logger.lock);
+            logger.tail = start + used;
+            pthread_cond_broadcast(&logger.drained);
+        }
+        return;
+    }
+
+    while (logger.tail != logger.head)
     {
-        time_t now;
-        struct tm *tm_info;
-        char timestamp[26];
+        unsigned long start = logger.tail;
+        unsigned long used = logger.head - logger.tail;
+        size_t offset = start % LOG_RING_SIZE;
+        struct iovec iov[2];
+        int iovcnt = 1;
+
+        iov[0].iov_base = logger.ring + offset;
+        if (offset + used <= LOG_RING_SIZE)
+        {
+            iov[0].iov_len = used;
+        }
+        else
+        {
+            iov[0].iov_len = LOG_RING_SIZE - offset;
+            iov[1].iov_base = logger.ring;
+            iov[1].iov_len = used - iov[0].iov_len;
+            iovcnt = 2;
+        }
 
-        time(&now);
-        tm_info = localtime(&now);
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
+        pthread_mutex_unlock(&logger.lock);
+        ssize_t written = writev(logger.fd, iov, iovcnt);
+        pthread_mutex_lock(&logger.lock);
 
-        if (fprintf(log, "[%s] %-7s %s\n", timestamp, type, message) < 0)
+        if (written < 0)
         {
-            // If fprintf fails, try to log to stderr
-            fprintf(stderr, "Error writing to log file\n");
+            if (errno == EINTR)
+                continue;
+            // Nothing sensible left to do with these records; drop them so producers never stall
+            fprintf(stderr, "Error writing to log file: %s\n", strerror(errno));
+            written = used;
+        }
+        logger.tail = start + written;
+        pthread_cond_broadcast(&logger.drained);
+    }
+}
+
+static void *flusher_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&logger.lock);
+    while (1)
+    {
+        while (!logger.stop && !logger.flush_requested &&
+               logger.head - logger.tail < LOG_FLUSH_THRESHOLD)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            if (pthread_cond_timedwait(&logger.wake, &logger.lock, &deadline) == ETIMEDOUT)
+                break;
         }
 
-        fclose(log);
+        logger.flush_requested = 0;
+        drain_ring_locked();
+
+        if (logger.stop)
+            break;
+    }
+    pthread_mutex_unlock(&logger.lock);
+    return NULL;
+}
+
+/* Keep the mutex consistent across fork(): the child gets a fresh logger and
+   discards records that still belong to the parent's flusher. */
+static void atfork_prepare()
+{
+    pthread_mutex_lock(&logger.lock);
+}
+
+static void atfork_parent()
+{
+    pthread_mutex_unlock(&logger.lock);
+}
+
+static void atfork_child()
+{
+    logger.owner = 0;
+    logger.threaded = 0;
+    logger.stop = 0;
+    logger.flush_requested = 0;
+    logger.tail = logger.head;
+    pthread_mutex_unlock(&logger.lock);
+}
+
+static void logger_atexit()
+{
+    log_shutdown();
+}
+
+/* Lazily open the log file and start the flusher for the current process.
+   Caller must hold logger.lock. */
+static int logger_start_locked()
+{
+    pid_t self = getpid();
+    if (logger.owner == self)
+        return logger.binary || logger.fd >= 0 ? 0 : -1;
+
+    if (!atfork_registered)
+    {
+        pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+        atexit(logger_atexit);
+        atfork_registered = 1;
+    }
+
+    logger.owner = self;
+    logger.threaded = 0;
+    logger.stop = 0;
+    logger.binary = binlog_enabled();
+    if (!logger.binary && logger.fd < 0)
+    {
+        logger.fd = open(LOG_FILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+        if (logger.fd < 0)
+        {
+            fprintf(stderr, "Cannot open log file: %s\n", strerror(errno));
+            return -1;
+        }
     }
+
+    if (pthread_create(&logger.thread, NULL, flusher_main, NULL) == 0)
+    {
+        logger.threaded = 1;
+    }
+    return 0;
+}
+
+void log_message(const char *type, const char *message)
+{
+    log_event(type, NULL, message);
+}
+
+void log_event(const char *type, const char *event, const char *message)
+{
+    char line[LOG_LINE_MAX];
+
+    pthread_mutex_lock(&logger.lock);
+    if (logger_start_locked() == -1)
+    {
+        pthread_mutex_unlock(&logger.lock);
+        return;
+    }
+
+    int len;
+    if (logger.binary)
+        len = binlog_encode(line, sizeof(line), type, event, message);
     else
+        len = snprintf(line, sizeof(line), "[%s] %-7s %s\n", cached_timestamp(), type, message);
+    if (len < 0)
+    {
+        pthread_mutex_unlock(&logger.lock);
+        fprintf(stderr, "Error writing to log file\n");
+        return;
+    }
+    if (!logger.binary && (size_t)len >= sizeof(line))
+    {
+        // Keep oversized records on one line
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+
+    if (!logger.threaded || logger.stop)
+    {
+        // No flusher available (or it is shutting down): fall back to a direct append
+        pthread_mutex_unlock(&logger.lock);
+        if (logger.binary)
+            binlog_write(line, len);
+        else if (write(logger.fd, line, len) < 0)
+            fprintf(stderr, "Error writing to log file\n");
+        return;
+    }
+
+    while (LOG_RING_SIZE - (logger.head - logger.tail) < (unsigned long)len)
+    {
+        logger.flush_requested = 1;
+        pthread_cond_signal(&logger.wake);
+        pthread_cond_wait(&logger.drained, &logger.lock);
+    }
+
+    size_t offset = logger.head % LOG_RING_SIZE;
+    size_t first = LOG_RING_SIZE - offset;
+    if (first >= (size_t)len)
     {
-        // If we can't open the log file, write to stderr
-        fprintf(stderr, "Cannot open log file: %s\n", strerror(errno));
+        memcpy(logger.ring + offset, line, len);
     }
-}
\ No newline at end of file
+    else
+    {
+        memcpy(logger.ring + offset, line, first);
+        memcpy(logger.ring, line + first, len - first);
+    }
+    logger.head += len;
+
+    if (logger.head - logger.tail >= LOG_FLUSH_THRESHOLD)
+        pthread_cond_signal(&logger.wake);
+    pthread_mutex_unlock(&logger.lock);
+}
+
+void log_flush()
+{
+    pthread_mutex_lock(&logger.lock);
+    if (logger.owner == getpid() && logger.threaded)
+    {
+        unsigned long target = logger.head;
+        logger.flush_requested = 1;
+        pthread_cond_signal(&logger.wake);
+        while (logger.tail < target)
+            pthread_cond_wait(&logger.drained, &logger.lock);
+    }
+    pthread_mutex_unlock(&logger.lock);
+}
+
+void log_reopen()
+{
+    if (logger.binary)
+    {
+        binlog_rotate(); // continue in a fresh segment
+        return;
+    }
+    int fd = open(LOG_FILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Cannot reopen log file: %s\n", strerror(errno));
+        return;
+    }
+
+    // Records already buffered go to the new file; dup2 keeps the descriptor number stable
+    pthread_mutex_lock(&logger.lock);
+    if (logger.fd < 0)
+        logger.fd = fd;
+    else
+    {
+        dup2(fd, logger.fd);
+        close(fd);
+    }
+    pthread_mutex_unlock(&logger.lock);
+}
+
+void log_shutdown()
+{
+    pthread_mutex_lock(&logger.lock);
+    if (logger.owner != getpid() || !logger.threaded)
+    {
+        pthread_mutex_unlock(&logger.lock);
+        return;
+    }
+    logger.stop = 1;
+    pthread_cond_signal(&logger.wake);
+    pthread_mutex_unlock(&logger.lock);
+
+    pthread_join(logger.thread, NULL);
+
+    pthread_mutex_lock(&logger.lock);
+    logger.threaded = 0;
+    pthread_mutex_unlock(&logger.lock);
+    if (logger.binary)
+        binlog_close();
+}
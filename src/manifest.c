@@ -0,0 +1,336 @@
+/* manifest.c – Per backup directory record of what has already been copied.
+ *
+ * Each BACKUP_DIR/<date> holds a MANIFEST_FILE table of name, size, mtime and
+ * a 64-bit FNV-1a content hash for every file backed up into it. A backup run
+ * skips sources whose size and mtime still match their entry (and whose copy
+ * is still present), and the hashes let a backup be verified later without
+ * touching the reporting directory.
+ *
+ * On-disk layout (native endianness, the file never leaves the host):
+ *   struct manifest_header, then `count` records of
+ *   struct manifest_record followed by name_len bytes of name (no NUL).
+ */
+
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+
+#define MANIFEST_MAGIC 0x464d4452u // "RDMF"
+#define MANIFEST_VERSION 1
+#define HASH_BUFFER_SIZE (256 * 1024)
+
+struct manifest_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct manifest_record
+{
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint16_t name_len;
+    uint16_t reserved;
+    uint64_t hash;
+};
+
+struct manifest_entry
+{
+    char *name;
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint64_t hash;
+};
+
+struct manifest
+{
+    pthread_mutex_t lock;
+    char dir[MAX_PATH_BUFFER];
+    struct manifest_entry *entries;
+    size_t count;
+    size_t sorted; // entries[0..sorted) are ordered by name, the rest were added this run
+    size_t capacity;
+    int dirty;
+};
+
+static int entry_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct manifest_entry *)a)->name, ((const struct manifest_entry *)b)->name);
+}
+
+/* Find an entry: binary search over the sorted part, linear over this run's additions.
+   Caller must hold m->lock. */
+static struct manifest_entry *find_entry(struct manifest *m, const char *name)
+{
+    struct manifest_entry key = {.name = (char *)name};
+    struct manifest_entry *hit = bsearch(&key, m->entries, m->sorted, sizeof(key), entry_cmp);
+    if (hit)
+        return hit;
+    for (size_t i = m->sorted; i < m->count; i++)
+    {
+        if (strcmp(m->entries[i].name, name) == 0)
+            return &m->entries[i];
+    }
+    return NULL;
+}
+
+static int append_entry(struct manifest *m, const char *name, size_t name_len)
+{
+    if (m->count == m->capacity)
+    {
+        size_t capacity = m->capacity ? m->capacity * 2 : 64;
+        struct manifest_entry *grown = realloc(m->entries, capacity * sizeof(*grown));
+        if (!grown)
+            return -1;
+        m->entries = grown;
+        m->capacity = capacity;
+    }
+    char *copy = malloc(name_len + 1);
+    if (!copy)
+        return -1;
+    memcpy(copy, name, name_len);
+    copy[name_len] = '\0';
+    memset(&m->entries[m->count], 0, sizeof(m->entries[0]));
+    m->entries[m->count].name = copy;
+    m->count++;
+    return 0;
+}
+
+/* FNV-1a over everything readable from fd, through pread() into a bounded
+   buffer: unlike a mapping, a file truncated meanwhile just ends early */
+int hash_fd(int fd, uint64_t *hash)
+{
+    unsigned char *buffer = malloc(HASH_BUFFER_SIZE);
+    if (!buffer)
+        return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint64_t h = 0xcbf29ce484222325ULL;
+    off_t offset = 0;
+    ssize_t n;
+    while ((n = pread(fd, buffer, HASH_BUFFER_SIZE, offset)) != 0)
+    {
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            free(buffer);
+            return -1;
+        }
+        for (ssize_t i = 0; i < n; i++)
+        {
+            h ^= buffer[i];
+            h *= 0x100000001b3ULL;
+        }
+        offset += n;
+    }
+    free(buffer);
+    *hash = h;
+    return 0;
+}
+
+int hash_file(const char *path, uint64_t *hash)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int rc = hash_fd(fd, hash);
+    close(fd);
+    return rc;
+}
+
+struct manifest *manifest_load(const char *dir)
+{
+    struct manifest *m = calloc(1, sizeof(*m));
+    if (!m)
+        return NULL;
+    pthread_mutex_init(&m->lock, NULL);
+    snprintf(m->dir, sizeof(m->dir), "%s", dir);
+
+    char path[MAX_PATH_BUFFER];
+    snprintf(path, sizeof(path), "%s/%s", dir, MANIFEST_FILE);
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return m; // first backup into this directory
+
+    struct manifest_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != MANIFEST_MAGIC ||
+        header.version != MANIFEST_VERSION)
+    {
+        log_message("WARNING", "Ignoring unreadable backup manifest, doing a full backup");
+        fclose(fp);
+        return m;
+    }
+
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        struct manifest_record rec;
+        char name[NAME_MAX + 1];
+        if (fread(&rec, sizeof(rec), 1, fp) != 1 || rec.name_len > NAME_MAX ||
+            fread(name, 1, rec.name_len, fp) != rec.name_len || append_entry(m, name, rec.name_len) == -1)
+        {
+            log_message("WARNING", "Backup manifest is truncated, unreadable entries will be copied again");
+            break;
+        }
+        struct manifest_entry *e = &m->entries[m->count - 1];
+        e->size = rec.size;
+        e->mtime_sec = rec.mtime_sec;
+        e->mtime_nsec = rec.mtime_nsec;
+        e->hash = rec.hash;
+    }
+    fclose(fp);
+
+    // Files are written sorted, but do not rely on it
+    qsort(m->entries, m->count, sizeof(m->entries[0]), entry_cmp);
+    m->sorted = m->count;
+    return m;
+}
+
+/* 1 if name was backed up with this size/mtime and its copy is still in place */
+int manifest_is_current(struct manifest *m, const char *name, const struct stat *st)
+{
+    pthread_mutex_lock(&m->lock);
+    struct manifest_entry *e = find_entry(m, name);
+    int current = e && e->size == (uint64_t)st->st_size && e->mtime_sec == st->st_mtim.tv_sec &&
+                  e->mtime_nsec == (uint32_t)st->st_mtim.tv_nsec;
+    pthread_mutex_unlock(&m->lock);
+
+    if (current)
+    {
+        char path[MAX_PATH_BUFFER];
+        struct stat dst;
+        snprintf(path, sizeof(path), "%s/%s", m->dir, name);
+        current = stat(path, &dst) == 0 && dst.st_size == st->st_size;
+    }
+    return current;
+}
+
+void manifest_update(struct manifest *m, const char *name, const struct stat *st, uint64_t hash)
+{
+    pthread_mutex_lock(&m->lock);
+    struct manifest_entry *e = find_entry(m, name);
+    if (!e && append_entry(m, name, strlen(name)) == 0)
+        e = &m->entries[m->count - 1];
+    if (e)
+    {
+        e->size = st->st_size;
+        e->mtime_sec = st->st_mtim.tv_sec;
+        e->mtime_nsec = st->st_mtim.tv_nsec;
+        e->hash = hash;
+        m->dirty = 1;
+    }
+    pthread_mutex_unlock(&m->lock);
+}
+
+/* Write the manifest to a temporary file and rename it into place */
+int manifest_save(struct manifest *m)
+{
+    pthread_mutex_lock(&m->lock);
+    if (!m->dirty)
+    {
+        pthread_mutex_unlock(&m->lock);
+        return 0;
+    }
+
+    qsort(m->entries, m->count, sizeof(m->entries[0]), entry_cmp);
+    m->sorted = m->count;
+
+    char path[MAX_PATH_BUFFER];
+    char tmp_path[MAX_PATH_BUFFER];
+    snprintf(path, sizeof(path), "%s/%s", m->dir, MANIFEST_FILE);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    int ret = -1;
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp)
+    {
+        struct manifest_header header = {MANIFEST_MAGIC, MANIFEST_VERSION, (uint32_t)m->count, 0};
+        int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+        for (size_t i = 0; ok && i < m->count; i++)
+        {
+            struct manifest_entry *e = &m->entries[i];
+            struct manifest_record rec = {e->size, e->mtime_sec, e->mtime_nsec,
+                                          (uint16_t)strlen(e->name), 0, e->hash};
+            ok = fwrite(&rec, sizeof(rec), 1, fp) == 1 &&
+                 fwrite(e->name, 1, rec.name_len, fp) == rec.name_len;
+        }
+        ok = fflush(fp) == 0 && fdatasync(fileno(fp)) == 0 && ok;
+        if (fclose(fp) == 0 && ok && rename(tmp_path, path) == 0)
+        {
+            ret = 0;
+            m->dirty = 0;
+        }
+        else
+        {
+            unlink(tmp_path);
+        }
+    }
+
+    if (ret == -1)
+    {
+        char err[MAX_PATH_BUFFER + 64];
+        snprintf(err, sizeof(err), "Failed to write backup manifest %s: %s", path, strerror(errno));
+        log_message("ERROR", err);
+    }
+    pthread_mutex_unlock(&m->lock);
+    return ret;
+}
+
+void manifest_free(struct manifest *m)
+{
+    if (!m)
+        return;
+    for (size_t i = 0; i < m->count; i++)
+        free(m->entries[i].name);
+    free(m->entries);
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+}
+
+/* Re-hash every file listed in dir's manifest and compare against the recorded
+   hash. Prints one line per problem; returns the number of bad or missing files. */
+int manifest_verify(const char *dir)
+{
+    char path[MAX_PATH_BUFFER];
+    snprintf(path, sizeof(path), "%s/%s", dir, MANIFEST_FILE);
+    if (access(path, F_OK) == -1)
+    {
+        fprintf(stderr, "No backup manifest in %s\n", dir);
+        return -1;
+    }
+
+    struct manifest *m = manifest_load(dir);
+    if (!m)
+        return -1;
+
+    int bad = 0;
+    for (size_t i = 0; i < m->count; i++)
+    {
+        struct manifest_entry *e = &m->entries[i];
+        uint64_t hash;
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->name);
+
+        if (stat(path, &st) == -1 || hash_file(path, &hash) == -1)
+        {
+            printf("MISSING  %s\n", e->name);
+            bad++;
+        }
+        else if ((uint64_t)st.st_size != e->size || hash != e->hash)
+        {
+            printf("CORRUPT  %s\n", e->name);
+            bad++;
+        }
+    }
+    printf("Verified %zu files in %s: %d problem(s)\n", m->count, dir, bad);
+    manifest_free(m);
+    return bad;
+}
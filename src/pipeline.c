@@ -0,0 +1,604 @@
+/* pipeline.c – In-process upload pipeline: watcher thread and worker pool
+ *
+ * The upload monitor used to be a forked process of its own. It now runs as
+ * the watcher thread of the daemon: it owns the watch manager, coalescing
+ * and the presence index, and hands every coalesced event to a pool of
+ * worker threads for the slow part, in stages:
+ *
+ *   enrich   stat the file, resolve its owner, log and report the event,
+ *            tag late uploads
+ *   ingest   validate a finished .xml upload and file it into the reporting
+ *            directory (REPORT_DAEMON_STREAM_INGEST=1 only)
+ *
+ * Events of one file must be handled in the order they happened (a CREATE
+ * ingested after the DELETE that followed it would resurrect the file), so
+ * jobs are sharded strictly by path hash: one shard per worker, each a
+ * bounded lock-free MPMC queue (a ring of sequence-numbered slots, the same
+ * scheme as shm_ring.c). A shard is served by one worker at a time, in
+ * queue order, and a job runs all its stages on that worker before the
+ * next job of the shard starts. Stealing moves whole shards, never single
+ * jobs: a shard with work is marked ready and gets one semaphore post, a
+ * worker that gets past sem_wait() claims a ready shard (its own first)
+ * and drains it. Idle workers sleep in sem_wait(). When a shard's queue is
+ * full the submitter waits for room instead of running the job out of
+ * order.
+ *
+ * The main thread keeps scheduling and control. It asks the watcher for work
+ * that needs the watcher's state (the deadline check reads its presence
+ * index) with pipeline_control(), which sets a request bit and wakes the
+ * watcher through an eventfd.
+ */
+
+#define _GNU_SOURCE
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#define CACHELINE 64
+#define SHARD_BATCH 32 // jobs a worker takes from a shard before giving others a turn
+
+#define SHARD_IDLE 0    // empty, or about to be re-checked by its last worker
+#define SHARD_READY 1   // has jobs and one semaphore post waiting for a worker
+#define SHARD_RUNNING 2 // being drained by exactly one worker
+
+#define STAGE_ENRICH 0
+#define STAGE_INGEST 1
+#define STAGE_COUNT 2
+
+static const char *const stage_names[STAGE_COUNT] = {"enrich", "ingest"};
+
+struct pipeline_job
+{
+    int stage;
+    time_t when; // wall clock time of the event
+    struct timespec queued;
+    char event[16];
+    size_t display; // offset of the name relative to its upload root
+    char path[];
+};
+
+struct queue_slot
+{
+    _Atomic uint64_t seq; // == position when free, position + 1 once filled
+    struct pipeline_job *job;
+};
+
+/* Bounded MPMC ring: the watcher pushes, whichever worker holds the shard
+   (state SHARD_RUNNING) pops */
+struct job_queue
+{
+    _Alignas(CACHELINE) _Atomic uint64_t head; // next position to fill
+    _Alignas(CACHELINE) _Atomic uint64_t tail; // next position to take
+    _Alignas(CACHELINE) _Atomic int state;     // SHARD_*
+    _Alignas(CACHELINE) struct queue_slot slots[PIPELINE_QUEUE_SLOTS];
+};
+
+struct stage_stats
+{
+    _Atomic long depth; // jobs of this stage queued right now
+    _Atomic long max_depth;
+    _Atomic uint64_t processed;
+    _Atomic uint64_t stolen;   // run by a worker other than the shard's own
+    _Atomic uint64_t inlined;  // run by the submitter because the pool was not running
+    _Atomic uint64_t full;     // submissions that had to wait for room in their shard
+    _Atomic uint64_t wait_ns;  // queued -> started
+    _Atomic uint64_t service_ns;
+};
+
+struct worker
+{
+    pthread_t thread;
+    int index;
+    int cpu; // -1 = not pinned
+    struct job_queue *queue;
+};
+
+static struct
+{
+    int running;
+    int worker_count; // shards
+    int started;      // worker threads (all shards are served, by stealing if need be)
+    struct worker *workers;
+    sem_t jobs; // one post per SHARD_READY shard (plus one per worker at shutdown)
+    _Atomic int stopping;
+
+    pthread_t watcher;
+    int watcher_started;
+    _Atomic int watcher_alive; // cleared when monitor_directory() returns, for whatever reason
+    _Atomic int watcher_stopping;
+    int watcher_cpu;
+    int control_fd;
+    _Atomic unsigned requests;
+
+    struct stage_stats stats[STAGE_COUNT];
+    time_t stats_logged;
+    uint64_t stats_last_processed;
+} pipe_state = {.control_fd = -1};
+
+static int64_t ns_between(const struct timespec *a, const struct timespec *b)
+{
+    return (int64_t)(b->tv_sec - a->tv_sec) * 1000000000LL + (b->tv_nsec - a->tv_nsec);
+}
+
+static void queue_init(struct job_queue *q)
+{
+    for (uint64_t i = 0; i < PIPELINE_QUEUE_SLOTS; i++)
+        atomic_init(&q->slots[i].seq, i);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->state, SHARD_IDLE);
+}
+
+static int queue_push(struct job_queue *q, struct pipeline_job *job)
+{
+    uint64_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    for (;;)
+    {
+        struct queue_slot *slot = &q->slots[pos & (PIPELINE_QUEUE_SLOTS - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                slot->job = job;
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        }
+        else if (diff < 0)
+            return -1; // full
+        else
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+}
+
+static int queue_empty(struct job_queue *q)
+{
+    uint64_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    struct queue_slot *slot = &q->slots[pos & (PIPELINE_QUEUE_SLOTS - 1)];
+    return atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1;
+}
+
+static struct pipeline_job *queue_pop(struct job_queue *q)
+{
+    uint64_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for (;;)
+    {
+        struct queue_slot *slot = &q->slots[pos & (PIPELINE_QUEUE_SLOTS - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - (pos + 1));
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                struct pipeline_job *job = slot->job;
+                atomic_store_explicit(&slot->seq, pos + PIPELINE_QUEUE_SLOTS, memory_order_release);
+                return job;
+            }
+        }
+        else if (diff < 0)
+            return NULL; // empty
+        else
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+}
+
+/* Run job through all its stages, then free it */
+static void stage_run(struct pipeline_job *job)
+{
+    for (;;)
+    {
+        struct stage_stats *s = &pipe_state.stats[job->stage];
+        struct timespec started, finished;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+
+        int next = -1;
+        if (job->stage == STAGE_ENRICH)
+        {
+            report_file_event(job->event, job->path, job->display, job->when);
+            if (strcmp(job->event, "CREATE") == 0 && ingest_enabled())
+                next = STAGE_INGEST;
+        }
+        else if (job->stage == STAGE_INGEST)
+            ingest_report(job->path);
+
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        atomic_fetch_add_explicit(&s->processed, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->wait_ns, ns_between(&job->queued, &started), memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->service_ns, ns_between(&started, &finished), memory_order_relaxed);
+
+        if (next == -1)
+            break;
+        /* Next stage right here, still holding the shard: a later event of
+           the same file must not overtake it */
+        job->stage = next;
+        job->queued = finished;
+    }
+    free(job);
+}
+
+/* Mark a shard that has jobs ready and wake one worker for it, unless it
+   is already ready or being drained */
+static void shard_wake(struct job_queue *q)
+{
+    int idle = SHARD_IDLE;
+    if (atomic_compare_exchange_strong(&q->state, &idle, SHARD_READY))
+        sem_post(&pipe_state.jobs);
+}
+
+/* Queue job on its shard, waiting while the shard is full; run it here
+   when the pool is not running */
+static void job_dispatch(struct pipeline_job *job, int shard)
+{
+    struct stage_stats *s = &pipe_state.stats[job->stage];
+    clock_gettime(CLOCK_MONOTONIC, &job->queued);
+
+    if (!pipe_state.running || atomic_load_explicit(&pipe_state.stopping, memory_order_relaxed))
+    {
+        atomic_fetch_add_explicit(&s->inlined, 1, memory_order_relaxed);
+        stage_run(job);
+        return;
+    }
+
+    long depth = atomic_fetch_add_explicit(&s->depth, 1, memory_order_relaxed) + 1;
+    long max = atomic_load_explicit(&s->max_depth, memory_order_relaxed);
+    while (depth > max && !atomic_compare_exchange_weak_explicit(&s->max_depth, &max, depth, memory_order_relaxed,
+                                                                 memory_order_relaxed))
+        ;
+    struct job_queue *q = pipe_state.workers[shard].queue;
+    if (queue_push(q, job) != 0)
+    {
+        atomic_fetch_add_explicit(&s->full, 1, memory_order_relaxed);
+        do
+        {
+            shard_wake(q);
+            sched_yield();
+        } while (queue_push(q, job) != 0);
+    }
+    // Pairs with the fence in shard_drain(): either it sees this job or we see the shard idle
+    atomic_thread_fence(memory_order_seq_cst);
+    shard_wake(q);
+}
+
+int pipeline_submit(const char *event, const char *path, size_t display)
+{
+    size_t len = strlen(path);
+    struct pipeline_job *job = malloc(sizeof(*job) + len + 1);
+    if (!job)
+    {
+        report_file_event(event, path, display, time(NULL));
+        return -1;
+    }
+    job->stage = STAGE_ENRICH;
+    job->when = time(NULL);
+    snprintf(job->event, sizeof(job->event), "%s", event);
+    job->display = display;
+    memcpy(job->path, path, len + 1);
+
+    int shard = 0;
+    if (pipe_state.worker_count > 0)
+    {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < len; i++)
+            h = (h ^ (unsigned char)path[i]) * 0x100000001b3ULL;
+        shard = h % pipe_state.worker_count;
+    }
+    job_dispatch(job, shard);
+    return 0;
+}
+
+static void pin_thread(pthread_t thread, int cpu, const char *what)
+{
+    if (cpu < 0)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rc = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (rc != 0)
+    {
+        char err[128];
+        snprintf(err, sizeof(err), "Failed to pin %s to CPU %d: %s", what, cpu, strerror(rc));
+        log_message("WARNING", err);
+    }
+}
+
+/* Claim a SHARD_READY shard, own one first; -1 when there is none */
+static int shard_claim(int self)
+{
+    int n = pipe_state.worker_count;
+    for (int i = 0; i < n; i++)
+    {
+        int shard = (self + i) % n;
+        int ready = SHARD_READY;
+        if (atomic_compare_exchange_strong(&pipe_state.workers[shard].queue->state, &ready, SHARD_RUNNING))
+            return shard;
+    }
+    return -1;
+}
+
+/* Run up to SHARD_BATCH jobs of a claimed shard in queue order, then hand
+   it back: ready again if jobs are left, idle otherwise */
+static void shard_drain(int shard, int self)
+{
+    struct job_queue *q = pipe_state.workers[shard].queue;
+    for (int done = 0; done < SHARD_BATCH; done++)
+    {
+        struct pipeline_job *job = queue_pop(q);
+        if (!job)
+        {
+            atomic_store(&q->state, SHARD_IDLE);
+            // Pairs with the fence in job_dispatch(): a job pushed meanwhile is seen here or wakes the shard there
+            atomic_thread_fence(memory_order_seq_cst);
+            if (!queue_empty(q))
+                shard_wake(q);
+            return;
+        }
+        struct stage_stats *s = &pipe_state.stats[job->stage];
+        atomic_fetch_sub_explicit(&s->depth, 1, memory_order_relaxed);
+        if (shard != self)
+            atomic_fetch_add_explicit(&s->stolen, 1, memory_order_relaxed);
+        stage_run(job);
+    }
+    // Batch used up: let the other shards have a turn, this one queues again
+    atomic_store(&q->state, SHARD_READY);
+    sem_post(&pipe_state.jobs);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *self = arg;
+    int held = 0; // IPC batching while a burst of jobs lasts
+
+    for (;;)
+    {
+        int queued = 0;
+        if (held && sem_getvalue(&pipe_state.jobs, &queued) == 0 && queued == 0)
+        {
+            ipc_release(ipc_default()); // burst over: send the partial batch before sleeping
+            held = 0;
+        }
+        while (sem_wait(&pipe_state.jobs) == -1 && errno == EINTR)
+            ;
+        /* Each post stands for a ready shard no other worker has claimed yet;
+           finding none for a moment only means another worker took ours and
+           its own is about to show up */
+        int shard;
+        while ((shard = shard_claim(self->index)) == -1)
+        {
+            if (atomic_load(&pipe_state.stopping))
+                break;
+            sched_yield();
+        }
+        if (shard == -1)
+            break; // the post was a shutdown wakeup and the shards are drained
+        if (!held)
+        {
+            ipc_hold(ipc_default());
+            held = 1;
+        }
+        shard_drain(shard, self->index);
+    }
+    if (held)
+        ipc_release(ipc_default());
+    return NULL;
+}
+
+static void *watcher_main(void *arg)
+{
+    (void)arg;
+    monitor_directory(pipe_state.control_fd);
+    atomic_store(&pipe_state.watcher_alive, 0);
+    if (!atomic_load(&pipe_state.watcher_stopping))
+    {
+        // Requests now fail, so the main thread checks for missing reports itself
+        const char *msg = "Upload watcher stopped unexpectedly: uploads are no longer watched";
+        log_event("ERROR", "pipeline", msg);
+        ipc_send(ipc_default(), "pipeline", 0, msg);
+    }
+    return NULL;
+}
+
+/* Parse a CPU list such as "0-3,6" into cpus, returns how many */
+static int parse_cpu_list(const char *list, int *cpus, int max)
+{
+    int count = 0;
+    const char *p = list;
+    while (*p && count < max)
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            break;
+        long last = first;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                break;
+        }
+        for (long cpu = first; cpu <= last && count < max; cpu++)
+            cpus[count++] = (int)cpu;
+        p = *end == ',' ? end + 1 : end;
+        if (*end != ',')
+            break;
+    }
+    return count;
+}
+
+int pipeline_start()
+{
+    long workers = env_long("REPORT_DAEMON_PIPELINE_WORKERS", PIPELINE_WORKERS);
+    if (workers <= 0)
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0)
+        workers = 1;
+    if (workers > PIPELINE_MAX_WORKERS)
+        workers = PIPELINE_MAX_WORKERS;
+
+    int cpus[PIPELINE_MAX_WORKERS];
+    int cpu_count = 0;
+    const char *cpu_list = config_get("REPORT_DAEMON_PIPELINE_CPUS");
+    if (cpu_list && *cpu_list)
+        cpu_count = parse_cpu_list(cpu_list, cpus, PIPELINE_MAX_WORKERS);
+    pipe_state.watcher_cpu = (int)env_long("REPORT_DAEMON_WATCHER_CPU", -1);
+
+    pipe_state.control_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pipe_state.workers = calloc(workers, sizeof(struct worker));
+    if (pipe_state.control_fd == -1 || !pipe_state.workers || sem_init(&pipe_state.jobs, 0, 0) == -1)
+    {
+        log_message("ERROR", "Failed to set up the upload pipeline");
+        return -1;
+    }
+
+    atomic_store(&pipe_state.stopping, 0);
+    pipe_state.worker_count = 0;
+    pipe_state.running = 1;
+    for (int i = 0; i < workers; i++)
+    {
+        struct worker *w = &pipe_state.workers[i];
+        w->index = i;
+        w->cpu = cpu_count > 0 ? cpus[i % cpu_count] : -1;
+        w->queue = aligned_alloc(CACHELINE, sizeof(struct job_queue));
+        if (!w->queue)
+            break;
+        queue_init(w->queue);
+    }
+    /* Shards first, threads second: a worker may claim any shard */
+    for (int i = 0; i < workers && pipe_state.workers[i].queue; i++)
+        pipe_state.worker_count = i + 1;
+    pipe_state.started = 0;
+    for (int i = 0; i < pipe_state.worker_count; i++)
+    {
+        struct worker *w = &pipe_state.workers[i];
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0)
+            break;
+        pin_thread(w->thread, w->cpu, "pipeline worker");
+        pipe_state.started++;
+    }
+    if (pipe_state.started == 0)
+    {
+        log_message("ERROR", "Failed to start the upload pipeline workers");
+        pipeline_stop();
+        return -1;
+    }
+    if (pipe_state.started < pipe_state.worker_count)
+    {
+        // Threads that did start already know the full count and claim the idle shards
+        char err[128];
+        snprintf(err, sizeof(err), "Started only %d of %d pipeline workers", pipe_state.started,
+                 pipe_state.worker_count);
+        log_message("WARNING", err);
+    }
+
+    atomic_store(&pipe_state.watcher_alive, 1);
+    atomic_store(&pipe_state.watcher_stopping, 0);
+    if (pthread_create(&pipe_state.watcher, NULL, watcher_main, NULL) != 0)
+    {
+        atomic_store(&pipe_state.watcher_alive, 0);
+        log_message("ERROR", "Failed to start the upload watcher thread");
+        pipeline_stop();
+        return -1;
+    }
+    pipe_state.watcher_started = 1;
+    pin_thread(pipe_state.watcher, pipe_state.watcher_cpu, "upload watcher");
+    pipe_state.stats_logged = time(NULL);
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Upload pipeline started: watcher thread, %d worker(s)%s", pipe_state.started,
+             cpu_count > 0 ? ", pinned" : "");
+    log_message("INFO", msg);
+    return 0;
+}
+
+int pipeline_control(unsigned request)
+{
+    if (!pipe_state.running || pipe_state.control_fd == -1 || !atomic_load(&pipe_state.watcher_alive))
+        return -1;
+    atomic_fetch_or(&pipe_state.requests, request);
+    uint64_t one = 1;
+    return write(pipe_state.control_fd, &one, sizeof(one)) == sizeof(one) ? 0 : -1;
+}
+
+unsigned pipeline_requests()
+{
+    uint64_t count;
+    if (read(pipe_state.control_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return 0;
+    return atomic_exchange(&pipe_state.requests, 0);
+}
+
+void pipeline_log_stats(int force)
+{
+    time_t now = time(NULL);
+    if (!force && now - pipe_state.stats_logged < PIPELINE_STATS_INTERVAL)
+        return;
+
+    uint64_t total = 0;
+    for (int i = 0; i < STAGE_COUNT; i++)
+        total += atomic_load(&pipe_state.stats[i].processed);
+    if (total == pipe_state.stats_last_processed)
+        return;
+    pipe_state.stats_logged = now;
+    pipe_state.stats_last_processed = total;
+
+    char msg[512];
+    size_t len = snprintf(msg, sizeof(msg), "Pipeline:");
+    for (int i = 0; i < STAGE_COUNT && len < sizeof(msg); i++)
+    {
+        struct stage_stats *s = &pipe_state.stats[i];
+        uint64_t processed = atomic_load(&s->processed);
+        len += snprintf(msg + len, sizeof(msg) - len,
+                        "%s %s %llu done, depth %ld (max %ld), %llu stolen, %llu inline, %llu full, wait %.2f ms, "
+                        "service %.2f ms",
+                        i ? ";" : "", stage_names[i], (unsigned long long)processed, atomic_load(&s->depth),
+                        atomic_load(&s->max_depth), (unsigned long long)atomic_load(&s->stolen),
+                        (unsigned long long)atomic_load(&s->inlined), (unsigned long long)atomic_load(&s->full),
+                        processed ? atomic_load(&s->wait_ns) / 1e6 / processed : 0.0,
+                        processed ? atomic_load(&s->service_ns) / 1e6 / processed : 0.0);
+    }
+    log_event("INFO", "pipeline", msg);
+    ipc_send(ipc_default(), "pipeline", 1, msg);
+}
+
+void pipeline_stop()
+{
+    if (!pipe_state.running)
+        return;
+    if (pipe_state.watcher_started)
+    {
+        atomic_store(&pipe_state.watcher_stopping, 1);
+        pipeline_control(PIPELINE_STOP);
+        pthread_join(pipe_state.watcher, NULL);
+        pipe_state.watcher_started = 0;
+    }
+
+    /* No new jobs: wake every worker once more; each leaves when it finds no shard ready */
+    atomic_store(&pipe_state.stopping, 1);
+    for (int i = 0; i < pipe_state.started; i++)
+        sem_post(&pipe_state.jobs);
+    for (int i = 0; i < pipe_state.started; i++)
+        pthread_join(pipe_state.workers[i].thread, NULL);
+    pipe_state.started = 0;
+    pipe_state.running = 0;
+    pipeline_log_stats(1);
+
+    for (int i = 0; i < pipe_state.worker_count; i++)
+        free(pipe_state.workers[i].queue);
+    free(pipe_state.workers);
+    pipe_state.workers = NULL;
+    pipe_state.worker_count = 0;
+    sem_destroy(&pipe_state.jobs);
+    close(pipe_state.control_fd);
+    pipe_state.control_fd = -1;
+}
@@ -0,0 +1,276 @@
+/* presence.c – Live index of which expected reports have arrived this cycle */
+
+#define _GNU_SOURCE
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/*
+ * The upload monitor keeps one bit per expected report (see departments.c)
+ * in a shm_open() segment, set when a report arrives and rebuilt by a scan
+ * at startup, on an inotify overflow, when the department list changes and
+ * when a new reporting cycle starts. Any other process (the deadline check,
+ * "report_daemon missing") maps the segment read-only and copies the bitmap
+ * instead of touching the upload directories.
+ *
+ * There is a single writer, so consistency is a seqlock: `seq` is odd while
+ * the writer is changing the index and readers retry until they copied the
+ * bitmap between two equal, even values.
+ */
+
+#define PRESENCE_MAGIC 0x53455250u // "PRES"
+#define PRESENCE_VERSION 1
+#define PRESENCE_READ_RETRIES 100
+
+struct presence_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count; // departments tracked
+    uint32_t words; // bitmap length in uint64_t
+    pid_t writer;   // daemon process maintaining the index
+    _Atomic uint32_t seq;
+    uint32_t present;
+    uint64_t fingerprint; // dept_set_fingerprint() of the list the bits refer to
+    char cycle_date[16];  // report_cycle_date() the index was built for
+    int64_t rebuilt;      // wall clock seconds of the last full rescan
+    _Atomic uint64_t bits[];
+};
+
+/* Writer side (upload monitor) */
+static struct presence_header *index_hdr = NULL;
+static size_t index_size = 0;
+static const struct dept_set *index_set = NULL;
+
+static void write_begin()
+{
+    atomic_fetch_add_explicit(&index_hdr->seq, 1, memory_order_acq_rel);
+}
+
+static void write_end()
+{
+    atomic_fetch_add_explicit(&index_hdr->seq, 1, memory_order_release);
+}
+
+/* Recreate the segment sized for count departments */
+static int index_create(int count)
+{
+    if (index_hdr)
+    {
+        munmap(index_hdr, index_size);
+        index_hdr = NULL;
+    }
+
+    uint32_t words = (count + 63) / 64 + 1;
+    size_t size = sizeof(struct presence_header) + words * sizeof(uint64_t);
+
+    shm_unlink(PRESENCE_SHM_NAME); // readers still mapping the old one see it go stale
+    int fd = shm_open(PRESENCE_SHM_NAME, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+    fchmod(fd, 0644);
+    if (ftruncate(fd, size) == -1)
+    {
+        close(fd);
+        shm_unlink(PRESENCE_SHM_NAME);
+        return -1;
+    }
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        shm_unlink(PRESENCE_SHM_NAME);
+        return -1;
+    }
+
+    index_hdr = addr;
+    index_size = size;
+    index_hdr->version = PRESENCE_VERSION;
+    index_hdr->count = count;
+    index_hdr->words = words;
+    index_hdr->writer = getpid();
+    atomic_init(&index_hdr->seq, 1); // not readable until the first rebuild
+    __atomic_store_n(&index_hdr->magic, PRESENCE_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int presence_rebuild(const struct dept_set *set)
+{
+    int count = dept_set_count(set);
+    if (!index_hdr || (int)index_hdr->count != count)
+    {
+        if (index_create(count) == -1)
+        {
+            char err[128];
+            snprintf(err, sizeof(err), "Failed to create the report presence index: %s", strerror(errno));
+            log_message("ERROR", err);
+            index_set = NULL;
+            return -1;
+        }
+    }
+    else
+        write_begin();
+
+    uint32_t words = index_hdr->words;
+    uint64_t *scratch = calloc(words, sizeof(uint64_t));
+    if (!scratch)
+    {
+        write_end();
+        return -1;
+    }
+
+    /* Same sources as the deadline check: the cycle's reporting directory and every upload root */
+    char cycle_dir[MAX_PATH_BUFFER];
+    char cycle_date[16];
+    report_cycle_date(cycle_date, sizeof(cycle_date));
+    snprintf(cycle_dir, sizeof(cycle_dir), "%s/%s", REPORT_DIR, cycle_date);
+    int found = 0, scanned = dept_mark_present(set, cycle_dir, scratch);
+    if (scanned > 0)
+        found += scanned;
+    const char *roots[MAX_UPLOAD_ROOTS];
+    int root_count = upload_roots(roots, MAX_UPLOAD_ROOTS);
+    for (int i = 0; i < root_count; i++)
+    {
+        scanned = dept_mark_present(set, roots[i], scratch);
+        if (scanned > 0)
+            found += scanned;
+    }
+
+    for (uint32_t i = 0; i < words; i++)
+        atomic_store_explicit(&index_hdr->bits[i], scratch[i], memory_order_relaxed);
+    free(scratch);
+    index_hdr->present = found;
+    index_hdr->fingerprint = dept_set_fingerprint(set);
+    snprintf(index_hdr->cycle_date, sizeof(index_hdr->cycle_date), "%s", cycle_date);
+    index_hdr->rebuilt = time(NULL);
+    write_end();
+
+    index_set = set;
+    return found;
+}
+
+int presence_current(const struct dept_set *set)
+{
+    if (!index_hdr || index_set != set || index_hdr->fingerprint != dept_set_fingerprint(set))
+        return 0;
+    char cycle_date[16];
+    report_cycle_date(cycle_date, sizeof(cycle_date));
+    return strcmp(cycle_date, index_hdr->cycle_date) == 0;
+}
+
+/* Set or clear one report's bit; returns the index or -1 if not an expected report */
+static int presence_set(const char *name, int present)
+{
+    if (!index_hdr || !index_set)
+        return -1;
+    int idx = dept_set_find(index_set, name, strlen(name));
+    if (idx < 0)
+        return -1;
+
+    uint64_t bit = 1ULL << (idx % 64);
+    uint64_t word = atomic_load_explicit(&index_hdr->bits[idx / 64], memory_order_relaxed);
+    if (!!(word & bit) == present)
+        return idx;
+    write_begin();
+    if (present)
+    {
+        atomic_fetch_or_explicit(&index_hdr->bits[idx / 64], bit, memory_order_relaxed);
+        index_hdr->present++;
+    }
+    else
+    {
+        atomic_fetch_and_explicit(&index_hdr->bits[idx / 64], ~bit, memory_order_relaxed);
+        index_hdr->present--;
+    }
+    write_end();
+    return idx;
+}
+
+int presence_mark(const char *name)
+{
+    return presence_set(name, 1);
+}
+
+int presence_gone(const char *name)
+{
+    if (!index_set || dept_set_find(index_set, name, strlen(name)) < 0)
+        return 0;
+
+    /* Streaming ingest moves reports into the cycle's reporting directory: still present */
+    char cycle_date[16];
+    char path[MAX_PATH_BUFFER];
+    report_cycle_date(cycle_date, sizeof(cycle_date));
+    snprintf(path, sizeof(path), "%s/%s/%s", REPORT_DIR, cycle_date, name);
+    if (access(path, F_OK) == 0)
+        return 0;
+
+    presence_set(name, 0);
+    return 1; // another copy may still exist under an upload root: rescan to be sure
+}
+
+void presence_close()
+{
+    if (index_hdr)
+    {
+        munmap(index_hdr, index_size);
+        index_hdr = NULL;
+        index_set = NULL;
+    }
+}
+
+/* Reader side: copy the bitmap for set into present (at least
+   (count + 63) / 64 words). Returns the number of missing reports, or -1
+   when there is no usable index and the caller has to scan. */
+int presence_snapshot(const struct dept_set *set, uint64_t *present)
+{
+    int fd = shm_open(PRESENCE_SHM_NAME, O_RDONLY | O_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct presence_header))
+    {
+        close(fd);
+        return -1;
+    }
+    const struct presence_header *hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED)
+        return -1;
+
+    int missing = -1;
+    uint32_t count = dept_set_count(set);
+    char cycle_date[16];
+    report_cycle_date(cycle_date, sizeof(cycle_date));
+
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == PRESENCE_MAGIC && hdr->version == PRESENCE_VERSION &&
+        hdr->count == count && hdr->fingerprint == dept_set_fingerprint(set) &&
+        sizeof(struct presence_header) + (size_t)hdr->words * sizeof(uint64_t) <= (size_t)st.st_size &&
+        (kill(hdr->writer, 0) == 0 || errno == EPERM))
+    {
+        for (int attempt = 0; attempt < PRESENCE_READ_RETRIES; attempt++)
+        {
+            uint32_t before = atomic_load_explicit(&hdr->seq, memory_order_acquire);
+            if (before & 1)
+            {
+                usleep(100); // a rescan is in progress
+                continue;
+            }
+            for (uint32_t i = 0; i < (count + 63) / 64; i++)
+                present[i] = atomic_load_explicit(&hdr->bits[i], memory_order_relaxed);
+            int present_count = hdr->present;
+            int current = strcmp(cycle_date, hdr->cycle_date) == 0;
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&hdr->seq, memory_order_relaxed) == before)
+            {
+                missing = current ? (int)count - present_count : -1; // stale cycle: scan instead
+                break;
+            }
+        }
+    }
+    munmap((void *)hdr, st.st_size);
+    return missing;
+}
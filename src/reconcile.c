@@ -0,0 +1,699 @@
+/* reconcile.c – Bring the upload monitor back in step with the upload trees
+ *
+ * inotify only reports what happens while it is watching, and when its
+ * queue overflows it drops events altogether. The reconciler keeps the last
+ * known state of every file under the upload roots (inode, size, mtime) and,
+ * at startup, after an overflow and on request (SIGUSR2,
+ * "report_daemon reconcile"), rescans the trees and replays the differences
+ * as synthetic events through the monitor's normal event path:
+ *
+ *   not in the state             IN_CLOSE_WRITE (reported as CREATE)
+ *   other inode                  IN_CLOSE_WRITE
+ *   other size or mtime          IN_MODIFY (coalesced, reported as MODIFY)
+ *   in the state, gone now       IN_DELETE, or IN_MOVED_FROM when the report
+ *                                was filed into the cycle's reporting directory
+ *
+ * A new file still open for writing (a read lease cannot be taken) is
+ * replayed as IN_CREATE instead, so it is reported and ingested once the
+ * writer closes it rather than half written.
+ *
+ * Between scans the monitor passes its live events to reconcile_note(), so
+ * the state always reflects what has been reported. The state is saved to
+ * UPLOAD_STATE_FILE after every scan and at shutdown; events that happened
+ * while the daemon was down are found by the scan at startup.
+ *
+ * The scan reads each directory with getdents64() into one large buffer and
+ * takes size and mtime from statx(); the table holds a fixed-size record per
+ * file plus its path, and is capped at RECONCILE_MAX_ENTRIES files.
+ */
+
+#define _GNU_SOURCE
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+
+#define RECONCILE_SCAN_BUFFER (1024 * 1024)
+#define RECONCILE_MAX_DEPTH 16
+#define RECONCILE_SETTLE_S 60 // files changed more recently may still be open for writing
+
+#define STATE_MAGIC 0x53554452u // "RDUS"
+#define STATE_VERSION 1
+
+#define INDEX_EMPTY 0
+#define INDEX_DELETED UINT32_MAX
+
+struct upload_state
+{
+    uint64_t key; // FNV-1a of the path
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;
+    uint32_t path_off; // into the path arena
+    uint32_t generation;
+    uint16_t root;
+    uint8_t live;
+};
+
+struct state_file_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+};
+
+struct state_file_record
+{
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;
+    uint32_t path_len;
+};
+
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct reconcile
+{
+    const char *roots[MAX_UPLOAD_ROOTS];
+    size_t root_len[MAX_UPLOAD_ROOTS];
+    int root_count;
+
+    /* Records are dense; a hash index maps path keys to them (record + 1) */
+    struct upload_state *entries;
+    size_t entry_count, entry_capacity;
+    size_t live;
+    uint32_t *index;
+    size_t capacity; // power of two
+    size_t used;     // non-empty index slots, tombstones included
+    char *arena;
+    size_t arena_size, arena_used;
+
+    uint32_t generation;
+    int replaying; // synthetic events are being emitted: reconcile_note() ignores them
+    int dirty;     // changed since the last save
+    unsigned long untracked;
+
+    /* Current scan */
+    char *buf;
+    watch_event_fn emit;
+    void *arg;
+    time_t now;
+    unsigned long files, created, modified, deleted;
+};
+
+static uint64_t path_key(const char *path)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *path; path++)
+        h = (h ^ (unsigned char)*path) * 0x100000001b3ULL;
+    return h;
+}
+
+static int root_of(const struct reconcile *rc, const char *path)
+{
+    for (int i = 0; i < rc->root_count; i++)
+    {
+        if (strncmp(path, rc->roots[i], rc->root_len[i]) == 0 && path[rc->root_len[i]] == '/')
+            return i;
+    }
+    return -1;
+}
+
+static struct upload_state *state_find(struct reconcile *rc, const char *path, uint64_t key)
+{
+    if (rc->capacity == 0)
+        return NULL;
+    size_t mask = rc->capacity - 1;
+    for (size_t idx = key & mask;; idx = (idx + 1) & mask)
+    {
+        uint32_t v = rc->index[idx];
+        if (v == INDEX_EMPTY)
+            return NULL;
+        if (v == INDEX_DELETED)
+            continue;
+        struct upload_state *e = &rc->entries[v - 1];
+        if (e->key == key && strcmp(rc->arena + e->path_off, path) == 0)
+            return e;
+    }
+}
+
+/* Rebuild the index for the live records; with compact, also squeeze the
+   removed records out of the record array and the path arena */
+static int state_rebuild(struct reconcile *rc, int compact)
+{
+    size_t capacity = 1024;
+    while (capacity < rc->live * 2 + 2)
+        capacity <<= 1;
+    uint32_t *index = calloc(capacity, sizeof(uint32_t));
+    char *arena = compact && rc->arena_size ? malloc(rc->arena_size) : NULL;
+    if (!index || (compact && rc->arena_size && !arena))
+    {
+        free(index);
+        free(arena);
+        return -1;
+    }
+
+    size_t count = 0, arena_used = 0;
+    for (size_t i = 0; i < rc->entry_count; i++)
+    {
+        struct upload_state *e = &rc->entries[i];
+        if (!e->live)
+            continue;
+        if (compact)
+        {
+            size_t len = strlen(rc->arena + e->path_off) + 1;
+            memcpy(arena + arena_used, rc->arena + e->path_off, len);
+            e->path_off = arena_used;
+            arena_used += len;
+            rc->entries[count] = *e;
+            e = &rc->entries[count];
+        }
+        size_t slot = e->key & (capacity - 1);
+        while (index[slot] != INDEX_EMPTY)
+            slot = (slot + 1) & (capacity - 1);
+        index[slot] = (compact ? count : i) + 1;
+        count++;
+    }
+    if (compact)
+    {
+        rc->entry_count = count;
+        free(rc->arena);
+        rc->arena = arena;
+        rc->arena_used = arena_used;
+    }
+    free(rc->index);
+    rc->index = index;
+    rc->capacity = capacity;
+    rc->used = rc->live;
+    return 0;
+}
+
+static int arena_add(struct reconcile *rc, const char *path, uint32_t *off)
+{
+    size_t len = strlen(path) + 1;
+    if (rc->arena_used + len > rc->arena_size)
+    {
+        size_t size = rc->arena_size ? rc->arena_size * 2 : 1024 * 1024;
+        while (size < rc->arena_used + len)
+            size *= 2;
+        if (size > UINT32_MAX)
+            return -1;
+        char *grown = realloc(rc->arena, size);
+        if (!grown)
+            return -1;
+        rc->arena = grown;
+        rc->arena_size = size;
+    }
+    memcpy(rc->arena + rc->arena_used, path, len);
+    *off = rc->arena_used;
+    rc->arena_used += len;
+    return 0;
+}
+
+/* New record for path; NULL when the table is full or memory ran out.
+   Invalidates pointers to other records. */
+static struct upload_state *state_insert(struct reconcile *rc, const char *path, uint64_t key, int root)
+{
+    if (rc->live >= RECONCILE_MAX_ENTRIES)
+    {
+        rc->untracked++;
+        return NULL;
+    }
+    if ((rc->used + 1) * 4 > rc->capacity * 3 && state_rebuild(rc, 0) == -1)
+        return NULL;
+    if (rc->entry_count == rc->entry_capacity)
+    {
+        size_t capacity = rc->entry_capacity ? rc->entry_capacity * 2 : 1024;
+        struct upload_state *grown = realloc(rc->entries, capacity * sizeof(*grown));
+        if (!grown)
+            return NULL;
+        rc->entries = grown;
+        rc->entry_capacity = capacity;
+    }
+    uint32_t off;
+    if (arena_add(rc, path, &off) == -1)
+        return NULL;
+
+    struct upload_state *e = &rc->entries[rc->entry_count++];
+    memset(e, 0, sizeof(*e));
+    e->key = key;
+    e->path_off = off;
+    e->root = root;
+    e->live = 1;
+    size_t mask = rc->capacity - 1;
+    size_t slot = key & mask;
+    while (rc->index[slot] != INDEX_EMPTY && rc->index[slot] != INDEX_DELETED)
+        slot = (slot + 1) & mask;
+    if (rc->index[slot] == INDEX_EMPTY)
+        rc->used++;
+    rc->index[slot] = rc->entry_count;
+    rc->live++;
+    rc->dirty = 1;
+    return e;
+}
+
+static void state_remove(struct reconcile *rc, struct upload_state *e)
+{
+    uint32_t v = (e - rc->entries) + 1;
+    size_t mask = rc->capacity - 1;
+    for (size_t slot = e->key & mask; rc->index[slot] != INDEX_EMPTY; slot = (slot + 1) & mask)
+    {
+        if (rc->index[slot] == v)
+        {
+            rc->index[slot] = INDEX_DELETED;
+            break;
+        }
+    }
+    e->live = 0;
+    rc->live--;
+    rc->dirty = 1;
+
+    /* Between scans uploads keep coming and going: reclaim once most records are dead */
+    if (!rc->replaying && rc->entry_count > 4096 && rc->entry_count > rc->live * 2)
+        state_rebuild(rc, 1);
+}
+
+static void state_set(struct upload_state *e, const struct statx *stx)
+{
+    e->ino = stx->stx_ino;
+    e->size = stx->stx_size;
+    e->mtime_ns = (int64_t)stx->stx_mtime.tv_sec * 1000000000LL + stx->stx_mtime.tv_nsec;
+}
+
+static int file_statx(int dirfd, const char *name, struct statx *stx)
+{
+    return statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                 STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME, stx);
+}
+
+/* 1 while some process has the file open for writing (no read lease possible) */
+static int being_written(int dirfd, const char *name)
+{
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    int busy = 0;
+    if (fcntl(fd, F_SETLEASE, F_RDLCK) == -1)
+        busy = errno == EAGAIN;
+    else
+        fcntl(fd, F_SETLEASE, F_UNLCK);
+    close(fd);
+    return busy;
+}
+
+static void emit(struct reconcile *rc, const char *path, int root, uint32_t mask)
+{
+    char dir[MAX_PATH_BUFFER];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (!slash)
+        return;
+    *slash = '\0';
+    rc->emit(dir, slash + 1, mask, rc->root_len[root], rc->arg);
+}
+
+/* Compare one regular file with its state, replaying what changed */
+static void reconcile_file(struct reconcile *rc, int root, int dirfd, const char *path, const char *name)
+{
+    struct statx stx;
+    if (file_statx(dirfd, name, &stx) == -1 || !S_ISREG(stx.stx_mode))
+        return;
+    rc->files++;
+
+    uint64_t key = path_key(path);
+    struct upload_state *e = state_find(rc, path, key);
+    int recent = rc->now - stx.stx_mtime.tv_sec < RECONCILE_SETTLE_S;
+    if (e && e->ino == stx.stx_ino)
+    {
+        e->generation = rc->generation;
+        int64_t mtime_ns = (int64_t)stx.stx_mtime.tv_sec * 1000000000LL + stx.stx_mtime.tv_nsec;
+        if (e->size == (int64_t)stx.stx_size && e->mtime_ns == mtime_ns)
+            return;
+        state_set(e, &stx);
+        rc->dirty = 1;
+        rc->modified++;
+        emit(rc, path, root, IN_MODIFY);
+        return;
+    }
+
+    if (recent && being_written(dirfd, name))
+    {
+        // Left out of the state, so it is new again if its close is missed too
+        if (e)
+            state_remove(rc, e);
+        emit(rc, path, root, IN_CREATE);
+        return;
+    }
+    if (!e && !(e = state_insert(rc, path, key, root)))
+        return; // table full: not tracked, not replayed
+    state_set(e, &stx);
+    e->generation = rc->generation;
+    rc->dirty = 1;
+    rc->created++;
+    emit(rc, path, root, IN_CLOSE_WRITE);
+}
+
+static void reconcile_dir(struct reconcile *rc, int root, int dirfd, char *path, size_t path_len, int depth)
+{
+    char **subdirs = NULL;
+    int sub_count = 0, sub_capacity = 0;
+
+    long n;
+    while ((n = syscall(SYS_getdents64, dirfd, rc->buf, RECONCILE_SCAN_BUFFER)) > 0)
+    {
+        for (long off = 0; off < n;)
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(rc->buf + off);
+            off += d->d_reclen;
+            if (d->d_name[0] == '.')
+                continue;
+
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                struct statx stx;
+                if (file_statx(dirfd, d->d_name, &stx) == -1)
+                    continue;
+                type = S_ISDIR(stx.stx_mode) ? DT_DIR : S_ISREG(stx.stx_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type == DT_DIR)
+            {
+                if (depth >= RECONCILE_MAX_DEPTH)
+                    continue;
+                if (sub_count == sub_capacity)
+                {
+                    sub_capacity = sub_capacity ? sub_capacity * 2 : 16;
+                    char **grown = realloc(subdirs, sub_capacity * sizeof(char *));
+                    if (!grown)
+                        continue;
+                    subdirs = grown;
+                }
+                if ((subdirs[sub_count] = strdup(d->d_name)) != NULL)
+                    sub_count++;
+            }
+            else if (type == DT_REG && path_len + 1 + strlen(d->d_name) < MAX_PATH_BUFFER)
+            {
+                snprintf(path + path_len, MAX_PATH_BUFFER - path_len, "/%s", d->d_name);
+                reconcile_file(rc, root, dirfd, path, d->d_name);
+            }
+        }
+    }
+
+    for (int i = 0; i < sub_count; i++)
+    {
+        int fd = openat(dirfd, subdirs[i], O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        size_t len = path_len + 1 + strlen(subdirs[i]);
+        if (fd != -1 && len < MAX_PATH_BUFFER)
+        {
+            snprintf(path + path_len, MAX_PATH_BUFFER - path_len, "/%s", subdirs[i]);
+            reconcile_dir(rc, root, fd, path, len, depth + 1);
+        }
+        if (fd != -1)
+            close(fd);
+        free(subdirs[i]);
+    }
+    free(subdirs);
+    path[path_len] = '\0';
+}
+
+/* A vanished report that now sits in the cycle's reporting directory was filed, not deleted */
+static int was_filed(const char *path)
+{
+    char cycle_date[16];
+    char filed[MAX_PATH_BUFFER];
+    const char *name = strrchr(path, '/');
+    report_cycle_date(cycle_date, sizeof(cycle_date));
+    snprintf(filed, sizeof(filed), "%s/%s%s", REPORT_DIR, cycle_date, name ? name : "/");
+    return access(filed, F_OK) == 0;
+}
+
+static int state_load(struct reconcile *rc)
+{
+    FILE *fp = fopen(UPLOAD_STATE_FILE, "rb");
+    if (!fp)
+        return -1;
+    struct state_file_header header;
+    int loaded = -1;
+    if (fread(&header, sizeof(header), 1, fp) == 1 && header.magic == STATE_MAGIC && header.version == STATE_VERSION)
+    {
+        struct state_file_record rec;
+        char path[MAX_PATH_BUFFER];
+        loaded = 0;
+        for (uint64_t i = 0; i < header.count; i++)
+        {
+            if (fread(&rec, sizeof(rec), 1, fp) != 1 || rec.path_len == 0 || rec.path_len >= sizeof(path) ||
+                fread(path, 1, rec.path_len, fp) != rec.path_len)
+                break;
+            path[rec.path_len] = '\0';
+            int root = root_of(rc, path);
+            if (root == -1)
+                continue; // no longer an upload root
+            struct upload_state *e = state_insert(rc, path, path_key(path), root);
+            if (!e)
+                break;
+            e->ino = rec.ino;
+            e->size = rec.size;
+            e->mtime_ns = rec.mtime_ns;
+            loaded++;
+        }
+    }
+    fclose(fp);
+    rc->dirty = 0;
+    return loaded;
+}
+
+int reconcile_save(struct reconcile *rc)
+{
+    if (!rc || !rc->dirty)
+        return 0;
+    char tmp[MAX_PATH_BUFFER];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", UPLOAD_STATE_FILE);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp)
+    {
+        char err[MAX_PATH_BUFFER + 64];
+        snprintf(err, sizeof(err), "Failed to save upload state %s: %s", tmp, strerror(errno));
+        log_message("ERROR", err);
+        return -1;
+    }
+    struct state_file_header header = {STATE_MAGIC, STATE_VERSION, rc->live};
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    for (size_t i = 0; ok && i < rc->entry_count; i++)
+    {
+        struct upload_state *e = &rc->entries[i];
+        if (!e->live)
+            continue;
+        const char *path = rc->arena + e->path_off;
+        struct state_file_record rec = {e->ino, e->size, e->mtime_ns, (uint32_t)strlen(path)};
+        ok = fwrite(&rec, sizeof(rec), 1, fp) == 1 && fwrite(path, 1, rec.path_len, fp) == rec.path_len;
+    }
+    if (fclose(fp) != 0)
+        ok = 0;
+    if (!ok || rename(tmp, UPLOAD_STATE_FILE) == -1)
+    {
+        char err[MAX_PATH_BUFFER + 64];
+        snprintf(err, sizeof(err), "Failed to save upload state %s: %s", UPLOAD_STATE_FILE, strerror(errno));
+        log_message("ERROR", err);
+        unlink(tmp);
+        return -1;
+    }
+    rc->dirty = 0;
+    return 0;
+}
+
+struct reconcile *reconcile_create(const char **roots, int root_count)
+{
+    struct reconcile *rc = calloc(1, sizeof(*rc));
+    if (!rc)
+        return NULL;
+    for (int i = 0; i < root_count && i < MAX_UPLOAD_ROOTS; i++)
+    {
+        rc->roots[i] = roots[i];
+        rc->root_len[i] = strlen(roots[i]);
+        rc->root_count++;
+    }
+    int loaded = state_load(rc);
+    char msg[128];
+    if (loaded >= 0)
+        snprintf(msg, sizeof(msg), "Loaded the saved state of %d upload(s)", loaded);
+    else
+        snprintf(msg, sizeof(msg), "No saved upload state, every upload found will be reported");
+    log_message("INFO", msg);
+    return rc;
+}
+
+/* Scan the roots flagged in selected (all of them when NULL) */
+static int reconcile_scan(struct reconcile *rc, const char *why, const int *selected, watch_event_fn on_event,
+                          void *arg)
+{
+    rc->buf = malloc(RECONCILE_SCAN_BUFFER);
+    if (!rc->buf)
+        return -1;
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    rc->emit = on_event;
+    rc->arg = arg;
+    rc->now = time(NULL);
+    rc->generation++;
+    rc->files = rc->created = rc->modified = rc->deleted = 0;
+    rc->untracked = 0;
+    rc->replaying = 1;
+
+    int scanned[MAX_UPLOAD_ROOTS] = {0};
+    char path[MAX_PATH_BUFFER];
+    for (int i = 0; i < rc->root_count; i++)
+    {
+        if (selected && !selected[i])
+            continue;
+        int fd = open(rc->roots[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+            continue; // keep its state: an unreachable root is not an empty one
+        snprintf(path, sizeof(path), "%s", rc->roots[i]);
+        reconcile_dir(rc, i, fd, path, rc->root_len[i], 0);
+        close(fd);
+        scanned[i] = 1;
+    }
+
+    /* Whatever was not seen in a scanned root is gone */
+    for (size_t i = 0; i < rc->entry_count; i++)
+    {
+        struct upload_state *e = &rc->entries[i];
+        if (!e->live || e->generation == rc->generation || !scanned[e->root])
+            continue;
+        int root = e->root;
+        snprintf(path, sizeof(path), "%s", rc->arena + e->path_off);
+        state_remove(rc, e);
+        rc->deleted++;
+        emit(rc, path, root, was_filed(path) ? IN_MOVED_FROM : IN_DELETE);
+    }
+    rc->replaying = 0;
+    if (rc->entry_count > rc->live + rc->live / 4)
+        state_rebuild(rc, 1);
+    free(rc->buf);
+    rc->buf = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    char msg[256];
+    snprintf(msg, sizeof(msg), "Reconciled upload roots (%s): %lu files in %.2f s, %lu created, %lu modified, %lu deleted",
+             why, rc->files, seconds, rc->created, rc->modified, rc->deleted);
+    log_event("INFO", "reconcile", msg);
+    ipc_send(ipc_default(), "reconcile", 1, msg);
+    if (rc->untracked > 0)
+    {
+        snprintf(msg, sizeof(msg), "Upload state is full (%d files): %lu files are not tracked", RECONCILE_MAX_ENTRIES,
+                 rc->untracked);
+        log_message("WARNING", msg);
+    }
+    reconcile_save(rc);
+    return (int)(rc->created + rc->modified + rc->deleted);
+}
+
+int reconcile_run(struct reconcile *rc, const char *why, watch_event_fn on_event, void *arg)
+{
+    if (!rc)
+        return -1;
+    return reconcile_scan(rc, why, NULL, on_event, arg);
+}
+
+int reconcile_set_roots(struct reconcile *rc, const char **roots, int root_count, watch_event_fn on_event, void *arg)
+{
+    if (!rc)
+        return -1;
+    const char *old[MAX_UPLOAD_ROOTS];
+    int old_count = rc->root_count;
+    memcpy(old, rc->roots, sizeof(old));
+
+    int added[MAX_UPLOAD_ROOTS] = {0};
+    int any_added = 0;
+    rc->root_count = 0;
+    for (int i = 0; i < root_count && i < MAX_UPLOAD_ROOTS; i++)
+    {
+        rc->roots[i] = roots[i];
+        rc->root_len[i] = strlen(roots[i]);
+        rc->root_count++;
+        added[i] = 1;
+        for (int j = 0; j < old_count; j++)
+        {
+            if (strcmp(old[j], roots[i]) == 0)
+                added[i] = 0;
+        }
+        any_added |= added[i];
+    }
+
+    /* Renumber the records; those under a dropped root are forgotten, not deleted */
+    rc->replaying = 1;
+    for (size_t i = 0; i < rc->entry_count; i++)
+    {
+        struct upload_state *e = &rc->entries[i];
+        if (!e->live)
+            continue;
+        int root = root_of(rc, rc->arena + e->path_off);
+        if (root == -1)
+            state_remove(rc, e);
+        else
+            e->root = root;
+    }
+    rc->replaying = 0;
+    rc->dirty = 1;
+
+    if (!any_added)
+    {
+        if (rc->entry_count > rc->live + rc->live / 4)
+            state_rebuild(rc, 1);
+        reconcile_save(rc);
+        return 0;
+    }
+    return reconcile_scan(rc, "new upload roots", added, on_event, arg);
+}
+
+void reconcile_note(struct reconcile *rc, const char *dir, const char *name, uint32_t mask)
+{
+    if (!rc || rc->replaying || name[0] == '.' || !(mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)))
+        return; // IN_MODIFY: the close that follows brings the final size and mtime
+
+    char path[MAX_PATH_BUFFER];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int root = root_of(rc, path);
+    if (root == -1)
+        return;
+    uint64_t key = path_key(path);
+    struct upload_state *e = state_find(rc, path, key);
+    if (mask & (IN_DELETE | IN_MOVED_FROM))
+    {
+        if (e)
+            state_remove(rc, e);
+        return;
+    }
+
+    struct statx stx;
+    if (file_statx(AT_FDCWD, path, &stx) == -1 || !S_ISREG(stx.stx_mode))
+        return;
+    if (!e && !(e = state_insert(rc, path, key, root)))
+        return;
+    state_set(e, &stx);
+    e->generation = rc->generation;
+    rc->dirty = 1;
+}
+
+void reconcile_destroy(struct reconcile *rc)
+{
+    if (!rc)
+        return;
+    reconcile_save(rc);
+    free(rc->entries);
+    free(rc->index);
+    free(rc->arena);
+    free(rc);
+}
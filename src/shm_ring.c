@@ -0,0 +1,283 @@
+/* shm_ring.c – Shared-memory multi-producer/single-consumer event ring.
+ *
+ * An alternative IPC transport to the 10-slot POSIX queue. The ring lives in
+ * a shm_open() segment mapped by the daemon, its monitor process and
+ * ipc_monitor. Producers reserve slots with a CAS on `head` and publish them
+ * by storing the slot's sequence number (bounded MPMC queue scheme); the
+ * consumer reads published slots without any syscall and only sleeps on a
+ * futex in the header when the ring is empty. A full ring never blocks a
+ * producer: the record is refused and counted as dropped.
+ *
+ * The segment is mode 0660, group SHM_RING_GROUP: members may run a monitor,
+ * other users cannot write to it. Even so, nothing read back from the shared
+ * header sizes or indexes memory: positions are masked with the compile-time
+ * capacity and record lengths are clamped to the payload size.
+ */
+
+#define _GNU_SOURCE
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+#include <grp.h>
+
+#define SHM_RING_MAGIC 0x474e5252u // "RRNG"
+#define SHM_RING_VERSION 2
+#define CACHELINE 64
+#define RING_MASK ((uint64_t)SHM_RING_CAPACITY - 1)
+
+struct shm_ring_slot
+{
+    _Atomic uint64_t seq; // == position + 1 once published, position + capacity once consumed
+    uint32_t len;
+    uint32_t reserved;
+    char data[SHM_RING_PAYLOAD];
+};
+
+struct shm_ring_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity; // power of two
+    uint32_t slot_size;
+
+    _Alignas(CACHELINE) _Atomic uint64_t head; // next position producers reserve
+    _Alignas(CACHELINE) _Atomic uint64_t tail; // next position the consumer reads
+    _Alignas(CACHELINE) _Atomic uint32_t futex; // bumped on every publish
+    _Atomic uint32_t waiters;                   // consumer is (about to be) asleep
+    _Alignas(CACHELINE) _Atomic uint64_t published;
+    _Atomic uint64_t dropped;
+
+    _Alignas(CACHELINE) struct shm_ring_slot slots[];
+};
+
+struct shm_ring
+{
+    struct shm_ring_header *hdr;
+    size_t map_size;
+    ino_t ino; // identifies the segment, to notice when the daemon recreates it
+};
+
+static size_t ring_bytes(uint32_t capacity)
+{
+    return sizeof(struct shm_ring_header) + (size_t)capacity * sizeof(struct shm_ring_slot);
+}
+
+static long futex(_Atomic uint32_t *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+    // Not FUTEX_PRIVATE_FLAG: waiter and wakers live in different processes
+    return syscall(SYS_futex, (uint32_t *)addr, op, val, timeout, NULL, 0);
+}
+
+static struct shm_ring *map_ring(int fd, size_t size)
+{
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+
+    struct shm_ring *ring = malloc(sizeof(*ring));
+    if (!ring)
+    {
+        munmap(addr, size);
+        return NULL;
+    }
+    struct stat st;
+    ring->hdr = addr;
+    ring->map_size = size;
+    ring->ino = fstat(fd, &st) == 0 ? st.st_ino : 0;
+    return ring;
+}
+
+/* Create (or recreate) the ring segment. Called once by the daemon at startup. */
+struct shm_ring *shm_ring_create(const char *name)
+{
+    size_t size = ring_bytes(SHM_RING_CAPACITY);
+
+    shm_unlink(name); // never attach producers to a ring left behind with another layout
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0660);
+    if (fd == -1)
+        return NULL;
+    // Monitors attach through the group; without it only root can
+    struct group grp, *found = NULL;
+    char buf[1024];
+    if (getgrnam_r(SHM_RING_GROUP, &grp, buf, sizeof(buf), &found) == 0 && found)
+        fchown(fd, -1, found->gr_gid);
+    fchmod(fd, 0660); // not subject to the umask
+    if (ftruncate(fd, size) == -1)
+    {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    struct shm_ring *ring = map_ring(fd, size);
+    close(fd);
+    if (!ring)
+    {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    struct shm_ring_header *hdr = ring->hdr;
+    hdr->capacity = SHM_RING_CAPACITY;
+    hdr->slot_size = sizeof(struct shm_ring_slot);
+    hdr->version = SHM_RING_VERSION;
+    for (uint32_t i = 0; i < SHM_RING_CAPACITY; i++)
+        atomic_init(&hdr->slots[i].seq, i);
+    atomic_store(&hdr->head, 0);
+    atomic_store(&hdr->tail, 0);
+    // Publishing the magic last tells attachers the layout is initialised
+    __atomic_store_n(&hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+    return ring;
+}
+
+/* Map an existing ring created by the daemon */
+struct shm_ring *shm_ring_attach(const char *name)
+{
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct shm_ring_header))
+    {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct shm_ring *ring = map_ring(fd, st.st_size);
+    close(fd);
+    if (!ring)
+        return NULL;
+
+    struct shm_ring_header *hdr = ring->hdr;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC ||
+        hdr->version != SHM_RING_VERSION || hdr->slot_size != sizeof(struct shm_ring_slot) ||
+        hdr->capacity != SHM_RING_CAPACITY || ring_bytes(SHM_RING_CAPACITY) > ring->map_size)
+    {
+        shm_ring_detach(ring);
+        errno = EINVAL;
+        return NULL;
+    }
+    return ring;
+}
+
+void shm_ring_detach(struct shm_ring *ring)
+{
+    if (!ring)
+        return;
+    munmap(ring->hdr, ring->map_size);
+    free(ring);
+}
+
+/* Publish one record. Never blocks: returns -1 with errno EAGAIN when full. */
+int shm_ring_publish(struct shm_ring *ring, const void *data, size_t len)
+{
+    struct shm_ring_header *hdr = ring->hdr;
+    if (len > SHM_RING_PAYLOAD)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    uint64_t pos = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+    struct shm_ring_slot *slot;
+    while (1)
+    {
+        slot = &hdr->slots[pos & RING_MASK];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&hdr->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            atomic_fetch_add_explicit(&hdr->dropped, 1, memory_order_relaxed);
+            errno = EAGAIN;
+            return -1;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+        }
+    }
+
+    memcpy(slot->data, data, len);
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    atomic_fetch_add_explicit(&hdr->published, 1, memory_order_relaxed);
+
+    atomic_fetch_add(&hdr->futex, 1);
+    if (atomic_load(&hdr->waiters))
+        futex(&hdr->futex, FUTEX_WAKE, 1, NULL);
+    return 0;
+}
+
+/* Take the next record if one is published. Returns its length, 0 when the
+   ring is empty. *seq receives the record's sequence number. Single consumer only. */
+size_t shm_ring_consume(struct shm_ring *ring, void *data, size_t size, uint64_t *seq)
+{
+    struct shm_ring_header *hdr = ring->hdr;
+    uint64_t pos = atomic_load_explicit(&hdr->tail, memory_order_relaxed);
+    struct shm_ring_slot *slot = &hdr->slots[pos & RING_MASK];
+
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1)
+        return 0;
+
+    size_t len = slot->len < SHM_RING_PAYLOAD ? slot->len : SHM_RING_PAYLOAD;
+    if (len > size)
+        len = size;
+    memcpy(data, slot->data, len);
+    atomic_store_explicit(&slot->seq, pos + SHM_RING_CAPACITY, memory_order_release);
+    atomic_store_explicit(&hdr->tail, pos + 1, memory_order_relaxed);
+    if (seq)
+        *seq = pos;
+    return len ? len : 1;
+}
+
+/* Sleep until something is published or timeout_ms elapses (-1 = forever) */
+void shm_ring_wait(struct shm_ring *ring, int timeout_ms)
+{
+    struct shm_ring_header *hdr = ring->hdr;
+    struct timespec ts, *timeout = NULL;
+    if (timeout_ms >= 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        timeout = &ts;
+    }
+
+    atomic_store(&hdr->waiters, 1);
+    uint32_t seen = atomic_load(&hdr->futex);
+    uint64_t pos = atomic_load(&hdr->tail);
+    // Re-check after announcing ourselves so a concurrent publish cannot be missed
+    if (atomic_load_explicit(&hdr->slots[pos & RING_MASK].seq, memory_order_acquire) != pos + 1)
+        futex(&hdr->futex, FUTEX_WAIT, seen, timeout);
+    atomic_store(&hdr->waiters, 0);
+}
+
+/* 1 if the name now refers to a different segment (daemon restarted) */
+int shm_ring_replaced(struct shm_ring *ring, const char *name)
+{
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd == -1)
+        return 1;
+    struct stat st;
+    int replaced = fstat(fd, &st) == -1 || st.st_ino != ring->ino;
+    close(fd);
+    return replaced;
+}
+
+void shm_ring_stats(struct shm_ring *ring, uint64_t *published, uint64_t *dropped)
+{
+    *published = atomic_load_explicit(&ring->hdr->published, memory_order_relaxed);
+    *dropped = atomic_load_explicit(&ring->hdr->dropped, memory_order_relaxed);
+}
@@ -0,0 +1,137 @@
+/* snapshot.c – Point-in-time snapshot of a reporting directory for backup */
+
+#define _GNU_SOURCE
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+/*
+ * Instead of keeping uploaders locked out for the whole backup window, the
+ * backup freezes the file set of REPORT_DIR/<date> by hard linking every
+ * report into SNAPSHOT_DIR/<date> (same filesystem, so linking is a
+ * directory entry per file) and copies from there while the live
+ * directories stay writable. Filed reports are only ever replaced by
+ * rename, never rewritten in place, so a link is as good as a copy; where
+ * links are refused (protected_hardlinks, link count limits) the file is
+ * reflinked instead, which shares extents but is a private copy.
+ *
+ * The directories are only locked for the few milliseconds the links take.
+ * If a file can neither be linked nor reflinked, snapshot_take() fails and
+ * the caller falls back to backing up the live directory under the lock.
+ */
+
+int snapshot_enabled()
+{
+    static int enabled = -1;
+    if (enabled == -1)
+        enabled = env_long("REPORT_DAEMON_SNAPSHOT", 1) != 0;
+    return enabled;
+}
+
+/* Reflink src into a new file dst, keeping mode and mtime for the manifest */
+static int snapshot_clone(int src_dirfd, int snap_dirfd, const char *name)
+{
+    int in = openat(src_dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in == -1)
+        return -1;
+    struct stat st;
+    int out = -1, rc = -1;
+    if (fstat(in, &st) == 0 &&
+        (out = openat(snap_dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 0777)) != -1 &&
+        ioctl(out, FICLONE, in) == 0)
+    {
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        futimens(out, times);
+        rc = 0;
+    }
+    int saved_errno = errno;
+    if (out != -1)
+    {
+        close(out);
+        if (rc == -1)
+            unlinkat(snap_dirfd, name, 0);
+    }
+    close(in);
+    errno = saved_errno;
+    return rc;
+}
+
+/* Remove a snapshot directory and the links in it */
+void snapshot_release(const char *snap_dir)
+{
+    DIR *dir = opendir(snap_dir);
+    if (dir)
+    {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+                unlinkat(dirfd(dir), entry->d_name, 0);
+        }
+        closedir(dir);
+    }
+    rmdir(snap_dir);
+}
+
+int snapshot_take(const char *src_dir, const char *snap_dir)
+{
+    snapshot_release(snap_dir); // left over from a backup that was interrupted
+    char snap_root[MAX_PATH_BUFFER];
+    snprintf(snap_root, sizeof(snap_root), "%s/%s", REPORT_DIR, SNAPSHOT_SUBDIR);
+    if (ensure_directory(snap_root) == -1 || ensure_directory(snap_dir) == -1)
+        return -1;
+
+    int src_fd = open(src_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (src_fd == -1)
+        return errno == ENOENT ? 0 : -1;
+    int snap_fd = open(snap_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = snap_fd == -1 ? NULL : fdopendir(dup(src_fd));
+    if (!dir)
+    {
+        if (snap_fd != -1)
+            close(snap_fd);
+        close(src_fd);
+        return -1;
+    }
+
+    int count = 0, linked = 0, failed = 0;
+    struct dirent *entry;
+    while (!failed && (entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_type != DT_REG || entry->d_name[0] == '.')
+            continue;
+        if (linkat(src_fd, entry->d_name, snap_fd, entry->d_name, 0) == 0)
+            linked++;
+        else if (errno == ENOENT)
+            continue; // removed since readdir
+        else if (snapshot_clone(src_fd, snap_fd, entry->d_name) == -1)
+        {
+            char err[MAX_PATH_BUFFER + 64];
+            snprintf(err, sizeof(err), "Failed to snapshot %s/%s: %s", src_dir, entry->d_name, strerror(errno));
+            log_message("ERROR", err);
+            failed = 1;
+            break;
+        }
+        count++;
+    }
+    closedir(dir);
+    close(snap_fd);
+    close(src_fd);
+
+    if (failed)
+    {
+        snapshot_release(snap_dir);
+        return -1;
+    }
+    if (linked < count)
+    {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Snapshot used reflinks for %d of %d reports", count - linked, count);
+        log_message("INFO", msg);
+    }
+    return count;
+}
@@ -0,0 +1,234 @@
+/* throttle.c – I/O pacing for backup runs
+ *
+ * A backup copies as fast as the disks allow, which starves uploads and the
+ * jobs reading REPORT_DIR. Threads doing backup I/O call throttle_enter()
+ * and then throttle_wait() for every chunk they copy:
+ *
+ *   - a token bucket shared by all backup threads limits the run to
+ *     REPORT_DAEMON_BACKUP_RATE bytes per second (0 = unlimited);
+ *   - while uploads are active (inotify on the upload roots) the rate is cut
+ *     to a quarter, or to THROTTLE_BUSY_RATE when unlimited, and doubles back
+ *     after each quiet interval;
+ *   - the threads run in the I/O priority class from
+ *     REPORT_DAEMON_BACKUP_IOPRIO ("idle", "be" = best-effort lowest level,
+ *     "none");
+ *   - with REPORT_DAEMON_BACKUP_FADVISE=1 the copied pages of source and
+ *     destination are dropped from the page cache afterwards.
+ *
+ * throttle_end() logs the achieved throughput of the run.
+ */
+
+#define _GNU_SOURCE
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+#define THROTTLE_CHUNK (1024 * 1024)    // largest chunk copied between two waits
+#define THROTTLE_POLL_NS 100000000L     // how often upload activity is checked
+#define THROTTLE_QUIET_NS 1000000000L   // quiet time before the rate is raised again
+
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int thread_throttled = 0;
+
+static struct
+{
+    long base_rate; // configured bytes/s, 0 = unlimited
+    long rate;      // current bytes/s, 0 = unlimited
+    double tokens;
+    struct timespec refilled;
+    int ioprio;
+    int drop_cache;
+
+    int inotify_fd;
+    struct timespec polled;
+    struct timespec last_activity;
+    unsigned long slowdowns;
+
+    struct timespec started;
+    uint64_t bytes;
+    uint64_t throttled_ns;
+} run = {.inotify_fd = -1};
+
+static int64_t ns_between(const struct timespec *a, const struct timespec *b)
+{
+    return (int64_t)(b->tv_sec - a->tv_sec) * 1000000000LL + (b->tv_nsec - a->tv_nsec);
+}
+
+static int parse_ioprio()
+{
+    const char *value = config_get("REPORT_DAEMON_BACKUP_IOPRIO");
+    if (!value || *value == '\0' || strcmp(value, "be") == 0)
+        return IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | 7;
+    if (strcmp(value, "idle") == 0)
+        return IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    return 0; // "none": inherit the daemon's priority
+}
+
+void throttle_begin()
+{
+    pthread_mutex_lock(&throttle_lock);
+    run.base_rate = env_long("REPORT_DAEMON_BACKUP_RATE", 0);
+    if (run.base_rate < 0)
+        run.base_rate = 0;
+    run.rate = run.base_rate;
+    run.tokens = 0;
+    run.ioprio = parse_ioprio();
+    run.drop_cache = env_long("REPORT_DAEMON_BACKUP_FADVISE", 0) != 0;
+    run.slowdowns = 0;
+    run.bytes = 0;
+    run.throttled_ns = 0;
+    clock_gettime(CLOCK_MONOTONIC, &run.started);
+    run.refilled = run.polled = run.started;
+    run.last_activity = (struct timespec){0, 0};
+
+    /* Foreground activity: files being written under the upload roots */
+    run.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (run.inotify_fd != -1)
+    {
+        const char *roots[MAX_UPLOAD_ROOTS];
+        int root_count = upload_roots(roots, MAX_UPLOAD_ROOTS);
+        for (int i = 0; i < root_count; i++)
+            inotify_add_watch(run.inotify_fd, roots[i], IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO);
+    }
+    pthread_mutex_unlock(&throttle_lock);
+}
+
+void throttle_enter()
+{
+    thread_throttled = 1;
+    if (run.ioprio != 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, run.ioprio) == -1)
+    {
+        char err[128];
+        snprintf(err, sizeof(err), "Failed to lower the backup I/O priority: %s", strerror(errno));
+        log_message("WARNING", err);
+    }
+}
+
+int throttle_ioprio()
+{
+    return run.ioprio;
+}
+
+size_t throttle_chunk(size_t wanted)
+{
+    if (!thread_throttled || wanted <= THROTTLE_CHUNK)
+        return wanted;
+    return THROTTLE_CHUNK;
+}
+
+/* Drain the inotify queue and adapt the rate. Caller holds throttle_lock. */
+static void poll_activity(const struct timespec *now)
+{
+    if (run.inotify_fd == -1 || ns_between(&run.polled, now) < THROTTLE_POLL_NS)
+        return;
+    run.polled = *now;
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int active = 0;
+    while (read(run.inotify_fd, buf, sizeof(buf)) > 0)
+        active = 1;
+
+    long busy_rate = run.base_rate ? run.base_rate / 4 : THROTTLE_BUSY_RATE;
+    if (active)
+    {
+        if (run.rate == 0 || run.rate > busy_rate)
+        {
+            run.rate = busy_rate;
+            run.slowdowns++;
+        }
+        run.last_activity = *now;
+    }
+    else if (run.rate != run.base_rate && ns_between(&run.last_activity, now) >= THROTTLE_QUIET_NS)
+    {
+        // Quiet again: back to the configured rate in doubling steps
+        run.rate *= 2;
+        if (run.base_rate ? run.rate >= run.base_rate : run.rate >= 4 * busy_rate)
+            run.rate = run.base_rate;
+        run.last_activity = *now;
+    }
+}
+
+void throttle_wait(size_t bytes)
+{
+    if (!thread_throttled)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&throttle_lock);
+    run.bytes += bytes;
+    poll_activity(&now);
+    if (run.rate == 0)
+    {
+        pthread_mutex_unlock(&throttle_lock);
+        return;
+    }
+
+    /* Refill, allowing a burst of a quarter second; a chunk larger than the
+       balance is taken on credit and paid for by sleeping */
+    run.tokens += ns_between(&run.refilled, &now) / 1e9 * run.rate;
+    if (run.tokens > run.rate / 4.0)
+        run.tokens = run.rate / 4.0;
+    run.refilled = now;
+    run.tokens -= bytes;
+    int64_t wait_ns = run.tokens < 0 ? (int64_t)(-run.tokens / run.rate * 1e9) : 0;
+    run.throttled_ns += wait_ns;
+    pthread_mutex_unlock(&throttle_lock);
+
+    if (wait_ns > 0)
+    {
+        struct timespec delay = {wait_ns / 1000000000LL, wait_ns % 1000000000LL};
+        while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+            ;
+    }
+}
+
+void throttle_drop_cache(const char *src, const char *dst)
+{
+    if (!run.drop_cache)
+        return;
+    int fd = open(dst, O_RDONLY | O_CLOEXEC);
+    if (fd != -1)
+    {
+        // Dirty pages cannot be dropped: write them back first
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    fd = open(src, O_RDONLY | O_CLOEXEC);
+    if (fd != -1)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+void throttle_end(const char *what)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&throttle_lock);
+    if (run.inotify_fd != -1)
+    {
+        close(run.inotify_fd);
+        run.inotify_fd = -1;
+    }
+    double seconds = ns_between(&run.started, &now) / 1e9;
+    double mib = run.bytes / (1024.0 * 1024.0);
+    char msg[256];
+    snprintf(msg, sizeof(msg),
+             "Backup throughput for %s: %.1f MiB in %.2f s (%.1f MiB/s), throttled %.2f s, slowed down %lu time(s) for uploads",
+             what, mib, seconds, seconds > 0 ? mib / seconds : 0.0, run.throttled_ns / 1e9, run.slowdowns);
+    pthread_mutex_unlock(&throttle_lock);
+    log_event("INFO", "throughput", msg);
+    ipc_send(ipc_default(), "throughput", 1, msg);
+}
@@ -0,0 +1,554 @@
+/* uring.c – io_uring engine for bulk report moves and backups
+ *
+ * The nightly move and backup are long runs of small blocking syscalls, and
+ * on a network-attached volume every one of them costs a round trip. With
+ * REPORT_DAEMON_IO_URING=<depth> they are queued on an io_uring instead so
+ * that <depth> files are in flight at once:
+ *
+ *   - renames are submitted as one IORING_OP_RENAMEAT per report;
+ *   - every file copy is a linked chain OPENAT(src) -> OPENAT(dst) ->
+ *     READ_FIXED -> WRITE_FIXED into direct descriptors (registered file
+ *     slots, so the opens need no round trip through userspace) and one
+ *     registered buffer per file, followed by further linked READ/WRITE
+ *     pairs for larger files and two CLOSEs. The FNV-1a content hash is
+ *     computed from the buffer as each chunk completes, so the backup does
+ *     not read the file a second time for the manifest.
+ *
+ * The ring is driven with raw syscalls (no liburing). If io_uring is
+ * missing, disabled or lacks one of the opcodes, uring_create() returns
+ * NULL and callers keep using the synchronous path; a copy that fails in
+ * the ring is retried by the caller with the regular copy engine.
+ */
+
+#define _GNU_SOURCE
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_OP_OPEN_SRC 0
+#define URING_OP_OPEN_DST 1
+#define URING_OP_READ 2
+#define URING_OP_WRITE 3
+#define URING_OP_CLOSE 4
+#define URING_OP_RENAME 5
+#define URING_OPS 6
+
+/* One file copy in flight, using file slots 2 * index and 2 * index + 1 and buffer index */
+struct uring_slot
+{
+    struct uring_copy *job; // NULL when free
+    off_t offset;           // next chunk to read
+    off_t chunk;            // length of the chunk in flight
+    int pending;            // SQEs submitted and not yet completed
+    int opened;             // bit 0: source open, bit 1: destination open
+    int closing;
+    int error;
+    uint64_t hash;
+    struct timespec submitted[URING_OPS];
+};
+
+struct uring
+{
+    int fd;
+    unsigned depth; // files in flight
+    unsigned entries;
+
+    /* Submission queue */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;
+    unsigned to_submit;
+
+    /* Completion queue */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+
+    char *buffers;
+    struct uring_slot *slots;
+    unsigned in_flight; // SQEs submitted, not completed
+
+    struct uring_stats stats;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_depth()
+{
+    long depth = env_long("REPORT_DAEMON_IO_URING", 0);
+    if (depth <= 0)
+        return 0;
+    return depth > URING_MAX_DEPTH ? URING_MAX_DEPTH : (int)depth;
+}
+
+/* All opcodes the engine relies on must be supported by the running kernel */
+static int uring_probe(int fd)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (!probe)
+        return -1;
+    int ok = sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    static const int needed[] = {IORING_OP_OPENAT, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+                                 IORING_OP_CLOSE, IORING_OP_RENAMEAT};
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++)
+        ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok ? 0 : -1;
+}
+
+void uring_destroy(struct uring *r)
+{
+    if (!r)
+        return;
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_map && r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_size);
+    if (r->sq_map)
+        munmap(r->sq_map, r->sq_map_size);
+    if (r->fd != -1)
+        close(r->fd);
+    if (r->buffers)
+        munmap(r->buffers, (size_t)r->depth * URING_BUFFER_SIZE);
+    free(r->slots);
+    free(r);
+}
+
+struct uring *uring_create(int depth)
+{
+    if (depth <= 0)
+        return NULL;
+    struct uring *r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+    r->fd = -1;
+    r->depth = depth;
+
+    /* Room for a full chain per file (2 opens, read, write) plus the closes */
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP;
+    r->fd = sys_io_uring_setup(depth * 4, &p);
+    if (r->fd == -1 || !(p.features & IORING_FEAT_SINGLE_MMAP) || uring_probe(r->fd) == -1)
+        goto fail;
+    r->entries = p.sq_entries;
+
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (r->cq_map_size > r->sq_map_size)
+        r->sq_map_size = r->cq_map_size;
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED)
+    {
+        r->sq_map = NULL;
+        goto fail;
+    }
+    r->cq_map = r->sq_map;
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+    {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = r->sq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(sq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(sq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(sq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+    r->sq_local_tail = *r->sq_tail;
+
+    /* One registered buffer per file in flight and two direct descriptor slots */
+    r->slots = calloc(depth, sizeof(struct uring_slot));
+    r->buffers = mmap(NULL, (size_t)depth * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!r->slots || r->buffers == MAP_FAILED)
+    {
+        r->buffers = NULL;
+        goto fail;
+    }
+    struct iovec iov[URING_MAX_DEPTH];
+    int files[2 * URING_MAX_DEPTH];
+    for (int i = 0; i < depth; i++)
+    {
+        iov[i].iov_base = r->buffers + (size_t)i * URING_BUFFER_SIZE;
+        iov[i].iov_len = URING_BUFFER_SIZE;
+        files[2 * i] = files[2 * i + 1] = -1; // sparse: filled by OPENAT
+    }
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_BUFFERS, iov, depth) == -1 ||
+        sys_io_uring_register(r->fd, IORING_REGISTER_FILES, files, 2 * depth) == -1)
+        goto fail;
+    return r;
+
+fail:
+    {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "io_uring unavailable (%s), using synchronous I/O", strerror(errno));
+        log_message("WARNING", msg);
+    }
+    uring_destroy(r);
+    return NULL;
+}
+
+void uring_get_stats(const struct uring *r, struct uring_stats *stats)
+{
+    *stats = r->stats;
+}
+
+/* Next free SQE, or NULL if the submission queue is full */
+static struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head >= r->entries)
+        return NULL;
+    unsigned idx = r->sq_local_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sq_local_tail++;
+    r->to_submit++;
+    return sqe;
+}
+
+/* Submit queued SQEs and wait for at least wait_for completions */
+static int uring_submit(struct uring *r, unsigned wait_for)
+{
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned submitting = r->to_submit;
+    if (submitting == 0 && wait_for == 0)
+        return 0;
+
+    int rc;
+    do
+        rc = sys_io_uring_enter(r->fd, submitting, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0);
+    while (rc == -1 && errno == EINTR);
+    if (rc == -1)
+        return -1;
+    r->to_submit -= rc;
+    r->in_flight += rc;
+    r->stats.submitted += rc;
+    if (rc > 0)
+    {
+        r->stats.depth_sum += r->in_flight;
+        r->stats.depth_samples++;
+        if (r->in_flight > r->stats.max_depth)
+            r->stats.max_depth = r->in_flight;
+    }
+    return 0;
+}
+
+static void note_latency(struct uring *r, const struct timespec *submitted)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t ns = (now.tv_sec - submitted->tv_sec) * 1000000000ULL + (now.tv_nsec - submitted->tv_nsec);
+    r->stats.completed++;
+    r->stats.latency_ns_sum += ns;
+    if (ns > r->stats.latency_ns_max)
+        r->stats.latency_ns_max = ns;
+}
+
+/* user_data: slot index << 8 | op */
+static void prep(struct uring *r, struct io_uring_sqe *sqe, unsigned slot, int op, int opcode)
+{
+    sqe->opcode = opcode;
+    sqe->user_data = ((uint64_t)slot << 8) | op;
+    clock_gettime(CLOCK_MONOTONIC, &r->slots[slot].submitted[op]);
+    r->slots[slot].pending++;
+}
+
+/* Queue the next READ_FIXED -> WRITE_FIXED pair of a copy */
+static void queue_chunk(struct uring *r, unsigned i)
+{
+    struct uring_slot *s = &r->slots[i];
+    off_t left = s->job->size - s->offset;
+    s->chunk = left < URING_BUFFER_SIZE ? left : URING_BUFFER_SIZE;
+    throttle_wait(s->chunk);
+    char *buf = r->buffers + (size_t)i * URING_BUFFER_SIZE;
+
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    prep(r, sqe, i, URING_OP_READ, IORING_OP_READ_FIXED);
+    sqe->fd = 2 * i;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->ioprio = throttle_ioprio();
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = s->chunk;
+    sqe->off = s->offset;
+    sqe->buf_index = i;
+
+    sqe = uring_sqe(r);
+    prep(r, sqe, i, URING_OP_WRITE, IORING_OP_WRITE_FIXED);
+    sqe->fd = 2 * i + 1;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->ioprio = throttle_ioprio();
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = s->chunk;
+    sqe->off = s->offset;
+    sqe->buf_index = i;
+}
+
+/* Start copying job in slot i: opens, first chunk, all linked */
+static void queue_copy(struct uring *r, unsigned i, struct uring_copy *job)
+{
+    struct uring_slot *s = &r->slots[i];
+    memset(s, 0, sizeof(*s));
+    s->job = job;
+    s->hash = 0xcbf29ce484222325ULL;
+
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    prep(r, sqe, i, URING_OP_OPEN_SRC, IORING_OP_OPENAT);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)job->src;
+    sqe->open_flags = O_RDONLY; // O_CLOEXEC is refused for direct descriptors
+    sqe->file_index = 2 * i + 1; // direct descriptor 2 * i
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = uring_sqe(r);
+    prep(r, sqe, i, URING_OP_OPEN_DST, IORING_OP_OPENAT);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)job->dst;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->len = job->mode & 07777;
+    sqe->file_index = 2 * i + 2;
+    if (job->size > 0)
+    {
+        sqe->flags = IOSQE_IO_LINK;
+        queue_chunk(r, i);
+    }
+}
+
+/* Close whatever the slot opened; the copy is finished once the closes complete */
+static void queue_close(struct uring *r, unsigned i)
+{
+    struct uring_slot *s = &r->slots[i];
+    s->closing = 1;
+    for (int f = 0; f < 2; f++)
+    {
+        if (!(s->opened & (1 << f)))
+            continue;
+        struct io_uring_sqe *sqe = uring_sqe(r);
+        prep(r, sqe, i, URING_OP_CLOSE, IORING_OP_CLOSE);
+        sqe->file_index = 2 * i + f + 1;
+    }
+}
+
+/* Handle one copy completion; returns 1 when the slot's job is finished */
+static int copy_completion(struct uring *r, unsigned i, int op, int res)
+{
+    struct uring_slot *s = &r->slots[i];
+    s->pending--;
+    note_latency(r, &s->submitted[op]);
+
+    if (res < 0 && op != URING_OP_CLOSE)
+    {
+        if (s->error == 0 && res != -ECANCELED)
+            s->error = -res;
+    }
+    else if (op == URING_OP_OPEN_SRC)
+        s->opened |= 1;
+    else if (op == URING_OP_OPEN_DST)
+        s->opened |= 2;
+    else if (op == URING_OP_READ && res != s->chunk && s->error == 0)
+        s->error = EIO; // short read: the file changed size, the caller copies it again
+    else if (op == URING_OP_WRITE && s->error == 0)
+    {
+        if (res != s->chunk)
+            s->error = EIO;
+        else
+        {
+            const unsigned char *data = (const unsigned char *)r->buffers + (size_t)i * URING_BUFFER_SIZE;
+            for (off_t k = 0; k < s->chunk; k++)
+            {
+                s->hash ^= data[k];
+                s->hash *= 0x100000001b3ULL;
+            }
+            s->offset += s->chunk;
+        }
+    }
+
+    if (s->pending > 0)
+        return 0;
+    if (!s->closing)
+    {
+        if (s->error == 0 && s->offset < s->job->size)
+        {
+            queue_chunk(r, i);
+            return 0;
+        }
+        if (s->error == 0 && s->opened != 3)
+            s->error = EIO;
+        queue_close(r, i);
+        if (s->pending > 0)
+            return 0;
+    }
+
+    /* Done: keep mode and mtime like the regular copy engine */
+    struct uring_copy *job = s->job;
+    job->error = s->error;
+    job->hash = s->hash;
+    if (job->error == 0)
+    {
+        struct timespec times[2] = {job->atime, job->mtime};
+        if (chmod(job->dst, job->mode & 07777) == -1 || utimensat(AT_FDCWD, job->dst, times, 0) == -1)
+        {
+            char err[MAX_PATH_BUFFER + 64];
+            snprintf(err, sizeof(err), "Failed to preserve attributes on %s: %s", job->dst, strerror(errno));
+            log_message("WARNING", err);
+        }
+    }
+    s->job = NULL;
+    return 1;
+}
+
+/* Reap available completions, waiting for at least one */
+static int uring_reap(struct uring *r, void (*on_cqe)(struct uring *r, uint64_t data, int res, void *arg), void *arg)
+{
+    if (uring_submit(r, 1) == -1)
+        return -1;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        r->in_flight--;
+        on_cqe(r, data, res, arg);
+    }
+    return 0;
+}
+
+struct copy_run
+{
+    int finished;
+    int ok;
+};
+
+static void on_copy_cqe(struct uring *r, uint64_t data, int res, void *arg)
+{
+    struct copy_run *run = arg;
+    unsigned i = data >> 8;
+    if (copy_completion(r, i, data & 0xff, res))
+    {
+        run->finished++;
+        if (r->slots[i].error == 0)
+            run->ok++;
+    }
+}
+
+int uring_copy_batch(struct uring *r, struct uring_copy *jobs, int count)
+{
+    struct copy_run run = {0, 0};
+    int next = 0;
+    for (int i = 0; i < count; i++)
+        jobs[i].error = -1; // not attempted
+
+    while (run.finished < next || next < count)
+    {
+        /* Fill free slots; each new copy needs at most four SQEs */
+        for (unsigned i = 0; i < r->depth && next < count; i++)
+        {
+            if (r->slots[i].job || r->entries - (r->sq_local_tail - *r->sq_head) < 4)
+                continue;
+            queue_copy(r, i, &jobs[next++]);
+        }
+        if (uring_reap(r, on_copy_cqe, &run) == -1)
+        {
+            // Ring failure: whatever is unfinished is left to the caller's fallback
+            char err[128];
+            snprintf(err, sizeof(err), "io_uring submission failed: %s", strerror(errno));
+            log_message("ERROR", err);
+            return run.ok;
+        }
+    }
+    return run.ok;
+}
+
+struct rename_run
+{
+    int *errors;
+    struct timespec *submitted;
+    int done;
+};
+
+static void on_rename_cqe(struct uring *r, uint64_t data, int res, void *arg)
+{
+    struct rename_run *run = arg;
+    unsigned i = data >> 8;
+    run->errors[i] = res < 0 ? -res : 0;
+    run->done++;
+    note_latency(r, &run->submitted[i]);
+}
+
+int uring_rename_batch(struct uring *r, const char *const *src, const char *const *dst, int count, int *errors)
+{
+    struct timespec *submitted = malloc((count > 0 ? count : 1) * sizeof(struct timespec));
+    if (!submitted)
+        return 0;
+    struct rename_run run = {errors, submitted, 0};
+    int queued = 0;
+    for (int i = 0; i < count; i++)
+        errors[i] = -1; // not attempted
+    while (run.done < count)
+    {
+        struct io_uring_sqe *sqe;
+        while (queued < count && queued - run.done < (int)r->depth && (sqe = uring_sqe(r)) != NULL)
+        {
+            sqe->opcode = IORING_OP_RENAMEAT;
+            sqe->user_data = (uint64_t)queued << 8 | URING_OP_RENAME;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)src[queued];
+            sqe->len = AT_FDCWD;
+            sqe->addr2 = (uintptr_t)dst[queued];
+            clock_gettime(CLOCK_MONOTONIC, &submitted[queued]);
+            queued++;
+        }
+        if (uring_reap(r, on_rename_cqe, &run) == -1)
+            break;
+    }
+    free(submitted);
+    return run.done;
+}
+
+void uring_log_stats(const struct uring *r, const char *what)
+{
+    const struct uring_stats *st = &r->stats;
+    if (st->submitted == 0)
+        return;
+    char msg[256];
+    snprintf(msg, sizeof(msg),
+             "io_uring %s: %lu ops, queue depth avg %.1f max %u, completion latency avg %lu us max %lu us",
+             what, st->submitted, st->depth_samples ? (double)st->depth_sum / st->depth_samples : 0.0,
+             st->max_depth, st->completed ? (unsigned long)(st->latency_ns_sum / st->completed / 1000) : 0,
+             (unsigned long)(st->latency_ns_max / 1000));
+    log_event("INFO", "io_uring", msg);
+    ipc_send(ipc_default(), "io_uring", 1, msg);
+}
@@ -7,6 +7,7 @@
 #include <string.h>
 #include <time.h>
 #include "utils.h"
+#include <sys/timerfd.h>
 
 void lock_directories()
 {
@@ -102,56 +103,65 @@ int ensure_directory(const char *dir_path)
     return 0;
 }
 
-// Function to copy a file from src to dst
-int copy_file(const char *src, const char *dst)
+/* Read an integer setting (environment or configuration file), falling back when unset or invalid */
+long env_long(const char *name, long fallback)
 {
-    FILE *in = fopen(src, "rb"); // "b" is for binary mode - no translations, raw
-    if (!in)
+    const char *value = config_get(name);
+    if (!value || *value == '\0')
+        return fallback;
+
+    char *end;
+    errno = 0;
+    long parsed = strtol(value, &end, 10);
+    if (errno != 0 || *end != '\0')
+        return fallback;
+    return parsed;
+}
+
+/* Arm an absolute CLOCK_REALTIME timer for the next local hour:minute.
+   TFD_TIMER_CANCEL_ON_SET makes a clock jump wake us so the timer is recomputed. */
+int daily_timer_arm(int tfd, int hour, int minute)
+{
+    // Not time(): its coarse clock can lag the timer that just fired and re-arm it for now
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    time_t now = ts.tv_sec;
+    struct tm next;
+    localtime_r(&now, &next);
+    next.tm_hour = hour;
+    next.tm_min = minute;
+    next.tm_sec = 0;
+    next.tm_isdst = -1;
+
+    time_t when = mktime(&next);
+    if (when <= now)
     {
-        char err[256];
-        snprintf(err, sizeof(err), "Failed to open source file %s: %s", src, strerror(errno));
-        log_message("ERROR", err);
-        return -1;
+        next.tm_mday++; // mktime() normalises month and year rollover
+        next.tm_hour = hour;
+        next.tm_min = minute;
+        next.tm_sec = 0;
+        next.tm_isdst = -1;
+        when = mktime(&next);
     }
 
-    FILE *out = fopen(dst, "wb");
-    if (!out)
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = when;
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL) == -1)
     {
         char err[256];
-        snprintf(err, sizeof(err), "Failed to open destination file %s: %s", dst, strerror(errno));
+        snprintf(err, sizeof(err), "Failed to arm %02d:%02d timer: %s", hour, minute, strerror(errno));
         log_message("ERROR", err);
-        fclose(in);
         return -1;
     }
-
-    char buffer[4096];
-    size_t bytes;
-    while ((bytes = fread(buffer, 1, sizeof(buffer), in)) > 0)
-    {
-        if (fwrite(buffer, 1, bytes, out) != bytes)
-        {
-            log_message("ERROR", "Error writing data during file copy");
-            fclose(in);
-            fclose(out);
-            return -1;
-        }
-    }
-
-    fclose(in);
-    fclose(out);
     return 0;
 }
 
-/* Helper function to check if it's within a specific time window */
-int is_time(int hour, int minute)
+/* Consume a timer expiry. Returns 1 if it fired, 0 if the wall clock was
+   changed and the timer has to be re-armed without running the job. */
+int daily_timer_read(int tfd)
 {
-    time_t now;
-    struct tm *current_time;
-    time(&now);
-    current_time = localtime(&now);
-
-    // Check if we're within the first minute of the specified hour
-    return (current_time->tm_hour == hour &&
-            current_time->tm_min == minute &&
-            current_time->tm_sec < 60); // Only trigger once in the minute
-}
\ No newline at end of file
+    uint64_t expirations;
+    if (read(tfd, &expirations, sizeof(expirations)) == -1)
+        return errno == ECANCELED ? 0 : -1;
+    return 1;
+}
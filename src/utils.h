@@ -8,18 +8,41 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <mqueue.h>
+#include <stdint.h>
 
-#define UPLOAD_DIR "/var/reports/uploads"
-#define REPORT_DIR "/var/reports/reporting"
-#define BACKUP_DIR "/var/reports/backup"
+// Data directories, fixed at startup (REPORT_DAEMON_UPLOAD_DIR, _REPORT_DIR, _BACKUP_DIR)
+#define DEFAULT_UPLOAD_DIR "/var/reports/uploads"
+#define DEFAULT_REPORT_DIR "/var/reports/reporting"
+#define DEFAULT_BACKUP_DIR "/var/reports/backup"
+#define UPLOAD_DIR config_dir("UPLOAD_DIR")
+#define REPORT_DIR config_dir("REPORT_DIR")
+#define BACKUP_DIR config_dir("BACKUP_DIR")
 #define LOG_FILE "/var/log/report_daemon.log"
+#define LOG_SEGMENT_DIR "/var/log/report_daemon"
+#define QUARANTINE_DIR "/var/reports/quarantine"
+#define CATALOG_DIR "/var/reports/catalog"
+#define SNAPSHOT_SUBDIR ".snapshot" // under REPORT_DIR
 
 // Definitions for backup status
 #define BACKUP_SUCCESS 1
 #define BACKUP_FAILURE 0
 
-// Message queue name
+// Message queue name and depth (messages are at most IPC_WIRE_MAX bytes, see ipc_wire.h)
 #define MQ_NAME "/report_daemon_mq"
+#define MQ_MAX_MSG 10
+
+// Shared-memory event ring (alternative IPC transport, see shm_ring.c)
+#define SHM_RING_NAME "/report_daemon_ring"
+#define SHM_RING_CAPACITY 4096 // slots, power of two
+#define SHM_RING_PAYLOAD 1008  // bytes per record
+
+// Group allowed to attach a monitor to the ring (the segment is 0660)
+#ifndef SHM_RING_GROUP
+#define SHM_RING_GROUP "report_daemon"
+#endif
+
+#define IPC_TRANSPORT_MQ 0
+#define IPC_TRANSPORT_SHM 1
 
 #ifndef DEPT_COUNT
 #define DEPT_COUNT 4
@@ -29,20 +52,211 @@
 #define FILE_PREFIX "dept"
 #endif
 
+// Expected department reports, one per line (REPORT_DAEMON_DEPARTMENTS overrides the path)
+#ifndef DEPT_LIST_FILE
+#define DEPT_LIST_FILE "/etc/report_daemon/departments.conf"
+#endif
+
 #define MAX_PATH_BUFFER 4096
 
+// Runtime configuration, reread on SIGHUP (REPORT_DAEMON_CONFIG overrides the path)
+#ifndef CONFIG_FILE
+#define CONFIG_FILE "/etc/report_daemon/report_daemon.conf"
+#endif
+
+// Report validation: required root element and the root attribute naming the
+// department ("" skips the check); REPORT_DAEMON_XML_ROOT/_DEPT_ATTR override
+#ifndef VALIDATE_ROOT_ELEMENT
+#define VALIDATE_ROOT_ELEMENT ""
+#endif
+
+#ifndef VALIDATE_DEPT_ATTRIBUTE
+#define VALIDATE_DEPT_ATTRIBUTE ""
+#endif
+
+// Live report presence index kept by the upload monitor (see presence.c)
+#define PRESENCE_SHM_NAME "/report_daemon_presence"
+
+// Upload roots: UPLOAD_DIR plus REPORT_DAEMON_UPLOAD_ROOTS (colon separated)
+#define MAX_UPLOAD_ROOTS 32
+
+// Share of fs.inotify.max_user_watches used before switching to fanotify
+#ifndef WATCH_BUDGET_PERCENT
+#define WATCH_BUDGET_PERCENT 90
+#endif
+
+// Window for coalescing upload events per file name, in milliseconds
+#ifndef COALESCE_WINDOW_MS
+#define COALESCE_WINDOW_MS 250
+#endif
+
+// Owner name cache lifetimes in seconds (see enrich.c)
+#ifndef OWNER_CACHE_TTL
+#define OWNER_CACHE_TTL 600
+#endif
+
+#ifndef OWNER_NEGATIVE_TTL
+#define OWNER_NEGATIVE_TTL 60
+#endif
+
+// Upload pipeline worker threads (0 = number of online CPUs, see pipeline.c)
+#ifndef PIPELINE_WORKERS
+#define PIPELINE_WORKERS 0
+#endif
+
+#define PIPELINE_MAX_WORKERS 64
+#define PIPELINE_QUEUE_SLOTS 1024 // jobs per worker queue, power of two
+
+// Pipeline stage counters are logged at most this often, in seconds
+#ifndef PIPELINE_STATS_INTERVAL
+#define PIPELINE_STATS_INTERVAL 300
+#endif
+
+// Backup worker threads (0 = number of online CPUs)
+#ifndef BACKUP_WORKERS
+#define BACKUP_WORKERS 0
+#endif
+
+#define BACKUP_MAX_WORKERS 64
+
+// Default daily schedule (local time): missing report check and nightly backup;
+// DEADLINE and BACKUP_TIME in the configuration file override them
+#ifndef DEADLINE_HOUR
+#define DEADLINE_HOUR 23
+#define DEADLINE_MINUTE 30
+#endif
+
+#ifndef BACKUP_HOUR
+#define BACKUP_HOUR 1
+#define BACKUP_MINUTE 0
+#endif
+
+// Last known state of the upload trees, for reconciliation (see reconcile.c)
+#define UPLOAD_STATE_FILE "/var/reports/.upload_state"
+#ifndef RECONCILE_MAX_ENTRIES
+#define RECONCILE_MAX_ENTRIES (4 * 1024 * 1024) // files tracked at most
+#endif
+
+// Binary log segments: size, retention and age before rotation
+// (REPORT_DAEMON_LOG_SEGMENT_MB, _LOG_SEGMENTS, _LOG_ROTATE_SECONDS)
+#ifndef LOG_SEGMENT_MB
+#define LOG_SEGMENT_MB 16
+#endif
+
+#ifndef LOG_SEGMENT_KEEP
+#define LOG_SEGMENT_KEEP 64
+#endif
+
+#ifndef LOG_ROTATE_SECONDS
+#define LOG_ROTATE_SECONDS 86400
+#endif
+
+// Name of the per backup directory manifest (see manifest.c)
+#define MANIFEST_FILE ".manifest"
+
+// Write-ahead journal of a backup run in progress (see journal.c)
+#define JOURNAL_FILE ".journal"
+#ifndef JOURNAL_BATCH
+#define JOURNAL_BATCH 64         // copies per checkpoint
+#define JOURNAL_INTERVAL_MS 2000 // or checkpoint at least this often
+#endif
+#define BACKUP_RESUME_MAX 16     // interrupted runs resumed at startup
+
 /* IPC functions using POSIX message queues */
 mqd_t init_msg_queue();
 int send_task_msg(mqd_t mq, const char *task, int result, const char *msg_text);
 void cleanup_msg_queue(mqd_t mq);
 void close_msg_queue(mqd_t mq);
 
+/* Shared-memory MPSC event ring */
+struct shm_ring;
+struct shm_ring *shm_ring_create(const char *name);
+struct shm_ring *shm_ring_attach(const char *name);
+void shm_ring_detach(struct shm_ring *ring);
+int shm_ring_publish(struct shm_ring *ring, const void *data, size_t len);
+size_t shm_ring_consume(struct shm_ring *ring, void *data, size_t size, uint64_t *seq);
+void shm_ring_wait(struct shm_ring *ring, int timeout_ms);
+int shm_ring_replaced(struct shm_ring *ring, const char *name);
+void shm_ring_stats(struct shm_ring *ring, uint64_t *published, uint64_t *dropped);
+
+// IPC_TRANSPORT_MQ or IPC_TRANSPORT_SHM, chosen by REPORT_DAEMON_IPC
+int ipc_transport();
+
+/* Persistent IPC context: open the queue once per process and reuse it.
+   Non-blocking contexts buffer messages locally while the queue is full. */
+struct ipc_ctx;
+struct ipc_event;
+struct ipc_ctx *ipc_open(int nonblocking);
+int ipc_send(struct ipc_ctx *ctx, const char *task, int result, const char *msg_text);
+
+// Same with typed fields (file, size, owner, ...); pid and timestamp are filled in
+int ipc_send_event(struct ipc_ctx *ctx, const struct ipc_event *ev);
+
+/* Between ipc_hold() and ipc_release() events are packed into full messages
+   (or sent after IPC_BATCH_MS) instead of one message each; holds nest */
+void ipc_hold(struct ipc_ctx *ctx);
+void ipc_release(struct ipc_ctx *ctx);
+
+int ipc_flush(struct ipc_ctx *ctx);
+void ipc_stats(struct ipc_ctx *ctx, unsigned long *sent, unsigned long *deferred, unsigned long *dropped);
+void ipc_close(struct ipc_ctx *ctx);
+
+// Shared non-blocking context of the current process, opened on first use
+struct ipc_ctx *ipc_default();
+
+// Flush and close the current process's shared context
+void ipc_shutdown();
+
 // File checking functions
 void check_missing_reports();
 
-// Logging function
+/* Expected department reports, reloaded when DEPT_LIST_FILE changes.
+   The returned set stays valid until the next dept_set_get(). */
+struct dept_set;
+struct dept_set *dept_set_get();
+int dept_set_count(const struct dept_set *set);
+const char *dept_set_name(const struct dept_set *set, int index);
+uint64_t dept_set_fingerprint(const struct dept_set *set);
+
+// Index of a report file name in the set, or -1
+int dept_set_find(const struct dept_set *set, const char *name, size_t len);
+
+// Names of the missing expected reports on stdout, returns how many are missing
+int list_missing_reports();
+
+// Set the bit of every expected report found in dir (recursively), returns how many were new
+int dept_mark_present(const struct dept_set *set, const char *dir, uint64_t *present);
+
+// Logging function (buffered, written by a background flusher)
 void log_message(const char *type, const char *message);
 
+// Same, also tagging the record with an event type (the IPC task name); only the binary log keeps it
+void log_event(const char *type, const char *event, const char *message);
+
+// Write out all buffered log records and wait until they reach LOG_FILE
+void log_flush();
+
+// Reopen LOG_FILE (after rotation), keeping buffered records
+void log_reopen();
+
+// Drain the log buffer and stop the flusher thread of the current process
+void log_shutdown();
+
+/* Binary log segments (binlog.c), used instead of LOG_FILE with
+   REPORT_DAEMON_LOG_FORMAT=binary */
+int binlog_enabled();
+
+// Encode a record for the logger's ring, returns its length
+size_t binlog_encode(char *buf, size_t size, const char *level, const char *event, const char *text);
+
+// Append encoded records to the current segment, rotating as needed
+void binlog_write(const char *records, size_t len);
+void binlog_rotate();
+void binlog_close();
+
+// "report_daemon log-dump [--from TIME] [--to TIME] [--type NAME]"
+int binlog_dump(int argc, char **argv);
+
 // Directory and File functions
 int ensure_directory(const char *dir_path);
 
@@ -52,16 +266,300 @@ void lock_directories();
 // Unlock directories after backup
 void unlock_directories();
 
-// Perform backup functionality
-void perform_backup();
+/* Snapshot backups (REPORT_DAEMON_SNAPSHOT=0 restores the locked backup
+   window): freeze src_dir into snap_dir with hard links or reflinks,
+   returns the number of reports or -1 */
+int snapshot_enabled();
+int snapshot_take(const char *src_dir, const char *snap_dir);
+void snapshot_release(const char *snap_dir);
 
-// Function monitoring reports dir
-void monitor_directory();
+// 1 if a report uploaded at `when` arrived after its cycle's missing report deadline
+int report_is_late(time_t when);
 
-// Helper to check if it's a specific time
-int is_time(int hour, int minute);
+// Current date as "YYYY-MM-DD"
+void get_date_string(char *buffer, size_t size);
 
-// Helper to copy a file
+// Date of the reporting directory new uploads belong to (the next nightly backup's date)
+void report_cycle_date(char *buffer, size_t size);
+
+// 1 when REPORT_DAEMON_STREAM_INGEST asks for reports to be filed as they arrive
+int ingest_enabled();
+
+// Move a finished .xml upload into REPORT_DIR/<cycle date> (other files are ignored)
+int ingest_report(const char *path);
+
+// Perform backup functionality, returns BACKUP_SUCCESS or BACKUP_FAILURE
+int perform_backup();
+
+// Start perform_backup() on a background thread (-1 if one is already running)
+int start_backup();
+
+// Finish interrupted backups (see journal.c), start_resume() in the background
+int resume_backups();
+int start_resume();
+
+// 1 while a background backup is running
+int backup_in_progress();
+
+// 1 once after a background backup finished, storing its status
+int backup_poll(int *status);
+
+// eventfd that becomes readable whenever a background backup finishes
+int backup_event_fd();
+
+/* Upload watcher: runs until PIPELINE_STOP is requested through control_fd.
+   It is the only thread that may call dept_set_get() and the presence_*
+   writer functions. */
+void monitor_directory(int control_fd);
+
+// Enrich, log and report one coalesced upload event (pipeline enrich stage)
+void report_file_event(const char *event_type, const char *path, size_t display, time_t when);
+
+/* In-process upload pipeline (pipeline.c): the watcher thread hands
+   coalesced events to worker threads; requests are PIPELINE_* bits */
+#define PIPELINE_STOP 1u
+#define PIPELINE_CHECK_MISSING 2u
+#define PIPELINE_RECONCILE 4u
+#define PIPELINE_RECONFIGURE 8u
+int pipeline_start();
+void pipeline_stop();
+
+// Queue an event for the workers (display: offset of the name shown in reports)
+int pipeline_submit(const char *event, const char *path, size_t display);
+
+// Ask the watcher for PIPELINE_* work, -1 when the pipeline or its watcher is not running
+int pipeline_control(unsigned request);
+
+// Watcher side: the requests made since the last call
+unsigned pipeline_requests();
+
+// Log per-stage queue depths and latencies (at most every PIPELINE_STATS_INTERVAL unless forced)
+void pipeline_log_stats(int force);
+
+// Fill roots with the configured upload roots, returns how many
+int upload_roots(const char **roots, int max);
+
+/* Recursive multi-root watch manager (inotify, fanotify fallback).
+   The callback gets the event's directory, file name, an inotify mask and the
+   length of the root prefix; overflows arrive with dir/name NULL and IN_Q_OVERFLOW. */
+typedef void (*watch_event_fn)(const char *dir, const char *name, uint32_t mask, size_t root_len, void *arg);
+struct watch_manager;
+struct watch_manager *watch_manager_create(watch_event_fn on_event, void *arg);
+int watch_add_root(struct watch_manager *wm, const char *path);
+// Stop watching a root added earlier; the other roots' watches are untouched
+int watch_remove_root(struct watch_manager *wm, const char *path);
+int watch_manager_inotify_fd(struct watch_manager *wm);
+int watch_manager_fanotify_fd(struct watch_manager *wm);
+int watch_manager_process(struct watch_manager *wm, int fd);
+size_t watch_count(struct watch_manager *wm);
+void watch_manager_destroy(struct watch_manager *wm);
+
+/* Upload reconciliation (reconcile.c): rescan the upload roots and replay
+   what changed since the last known state through on_event as synthetic
+   inotify events. Only the watcher thread uses it. */
+struct reconcile;
+struct reconcile *reconcile_create(const char **roots, int root_count);
+
+// Returns the number of events replayed, or -1
+int reconcile_run(struct reconcile *rc, const char *why, watch_event_fn on_event, void *arg);
+
+// Switch to a new set of roots: files in the added ones are replayed, dropped ones forgotten
+int reconcile_set_roots(struct reconcile *rc, const char **roots, int root_count, watch_event_fn on_event, void *arg);
+
+// Keep the state in step with a live event
+void reconcile_note(struct reconcile *rc, const char *dir, const char *name, uint32_t mask);
+int reconcile_save(struct reconcile *rc);
+void reconcile_destroy(struct reconcile *rc);
+
+/* Event enrichment: stat a file relative to a cached directory fd and
+   resolve its owner through the uid cache. Returns 0, or -1 with owner "unknown". */
+struct file_meta
+{
+    struct stat st;
+    char owner[64];
+};
+int enrich_file(const char *path, struct file_meta *meta);
+
+/* Run op(dirfd, basename, arg) with a cached fd of path's directory, retrying
+   once if that directory was replaced. Returns op's result. */
+int dir_cache_at(const char *path, int (*op)(int dirfd, const char *name, void *arg), void *arg);
+
+// Owner cache counters (negative counts lookups that found no passwd entry)
+void enrich_stats(unsigned long *hits, unsigned long *misses, unsigned long *negative);
+
+/* Report validation (REPORT_DAEMON_VALIDATE=0 disables it).
+   validate_report returns 0 if well-formed, 1 with a reason if not, -1 if unreadable. */
+int validation_enabled();
+int validate_report(const char *path, char *reason, size_t reason_size);
+
+// Move a report to QUARANTINE_DIR/<date>/ with a "<name>.reason" file next to it
+int quarantine_report(const char *path, const char *reason);
+
+// Validate a report about to be filed; 1 if it failed and was quarantined
+int report_rejected(const char *path);
+
+/* Report catalog (catalog.c): one record per report filed into REPORT_DIR
+   or backed up into BACKUP_DIR; date is the "YYYY-MM-DD" directory name */
+#define CATALOG_FILED 0
+#define CATALOG_BACKED_UP 1
+int catalog_record(int kind, const char *date, const char *name, uint64_t size, uint64_t hash);
+
+// Merge new catalog records into the sorted index, returns the number of entries
+int catalog_rebuild();
+
+// Print catalog entries for what = "date" or "dept", returns the number found
+int catalog_query(const char *what, const char *arg);
+
+/* Report presence index. The upload monitor owns it: presence_rebuild()
+   rescans the upload roots and the cycle's reporting directory, mark/gone
+   follow single files (gone returns 1 when a rescan is needed). */
+int presence_rebuild(const struct dept_set *set);
+int presence_current(const struct dept_set *set);
+int presence_mark(const char *name);
+int presence_gone(const char *name);
+void presence_close();
+
+// Copy the index for set into present; missing report count, or -1 without a current index
+int presence_snapshot(const struct dept_set *set, uint64_t *present);
+
+/* Backup manifest: which files of a backup directory are already up to date */
+struct manifest;
+struct manifest *manifest_load(const char *dir);
+int manifest_is_current(struct manifest *m, const char *name, const struct stat *st);
+void manifest_update(struct manifest *m, const char *name, const struct stat *st, uint64_t hash);
+int manifest_save(struct manifest *m);
+void manifest_free(struct manifest *m);
+
+/* Backup journal: journal_open() replays an interrupted run's journal into
+   the manifest and starts a new one, journal_record() logs a published
+   copy, journal_close() removes the journal when the run is complete */
+struct journal;
+struct journal *journal_open(const char *backup_dir, struct manifest *m);
+void journal_record(struct journal *j, const char *name, const struct stat *st, uint64_t hash);
+void journal_close(struct journal *j, int complete);
+
+// Dates under BACKUP_DIR with a journal left by an interrupted run
+int journal_pending(char dates[][16], int max);
+
+// Re-hash a backup directory against its manifest, returns the number of problems
+int manifest_verify(const char *dir);
+
+// 64-bit FNV-1a hash of a file's contents (read with pread, never mapped)
+int hash_file(const char *path, uint64_t *hash);
+int hash_fd(int fd, uint64_t *hash);
+
+/* Arm a timerfd for the next local hour:minute (absolute CLOCK_REALTIME,
+   cancelled by clock changes); daily_timer_read() returns 1 if it fired and
+   0 if the clock changed and it only needs re-arming */
+int daily_timer_arm(int tfd, int hour, int minute);
+int daily_timer_read(int tfd);
+
+// Integer setting from the configuration, or fallback when unset/invalid
+long env_long(const char *name, long fallback);
+
+/* Runtime configuration (config.c): the environment over CONFIG_FILE.
+   config_get() takes a REPORT_DAEMON_* name and returns its value or NULL;
+   returned strings stay valid for the life of the process. */
+const char *config_get(const char *name);
+
+// Validate the configuration, printing each problem to out; returns the error count
+int config_check(FILE *out);
+
+// (Re)load the configuration; on errors they are logged and the current one is kept (-1)
+int config_load();
+
+// UPLOAD_DIR, REPORT_DIR or BACKUP_DIR as configured at startup (a reload does not move them)
+const char *config_dir(const char *name);
+
+// Configured times of the missing report check and of the nightly backup
+void config_deadline(int *hour, int *minute);
+void config_backup_time(int *hour, int *minute);
+
+
+/* io_uring engine for bulk moves and copies (uring.c), enabled with
+   REPORT_DAEMON_IO_URING=<files in flight> */
+#ifndef URING_BUFFER_SIZE
+#define URING_BUFFER_SIZE (256 * 1024) // registered buffer per file in flight
+#endif
+#define URING_MAX_DEPTH 64
+
+struct uring;
+
+struct uring_stats
+{
+    unsigned long submitted;
+    unsigned long completed;
+    unsigned long depth_sum; // SQEs in flight, sampled after each submission
+    unsigned long depth_samples;
+    unsigned max_depth;
+    uint64_t latency_ns_sum; // submission to completion
+    uint64_t latency_ns_max;
+};
+
+/* One copy for uring_copy_batch(); error is 0 on success, -1 if the ring
+   failed before getting to it, otherwise an errno value */
+struct uring_copy
+{
+    const char *src;
+    const char *dst;
+    off_t size;
+    mode_t mode;
+    struct timespec atime, mtime;
+    uint64_t hash; // FNV-1a of the contents, as hash_file()
+    int error;
+};
+
+// Files in flight requested by REPORT_DAEMON_IO_URING, 0 when disabled
+int uring_depth();
+
+// NULL (after logging why) when io_uring cannot be used: fall back to synchronous I/O
+struct uring *uring_create(int depth);
+void uring_destroy(struct uring *r);
+
+// Copy jobs keeping depth files in flight, returns the number that succeeded
+int uring_copy_batch(struct uring *r, struct uring_copy *jobs, int count);
+
+// rename() each src to dst; errors[i] is 0, an errno value or -1 if not attempted
+int uring_rename_batch(struct uring *r, const char *const *src, const char *const *dst, int count, int *errors);
+
+void uring_get_stats(const struct uring *r, struct uring_stats *stats);
+
+// Log and report the queue depth and completion latency of a run
+void uring_log_stats(const struct uring *r, const char *what);
+
+/* Backup I/O pacing (throttle.c). throttle_begin()/throttle_end() bracket a
+   run; threads doing its I/O call throttle_enter() once, then
+   throttle_wait() per chunk copied (a no-op on other threads). */
+#ifndef THROTTLE_BUSY_RATE
+#define THROTTLE_BUSY_RATE (32L * 1024 * 1024) // bytes/s while uploads are active and no rate is set
+#endif
+void throttle_begin();
+void throttle_enter();
+void throttle_wait(size_t bytes);
+void throttle_end(const char *what);
+
+// Largest chunk a throttled thread should copy before calling throttle_wait()
+size_t throttle_chunk(size_t wanted);
+
+// I/O priority for backup requests (ioprio_set() encoding, 0 = unchanged)
+int throttle_ioprio();
+
+// Drop a copied file from the page cache if REPORT_DAEMON_BACKUP_FADVISE=1
+void throttle_drop_cache(const char *src, const char *dst);
+
+// Copy strategies tried by the copy engine, fastest first
+#define COPY_REFLINK 0
+#define COPY_RANGE 1
+#define COPY_SENDFILE 2
+#define COPY_USERSPACE 3
+
+// Helper to copy a file (keeps mode and mtime)
 int copy_file(const char *src, const char *dst);
 
+// Same as copy_file, also reporting the strategy that performed the copy
+int copy_file_ex(const char *src, const char *dst, int *strategy_used);
+
+// Human readable name of a COPY_* strategy
+const char *copy_strategy_name(int strategy);
+
 #endif
\ No newline at end of file
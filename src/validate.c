@@ -0,0 +1,564 @@
+/* validate.c – Well-formedness check of reports before they are accepted */
+
+#define _GNU_SOURCE // memmem
+#include "utils.h"
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Reports are mapped read-only and checked in one pass: matching start and
+ * end tags, a single root element, quoted attributes, valid references, and
+ * closed comments, CDATA sections and processing instructions. Optionally
+ * the root element must have a given name and carry the department id
+ * (the report's file name without ".xml") in a given attribute.
+ *
+ * Almost all bytes of a report are character data or attribute values, where
+ * the only interesting bytes are '<', '&' and the closing quote. Those runs
+ * are skipped 64 bytes at a time with SSE2 compares, so a large report is
+ * checked at a good fraction of memory bandwidth and only markup is looked
+ * at byte by byte.
+ *
+ * Reports that fail are moved to QUARANTINE_DIR/<date>/ next to a
+ * "<name>.reason" file instead of being filed.
+ *
+ * Uploads sit in a world-writable tree, and truncating a mapped file under
+ * the check raises SIGBUS in the thread reading it. A SIGBUS handler jumps
+ * back out of the check of that thread, and the report is rejected as
+ * truncated; a SIGBUS anywhere else still kills the daemon as before.
+ */
+
+#define XML_MAX_DEPTH 4096
+
+struct xml_check
+{
+    const char *base;
+    const char *p;
+    const char *end;
+    char *reason;
+    size_t reason_size;
+
+    const char *root_name; // required root element, "" for any
+    const char *dept_attr; // attribute holding the department id, "" to skip
+    const char *dept_id;   // expected value of dept_attr
+    size_t dept_id_len;
+    int dept_seen;
+
+    const char **stack; // names of the open elements (pointers into the mapping)
+    size_t *stack_len;
+    int depth;
+    int root_seen;
+};
+
+static __thread sigjmp_buf *bus_jump; // set while this thread reads a mapping
+static pthread_once_t bus_once = PTHREAD_ONCE_INIT;
+
+static void on_sigbus(int sig)
+{
+    if (bus_jump)
+        siglongjmp(*bus_jump, 1);
+    // Not ours: the faulting access repeats with the default action
+    signal(sig, SIG_DFL);
+}
+
+static void install_sigbus()
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigbus;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+static int fail(struct xml_check *ck, const char *fmt, ...)
+{
+    char detail[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(detail, sizeof(detail), fmt, ap);
+    va_end(ap);
+    snprintf(ck->reason, ck->reason_size, "%s at byte %ld", detail, (long)(ck->p - ck->base));
+    return -1;
+}
+
+#ifdef __SSE2__
+/* Bytes of the 16 at p equal to any of the three broadcast characters */
+static inline __m128i match16(const char *p, __m128i va, __m128i vb, __m128i vc)
+{
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    return _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)),
+                        _mm_cmpeq_epi8(chunk, vc));
+}
+#endif
+
+/* First of a, b or c in [p, end), or end */
+static const char *scan3(const char *p, const char *end, char a, char b, char c)
+{
+#ifdef __SSE2__
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), vc = _mm_set1_epi8(c);
+    while (end - p >= 64)
+    {
+        __m128i m0 = match16(p, va, vb, vc), m1 = match16(p + 16, va, vb, vc);
+        __m128i m2 = match16(p + 32, va, vb, vc), m3 = match16(p + 48, va, vb, vc);
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(m0, m1), _mm_or_si128(m2, m3))))
+        {
+            uint64_t mask = (uint64_t)_mm_movemask_epi8(m0) | (uint64_t)_mm_movemask_epi8(m1) << 16 |
+                            (uint64_t)_mm_movemask_epi8(m2) << 32 | (uint64_t)_mm_movemask_epi8(m3) << 48;
+            return p + __builtin_ctzll(mask);
+        }
+        p += 64;
+    }
+    while (end - p >= 16)
+    {
+        int mask = _mm_movemask_epi8(match16(p, va, vb, vc));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    for (; p < end; p++)
+    {
+        if (*p == a || *p == b || *p == c)
+            return p;
+    }
+    return end;
+}
+
+static int is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int is_name_start(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == ':' || c >= 0x80;
+}
+
+static int is_name_char(unsigned char c)
+{
+    return is_name_start(c) || (c >= '0' && c <= '9') || c == '-' || c == '.';
+}
+
+static void skip_space(struct xml_check *ck)
+{
+    while (ck->p < ck->end && is_space(*ck->p))
+        ck->p++;
+}
+
+static int parse_name(struct xml_check *ck, const char **name, size_t *len)
+{
+    const char *start = ck->p;
+    if (ck->p >= ck->end || !is_name_start((unsigned char)*ck->p))
+        return fail(ck, "expected a name");
+    while (ck->p < ck->end && is_name_char((unsigned char)*ck->p))
+        ck->p++;
+    *name = start;
+    *len = ck->p - start;
+    return 0;
+}
+
+/* Skip past the terminator, which must appear before the end of the file */
+static int skip_past(struct xml_check *ck, const char *terminator, const char *what)
+{
+    size_t len = strlen(terminator);
+    const char *found = memmem(ck->p, ck->end - ck->p, terminator, len);
+    if (!found)
+        return fail(ck, "unterminated %s", what);
+    ck->p = found + len;
+    return 0;
+}
+
+/* &name; or &#...; with ck->p on the '&' */
+static int parse_reference(struct xml_check *ck)
+{
+    static const char *predefined[] = {"lt", "gt", "amp", "quot", "apos"};
+    const char *start = ++ck->p;
+    const char *semi = memchr(start, ';', ck->end - start < 16 ? ck->end - start : 16);
+    if (!semi)
+        return fail(ck, "unterminated reference");
+    size_t len = semi - start;
+
+    if (len > 1 && start[0] == '#')
+    {
+        int hex = start[1] == 'x';
+        size_t i = hex ? 2 : 1;
+        if (i == len)
+            return fail(ck, "empty character reference");
+        for (; i < len; i++)
+        {
+            char c = start[i];
+            int ok = (c >= '0' && c <= '9') || (hex && ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')));
+            if (!ok)
+                return fail(ck, "invalid character reference");
+        }
+    }
+    else
+    {
+        // No DTD is processed, so only the predefined entities are defined
+        size_t i;
+        for (i = 0; i < sizeof(predefined) / sizeof(predefined[0]); i++)
+        {
+            if (strlen(predefined[i]) == len && memcmp(predefined[i], start, len) == 0)
+                break;
+        }
+        if (i == sizeof(predefined) / sizeof(predefined[0]))
+            return fail(ck, "undefined entity &%.*s;", (int)len, start);
+    }
+    ck->p = semi + 1;
+    return 0;
+}
+
+static int parse_attributes(struct xml_check *ck, int is_root)
+{
+    while (1)
+    {
+        const char *before = ck->p;
+        skip_space(ck);
+        if (ck->p >= ck->end)
+            return fail(ck, "truncated start tag");
+        if (*ck->p == '>' || *ck->p == '/')
+            return 0;
+        if (ck->p == before)
+            return fail(ck, "expected whitespace between attributes");
+
+        const char *name;
+        size_t name_len;
+        if (parse_name(ck, &name, &name_len) == -1)
+            return -1;
+        skip_space(ck);
+        if (ck->p >= ck->end || *ck->p != '=')
+            return fail(ck, "attribute %.*s without a value", (int)name_len, name);
+        ck->p++;
+        skip_space(ck);
+        if (ck->p >= ck->end || (*ck->p != '"' && *ck->p != '\''))
+            return fail(ck, "unquoted value of attribute %.*s", (int)name_len, name);
+
+        char quote = *ck->p++;
+        const char *value = ck->p;
+        while (1)
+        {
+            ck->p = scan3(ck->p, ck->end, quote, '<', '&');
+            if (ck->p >= ck->end)
+                return fail(ck, "unterminated value of attribute %.*s", (int)name_len, name);
+            if (*ck->p == quote)
+                break;
+            if (*ck->p == '<')
+                return fail(ck, "'<' in value of attribute %.*s", (int)name_len, name);
+            if (parse_reference(ck) == -1)
+                return -1;
+        }
+
+        if (is_root && ck->dept_attr[0] && strlen(ck->dept_attr) == name_len &&
+            memcmp(ck->dept_attr, name, name_len) == 0)
+        {
+            size_t value_len = ck->p - value;
+            if (value_len != ck->dept_id_len || memcmp(value, ck->dept_id, value_len) != 0)
+                return fail(ck, "department %.*s does not match %s", (int)value_len, value, ck->dept_id);
+            ck->dept_seen = 1;
+        }
+        ck->p++; // closing quote
+    }
+}
+
+static int parse_start_tag(struct xml_check *ck)
+{
+    const char *name;
+    size_t len;
+    if (parse_name(ck, &name, &len) == -1)
+        return -1;
+
+    int is_root = ck->depth == 0;
+    if (is_root)
+    {
+        if (ck->root_seen)
+            return fail(ck, "more than one root element");
+        ck->root_seen = 1;
+        if (ck->root_name[0] && (strlen(ck->root_name) != len || memcmp(ck->root_name, name, len) != 0))
+            return fail(ck, "root element is <%.*s>, expected <%s>", (int)len, name, ck->root_name);
+    }
+
+    if (parse_attributes(ck, is_root) == -1)
+        return -1;
+    if (is_root && ck->dept_attr[0] && !ck->dept_seen)
+        return fail(ck, "root element has no %s attribute", ck->dept_attr);
+
+    if (*ck->p == '/')
+    {
+        if (ck->p + 1 >= ck->end || ck->p[1] != '>')
+            return fail(ck, "malformed empty-element tag");
+        ck->p += 2;
+        return 0;
+    }
+    ck->p++; // '>'
+
+    if (ck->depth == XML_MAX_DEPTH)
+        return fail(ck, "elements nested deeper than %d", XML_MAX_DEPTH);
+    ck->stack[ck->depth] = name;
+    ck->stack_len[ck->depth] = len;
+    ck->depth++;
+    return 0;
+}
+
+static int parse_end_tag(struct xml_check *ck)
+{
+    const char *name;
+    size_t len;
+    if (parse_name(ck, &name, &len) == -1)
+        return -1;
+    skip_space(ck);
+    if (ck->p >= ck->end || *ck->p != '>')
+        return fail(ck, "malformed end tag");
+    ck->p++;
+
+    if (ck->depth == 0)
+        return fail(ck, "end tag </%.*s> without a start tag", (int)len, name);
+    ck->depth--;
+    if (ck->stack_len[ck->depth] != len || memcmp(ck->stack[ck->depth], name, len) != 0)
+        return fail(ck, "</%.*s> closes <%.*s>", (int)len, name,
+                    (int)ck->stack_len[ck->depth], ck->stack[ck->depth]);
+    return 0;
+}
+
+/* Markup starting at '<' */
+static int parse_markup(struct xml_check *ck)
+{
+    const char *rest = ck->p + 1;
+    size_t avail = ck->end - rest;
+
+    if (avail >= 1 && *rest == '?')
+    {
+        ck->p = rest + 1;
+        return skip_past(ck, "?>", "processing instruction");
+    }
+    if (avail >= 3 && memcmp(rest, "!--", 3) == 0)
+    {
+        ck->p = rest + 3;
+        return skip_past(ck, "-->", "comment");
+    }
+    if (avail >= 8 && memcmp(rest, "![CDATA[", 8) == 0)
+    {
+        if (ck->depth == 0)
+            return fail(ck, "CDATA section outside the root element");
+        ck->p = rest + 8;
+        return skip_past(ck, "]]>", "CDATA section");
+    }
+    if (avail >= 8 && memcmp(rest, "!DOCTYPE", 8) == 0)
+    {
+        if (ck->root_seen)
+            return fail(ck, "DOCTYPE after the root element");
+        // Skip to the closing '>', past an internal subset in brackets
+        int brackets = 0;
+        for (ck->p = rest + 8; ck->p < ck->end; ck->p++)
+        {
+            if (*ck->p == '[')
+                brackets++;
+            else if (*ck->p == ']')
+                brackets--;
+            else if (*ck->p == '>' && brackets <= 0)
+            {
+                ck->p++;
+                return 0;
+            }
+        }
+        return fail(ck, "unterminated DOCTYPE");
+    }
+    if (avail >= 1 && *rest == '/')
+    {
+        ck->p = rest + 1;
+        return parse_end_tag(ck);
+    }
+    ck->p = rest;
+    return parse_start_tag(ck);
+}
+
+static int check_document(struct xml_check *ck)
+{
+    if (ck->end - ck->p >= 3 && memcmp(ck->p, "\xEF\xBB\xBF", 3) == 0)
+        ck->p += 3; // UTF-8 byte order mark
+
+    while (ck->p < ck->end)
+    {
+        if (ck->depth == 0)
+        {
+            // Outside the root element only whitespace may appear between markup
+            skip_space(ck);
+            if (ck->p >= ck->end)
+                break;
+            if (*ck->p != '<')
+                return fail(ck, ck->root_seen ? "content after the root element" : "content before the root element");
+            if (parse_markup(ck) == -1)
+                return -1;
+            continue;
+        }
+
+        ck->p = scan3(ck->p, ck->end, '<', '&', '<');
+        if (ck->p >= ck->end)
+            break;
+        if (*ck->p == '&')
+        {
+            if (parse_reference(ck) == -1)
+                return -1;
+        }
+        else if (parse_markup(ck) == -1)
+            return -1;
+    }
+
+    if (ck->depth > 0)
+        return fail(ck, "truncated: <%.*s> is not closed", (int)ck->stack_len[ck->depth - 1], ck->stack[ck->depth - 1]);
+    if (!ck->root_seen)
+        return fail(ck, "no root element");
+    return 0;
+}
+
+static const char *env_string(const char *name, const char *fallback)
+{
+    const char *value = config_get(name);
+    return value ? value : fallback;
+}
+
+int validation_enabled()
+{
+    static int enabled = -1;
+    if (enabled == -1)
+        enabled = env_long("REPORT_DAEMON_VALIDATE", 1) != 0;
+    return enabled;
+}
+
+int validate_report(const char *path, char *reason, size_t reason_size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        snprintf(reason, reason_size, "empty file");
+        return 1;
+    }
+
+    // Populated up front: one pass over a large report would otherwise take a fault per page
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+    pthread_once(&bus_once, install_sigbus);
+
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    const char *ext = strrchr(name, '.');
+    char dept_id[256];
+    snprintf(dept_id, sizeof(dept_id), "%.*s", (int)(ext ? ext - name : (long)strlen(name)), name);
+
+    const char *stack[XML_MAX_DEPTH];
+    size_t stack_len[XML_MAX_DEPTH];
+    struct xml_check ck = {
+        .base = data,
+        .p = data,
+        .end = data + st.st_size,
+        .reason = reason,
+        .reason_size = reason_size,
+        .root_name = env_string("REPORT_DAEMON_XML_ROOT", VALIDATE_ROOT_ELEMENT),
+        .dept_attr = env_string("REPORT_DAEMON_XML_DEPT_ATTR", VALIDATE_DEPT_ATTRIBUTE),
+        .dept_id = dept_id,
+        .dept_id_len = strlen(dept_id),
+        .stack = stack,
+        .stack_len = stack_len,
+    };
+    sigjmp_buf jump;
+    int rc;
+    if (sigsetjmp(jump, 1) == 0)
+    {
+        bus_jump = &jump;
+        rc = check_document(&ck);
+    }
+    else
+    {
+        snprintf(reason, reason_size, "file truncated while it was checked");
+        rc = -1;
+    }
+    bus_jump = NULL;
+    munmap((void *)data, st.st_size);
+    return rc == 0 ? 0 : 1;
+}
+
+int quarantine_report(const char *path, const char *reason)
+{
+    char date[16];
+    char dir[MAX_PATH_BUFFER];
+    get_date_string(date, sizeof(date));
+    snprintf(dir, sizeof(dir), "%s/%s", QUARANTINE_DIR, date);
+    if (ensure_directory(QUARANTINE_DIR) == -1 || ensure_directory(dir) == -1)
+        return -1;
+
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    char dst[MAX_PATH_BUFFER];
+    snprintf(dst, sizeof(dst), "%s/%s", dir, name);
+    if (rename(path, dst) == -1 && (errno != EXDEV || copy_file(path, dst) == -1 || unlink(path) == -1))
+        return -1;
+
+    char reason_path[MAX_PATH_BUFFER];
+    snprintf(reason_path, sizeof(reason_path), "%s.reason", dst);
+    FILE *fp = fopen(reason_path, "w");
+    if (fp)
+    {
+        char timestamp[32];
+        time_t now = time(NULL);
+        struct tm tm_now;
+        localtime_r(&now, &tm_now);
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm_now);
+        fprintf(fp, "%s\nfile: %s\nquarantined: %s\n", reason, path, timestamp);
+        fclose(fp);
+    }
+    return 0;
+}
+
+int report_rejected(const char *path)
+{
+    if (!validation_enabled())
+        return 0;
+
+    char reason[512];
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    int rc = validate_report(path, reason, sizeof(reason));
+    if (rc == 0)
+        return 0;
+    if (rc == -1)
+    {
+        // Unreadable here does not mean malformed: let the move decide
+        char msg[MAX_PATH_BUFFER + 64];
+        snprintf(msg, sizeof(msg), "Could not validate %s: %s", name, strerror(errno));
+        log_message("WARNING", msg);
+        return 0;
+    }
+
+    char msg[1024];
+    if (quarantine_report(path, reason) == 0)
+    {
+        snprintf(msg, sizeof(msg), "Quarantined %s: %s", name, reason);
+        log_event("WARNING", "quarantine", msg);
+        ipc_send(ipc_default(), "quarantine", 0, msg);
+    }
+    else
+    {
+        snprintf(msg, sizeof(msg), "Rejected %s (%s) but could not quarantine it: %s", name, reason, strerror(errno));
+        log_event("ERROR", "quarantine", msg);
+        ipc_send(ipc_default(), "quarantine", 0, msg);
+    }
+    return 1;
+}
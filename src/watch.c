@@ -0,0 +1,648 @@
+/* watch.c – Recursive, multi-root watch manager for the upload trees.
+ *
+ * One inotify instance watches every configured upload root and all of their
+ * subdirectories. Watches are added as directories appear and dropped as they
+ * disappear, and a wd -> path hash map resolves each event in O(1).
+ *
+ * inotify needs one watch per directory and the kernel caps them at
+ * fs.inotify.max_user_watches. When a tree grows close to that limit the
+ * manager switches to a fanotify filesystem mark (FAN_REPORT_DFID_NAME),
+ * which covers any number of directories with one mark per root; events are
+ * translated back into inotify masks so callers never see the difference.
+ */
+
+#define _GNU_SOURCE
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+
+#define WATCH_MASK (IN_CREATE | IN_MODIFY | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | \
+                    IN_CLOSE_WRITE | IN_DELETE_SELF | IN_ONLYDIR)
+#define FANOTIFY_MASK (FAN_CREATE | FAN_MODIFY | FAN_DELETE | FAN_MOVED_TO | FAN_MOVED_FROM | \
+                       FAN_CLOSE_WRITE | FAN_ONDIR)
+#define INOTIFY_BUFFER_LEN (1024 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+#define FANOTIFY_BUFFER_LEN (64 * 1024)
+#define HANDLE_CACHE_SLOTS 256
+#define MAX_HANDLE_BYTES 128
+
+struct watch_entry
+{
+    int wd; // 0 = empty slot, -1 = tombstone
+    int root;
+    char *path;
+};
+
+struct watch_root
+{
+    char path[MAX_PATH_BUFFER];
+    size_t len;        // 0 = slot freed by watch_remove_root()
+    int mount_fd;      // for open_by_handle_at() in fanotify mode
+    fsid_t fsid;
+};
+
+/* Directory file handle -> path, so fanotify events avoid a lookup each */
+struct handle_cache_entry
+{
+    unsigned int bytes;
+    int type;
+    unsigned char handle[MAX_HANDLE_BYTES];
+    char *path;
+};
+
+struct watch_manager
+{
+    int inotify_fd;
+    int fanotify_fd; // -1 until the fallback is active
+    struct watch_entry *table;
+    size_t capacity;
+    size_t used; // live entries plus tombstones
+    size_t live;
+    long watch_limit;
+    struct watch_root roots[MAX_UPLOAD_ROOTS];
+    int root_count; // slots in use, freed ones included
+    struct handle_cache_entry handle_cache[HANDLE_CACHE_SLOTS];
+    watch_event_fn on_event;
+    void *arg;
+};
+
+/* Watches we allow ourselves: WATCH_BUDGET_PERCENT of max_user_watches */
+static long read_watch_limit()
+{
+    long limit = 8192;
+    FILE *fp = fopen("/proc/sys/fs/inotify/max_user_watches", "r");
+    if (fp)
+    {
+        if (fscanf(fp, "%ld", &limit) != 1)
+            limit = 8192;
+        fclose(fp);
+    }
+    return limit * WATCH_BUDGET_PERCENT / 100;
+}
+
+static size_t wd_slot(const struct watch_manager *wm, int wd)
+{
+    return ((unsigned int)wd * 2654435761u) & (wm->capacity - 1);
+}
+
+static struct watch_entry *table_find(struct watch_manager *wm, int wd)
+{
+    size_t idx = wd_slot(wm, wd);
+    for (size_t probe = 0; probe < wm->capacity; probe++)
+    {
+        struct watch_entry *e = &wm->table[(idx + probe) & (wm->capacity - 1)];
+        if (e->wd == 0)
+            return NULL;
+        if (e->wd == wd)
+            return e;
+    }
+    return NULL;
+}
+
+static int table_insert(struct watch_manager *wm, int wd, int root, const char *path);
+
+static int table_grow(struct watch_manager *wm)
+{
+    struct watch_entry *old = wm->table;
+    size_t old_capacity = wm->capacity;
+
+    wm->capacity = old_capacity ? old_capacity * 2 : 256;
+    wm->table = calloc(wm->capacity, sizeof(*wm->table));
+    if (!wm->table)
+    {
+        wm->table = old;
+        wm->capacity = old_capacity;
+        return -1;
+    }
+    wm->used = 0;
+    wm->live = 0;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old[i].wd > 0)
+        {
+            table_insert(wm, old[i].wd, old[i].root, old[i].path);
+            free(old[i].path);
+        }
+    }
+    free(old);
+    return 0;
+}
+
+static int table_insert(struct watch_manager *wm, int wd, int root, const char *path)
+{
+    struct watch_entry *existing = table_find(wm, wd);
+    if (existing)
+    {
+        // inotify returns the same wd for a directory that is already watched
+        char *copy = strdup(path);
+        if (!copy)
+            return -1;
+        free(existing->path);
+        existing->path = copy;
+        existing->root = root;
+        return 0;
+    }
+
+    if ((wm->used + 1) * 2 > wm->capacity && table_grow(wm) == -1)
+        return -1;
+
+    size_t idx = wd_slot(wm, wd);
+    while (wm->table[idx].wd > 0)
+        idx = (idx + 1) & (wm->capacity - 1);
+    if (wm->table[idx].wd == 0)
+        wm->used++;
+    wm->table[idx].wd = wd;
+    wm->table[idx].root = root;
+    wm->table[idx].path = strdup(path);
+    wm->live++;
+    return wm->table[idx].path ? 0 : -1;
+}
+
+static void table_remove(struct watch_manager *wm, struct watch_entry *e)
+{
+    free(e->path);
+    e->path = NULL;
+    e->wd = -1;
+    wm->live--;
+}
+
+struct watch_manager *watch_manager_create(watch_event_fn on_event, void *arg)
+{
+    struct watch_manager *wm = calloc(1, sizeof(*wm));
+    if (!wm)
+        return NULL;
+
+    wm->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (wm->inotify_fd < 0)
+    {
+        free(wm);
+        return NULL;
+    }
+    wm->fanotify_fd = -1;
+    wm->watch_limit = read_watch_limit();
+    wm->on_event = on_event;
+    wm->arg = arg;
+    if (table_grow(wm) == -1)
+    {
+        close(wm->inotify_fd);
+        free(wm);
+        return NULL;
+    }
+    return wm;
+}
+
+int watch_manager_inotify_fd(struct watch_manager *wm)
+{
+    return wm->inotify_fd;
+}
+
+int watch_manager_fanotify_fd(struct watch_manager *wm)
+{
+    return wm->fanotify_fd;
+}
+
+size_t watch_count(struct watch_manager *wm)
+{
+    return wm->live;
+}
+
+static int enable_fanotify(struct watch_manager *wm);
+
+/* Watch dir and every directory below it. Files already present in a newly
+   created directory are reported as CREATE, since they may have been written
+   before the watch existed. */
+static void add_tree(struct watch_manager *wm, const char *dir, int root, int report_existing)
+{
+    if (wm->fanotify_fd != -1 && !report_existing)
+        return; // the filesystem mark already covers it
+    if (wm->fanotify_fd == -1 && (long)wm->live >= wm->watch_limit)
+        enable_fanotify(wm);
+    if (wm->fanotify_fd == -1)
+    {
+        int wd = inotify_add_watch(wm->inotify_fd, dir, WATCH_MASK);
+        if (wd < 0)
+        {
+            int saved_errno = errno;
+            char err[MAX_PATH_BUFFER + 64];
+            snprintf(err, sizeof(err), "Error adding watch on %s: %s", dir, strerror(saved_errno));
+            log_message("ERROR", err);
+            if (saved_errno == ENOSPC)
+                enable_fanotify(wm);
+            if (wm->fanotify_fd == -1)
+                return;
+        }
+        else
+        {
+            table_insert(wm, wd, root, dir);
+        }
+    }
+
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        char path[MAX_PATH_BUFFER];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (entry->d_type == DT_DIR)
+            add_tree(wm, path, root, report_existing);
+        else if (entry->d_type == DT_REG && report_existing)
+            wm->on_event(dir, entry->d_name, IN_CLOSE_WRITE, wm->roots[root].len, wm->arg);
+    }
+    closedir(d);
+}
+
+/* Stop watching path and everything below it (moved away or deleted) */
+static void remove_tree(struct watch_manager *wm, const char *path)
+{
+    size_t len = strlen(path);
+    for (size_t i = 0; i < wm->capacity; i++)
+    {
+        struct watch_entry *e = &wm->table[i];
+        if (e->wd > 0 && strncmp(e->path, path, len) == 0 && (e->path[len] == '\0' || e->path[len] == '/'))
+        {
+            inotify_rm_watch(wm->inotify_fd, e->wd);
+            table_remove(wm, e);
+        }
+    }
+}
+
+/* Slot of the root with exactly this path, or -1 */
+static int find_root(struct watch_manager *wm, const char *path)
+{
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+    for (int i = 0; i < wm->root_count; i++)
+    {
+        if (wm->roots[i].len == len && strncmp(wm->roots[i].path, path, len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int watch_add_root(struct watch_manager *wm, const char *path)
+{
+    if (find_root(wm, path) != -1)
+        return 0;
+
+    // Reuse a slot freed by watch_remove_root() so indexes stay below MAX_UPLOAD_ROOTS
+    int index = 0;
+    while (index < wm->root_count && wm->roots[index].len > 0)
+        index++;
+    if (index == MAX_UPLOAD_ROOTS)
+        return -1;
+
+    struct watch_root *root = &wm->roots[index];
+    snprintf(root->path, sizeof(root->path), "%s", path);
+    root->len = strlen(root->path);
+    while (root->len > 1 && root->path[root->len - 1] == '/')
+        root->path[--root->len] = '\0';
+    root->mount_fd = open(root->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root->mount_fd < 0)
+    {
+        char err[MAX_PATH_BUFFER + 64];
+        snprintf(err, sizeof(err), "Cannot open upload root %s: %s", root->path, strerror(errno));
+        log_message("ERROR", err);
+        root->len = 0;
+        return -1;
+    }
+    struct statfs sfs;
+    if (fstatfs(root->mount_fd, &sfs) == 0)
+        root->fsid = sfs.f_fsid;
+
+    if (index == wm->root_count)
+        wm->root_count++;
+    if (wm->fanotify_fd != -1)
+    {
+        if (fanotify_mark(wm->fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK,
+                          AT_FDCWD, root->path) == -1)
+            log_message("ERROR", "Failed to add fanotify mark for upload root");
+        return 0;
+    }
+    add_tree(wm, root->path, index, 0);
+    return 0;
+}
+
+int watch_remove_root(struct watch_manager *wm, const char *path)
+{
+    int index = find_root(wm, path);
+    if (index == -1)
+        return -1;
+
+    struct watch_root *root = &wm->roots[index];
+    if (wm->fanotify_fd != -1)
+    {
+        // The mark is per filesystem: keep it while another root lives there
+        int shared = 0;
+        for (int i = 0; i < wm->root_count; i++)
+        {
+            if (i != index && wm->roots[i].len > 0 && memcmp(&wm->roots[i].fsid, &root->fsid, sizeof(fsid_t)) == 0)
+                shared = 1;
+        }
+        if (!shared && fanotify_mark(wm->fanotify_fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, FANOTIFY_MASK,
+                                     AT_FDCWD, root->path) == -1)
+        {
+            char err[MAX_PATH_BUFFER + 64];
+            snprintf(err, sizeof(err), "Failed to remove fanotify mark on %s: %s", root->path, strerror(errno));
+            log_message("ERROR", err);
+        }
+    }
+    else
+    {
+        remove_tree(wm, root->path);
+    }
+
+    close(root->mount_fd);
+    root->mount_fd = -1;
+    root->path[0] = '\0';
+    root->len = 0;
+    while (wm->root_count > 0 && wm->roots[wm->root_count - 1].len == 0)
+        wm->root_count--;
+    return 0;
+}
+
+/* Switch to one fanotify filesystem mark per root. Needs CAP_SYS_ADMIN and
+   Linux 5.9+; on failure we keep the inotify watches we already have. */
+static int enable_fanotify(struct watch_manager *wm)
+{
+    if (wm->fanotify_fd != -1)
+        return 0;
+
+    int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK,
+                           O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        char err[256];
+        snprintf(err, sizeof(err), "Watch limit reached and fanotify is unavailable (%s): "
+                                   "new subdirectories will not be monitored", strerror(errno));
+        log_message("ERROR", err);
+        wm->watch_limit = LONG_MAX; // do not retry for every directory
+        return -1;
+    }
+
+    for (int i = 0; i < wm->root_count; i++)
+    {
+        if (wm->roots[i].len == 0)
+            continue;
+        if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, AT_FDCWD,
+                          wm->roots[i].path) == -1)
+        {
+            char err[MAX_PATH_BUFFER + 64];
+            snprintf(err, sizeof(err), "Failed to add fanotify mark on %s: %s", wm->roots[i].path, strerror(errno));
+            log_message("ERROR", err);
+            close(fd);
+            wm->watch_limit = LONG_MAX;
+            return -1;
+        }
+    }
+
+    /* The filesystem marks cover everything, the per-directory watches are now redundant */
+    for (size_t i = 0; i < wm->capacity; i++)
+    {
+        if (wm->table[i].wd > 0)
+        {
+            inotify_rm_watch(wm->inotify_fd, wm->table[i].wd);
+            table_remove(wm, &wm->table[i]);
+        }
+    }
+    wm->fanotify_fd = fd;
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Watched %zu directories, near max_user_watches; switched to fanotify filesystem marks",
+             wm->live);
+    log_message("WARNING", msg);
+    if (wm->on_event)
+        wm->on_event(NULL, NULL, IN_Q_OVERFLOW, 0, wm->arg); // events may have been missed during the switch
+    return 0;
+}
+
+/* Root index a path belongs to, or -1 */
+static int root_of(struct watch_manager *wm, const char *path)
+{
+    for (int i = 0; i < wm->root_count; i++)
+    {
+        size_t len = wm->roots[i].len;
+        if (len > 0 && strncmp(path, wm->roots[i].path, len) == 0 && (path[len] == '\0' || path[len] == '/'))
+            return i;
+    }
+    return -1;
+}
+
+/* Dispatch one event already translated to an inotify mask */
+static void dispatch(struct watch_manager *wm, const char *dir, int root, const char *name, uint32_t mask)
+{
+    if (mask & IN_ISDIR)
+    {
+        if (name[0] == '.')
+            return;
+        char path[MAX_PATH_BUFFER];
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        if (mask & (IN_CREATE | IN_MOVED_TO))
+            add_tree(wm, path, root, 1);
+        else if ((mask & (IN_DELETE | IN_MOVED_FROM)) && wm->fanotify_fd == -1)
+            remove_tree(wm, path);
+        return;
+    }
+    wm->on_event(dir, name, mask, wm->roots[root].len, wm->arg);
+}
+
+static int read_inotify(struct watch_manager *wm)
+{
+    char buffer[INOTIFY_BUFFER_LEN] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+
+    while ((length = read(wm->inotify_fd, buffer, sizeof(buffer))) > 0)
+    {
+        char *ptr = buffer;
+        while (ptr < buffer + length)
+        {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                wm->on_event(NULL, NULL, IN_Q_OVERFLOW, 0, wm->arg);
+                continue;
+            }
+
+            struct watch_entry *e = table_find(wm, event->wd);
+            if (!e)
+                continue; // watch already removed
+            if (event->mask & IN_IGNORED)
+            {
+                int root = root_of(wm, e->path);
+                if (root >= 0 && strcmp(e->path, wm->roots[root].path) == 0)
+                {
+                    char err[MAX_PATH_BUFFER + 64];
+                    snprintf(err, sizeof(err), "Upload root %s is no longer watched", e->path);
+                    log_message("ERROR", err);
+                }
+                table_remove(wm, e);
+                continue;
+            }
+            if (event->len > 0)
+            {
+                // Copy: dispatching may add watches and rehash the table
+                char dir[MAX_PATH_BUFFER];
+                int root = e->root;
+                snprintf(dir, sizeof(dir), "%s", e->path);
+                dispatch(wm, dir, root, event->name, event->mask);
+            }
+        }
+    }
+
+    if (length == -1 && errno != EAGAIN)
+        return -1;
+    return 0;
+}
+
+/* Resolve a fanotify directory handle to its path, through the cache */
+static const char *handle_path(struct watch_manager *wm, struct file_handle *handle, const void *fsid)
+{
+    if (handle->handle_bytes > MAX_HANDLE_BYTES)
+        return NULL;
+
+    unsigned long h = 1469598103934665603UL ^ (unsigned int)handle->handle_type;
+    for (unsigned int i = 0; i < handle->handle_bytes; i++)
+    {
+        h ^= handle->f_handle[i];
+        h *= 1099511628211UL;
+    }
+    struct handle_cache_entry *slot = &wm->handle_cache[h % HANDLE_CACHE_SLOTS];
+    if (slot->path && slot->bytes == handle->handle_bytes && slot->type == handle->handle_type &&
+        memcmp(slot->handle, handle->f_handle, handle->handle_bytes) == 0)
+    {
+        // Verify the directory still lives there (it may have been renamed)
+        struct stat st;
+        if (stat(slot->path, &st) == 0)
+            return slot->path;
+    }
+
+    int mount_fd = -1;
+    for (int i = 0; i < wm->root_count; i++)
+    {
+        if (wm->roots[i].len > 0 && memcmp(&wm->roots[i].fsid, fsid, sizeof(fsid_t)) == 0)
+        {
+            mount_fd = wm->roots[i].mount_fd;
+            break;
+        }
+    }
+    if (mount_fd == -1)
+        return NULL; // another filesystem sharing the mark's superblock
+
+    int fd = open_by_handle_at(mount_fd, handle, O_PATH | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    char link[64];
+    char path[MAX_PATH_BUFFER];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(link, path, sizeof(path) - 1);
+    close(fd);
+    if (len <= 0)
+        return NULL;
+    path[len] = '\0';
+
+    free(slot->path);
+    slot->path = strdup(path);
+    slot->bytes = handle->handle_bytes;
+    slot->type = handle->handle_type;
+    memcpy(slot->handle, handle->f_handle, handle->handle_bytes);
+    return slot->path;
+}
+
+static uint32_t fanotify_to_inotify(uint64_t mask)
+{
+    uint32_t out = 0;
+    if (mask & FAN_CREATE)
+        out |= IN_CREATE;
+    if (mask & FAN_MODIFY)
+        out |= IN_MODIFY;
+    if (mask & FAN_DELETE)
+        out |= IN_DELETE;
+    if (mask & FAN_MOVED_TO)
+        out |= IN_MOVED_TO;
+    if (mask & FAN_MOVED_FROM)
+        out |= IN_MOVED_FROM;
+    if (mask & FAN_CLOSE_WRITE)
+        out |= IN_CLOSE_WRITE;
+    if (mask & FAN_ONDIR)
+        out |= IN_ISDIR;
+    return out;
+}
+
+static int read_fanotify(struct watch_manager *wm)
+{
+    char buffer[FANOTIFY_BUFFER_LEN] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    ssize_t length;
+
+    while ((length = read(wm->fanotify_fd, buffer, sizeof(buffer))) > 0)
+    {
+        struct fanotify_event_metadata *meta = (struct fanotify_event_metadata *)buffer;
+        for (; FAN_EVENT_OK(meta, length); meta = FAN_EVENT_NEXT(meta, length))
+        {
+            if (meta->mask & FAN_Q_OVERFLOW)
+            {
+                wm->on_event(NULL, NULL, IN_Q_OVERFLOW, 0, wm->arg);
+                continue;
+            }
+
+            struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *)(meta + 1);
+            if ((char *)fid >= (char *)meta + meta->event_len ||
+                fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+                continue;
+
+            struct file_handle *handle = (struct file_handle *)fid->handle;
+            const char *name = (const char *)handle->f_handle + handle->handle_bytes;
+            const char *dir = handle_path(wm, handle, &fid->fsid);
+            if (!dir)
+                continue;
+            int root = root_of(wm, dir);
+            if (root < 0)
+                continue; // the mark covers the whole filesystem: ignore other directories
+
+            char dir_copy[MAX_PATH_BUFFER];
+            snprintf(dir_copy, sizeof(dir_copy), "%s", dir);
+            dispatch(wm, dir_copy, root, name, fanotify_to_inotify(meta->mask));
+        }
+    }
+
+    if (length == -1 && errno != EAGAIN)
+        return -1;
+    return 0;
+}
+
+/* Read and dispatch everything pending on fd (either of the manager's descriptors) */
+int watch_manager_process(struct watch_manager *wm, int fd)
+{
+    if (fd == wm->fanotify_fd)
+        return read_fanotify(wm);
+    return read_inotify(wm);
+}
+
+void watch_manager_destroy(struct watch_manager *wm)
+{
+    if (!wm)
+        return;
+    for (size_t i = 0; i < wm->capacity; i++)
+        free(wm->table[i].wd > 0 ? wm->table[i].path : NULL);
+    for (int i = 0; i < HANDLE_CACHE_SLOTS; i++)
+        free(wm->handle_cache[i].path);
+    for (int i = 0; i < wm->root_count; i++)
+    {
+        if (wm->roots[i].len > 0)
+            close(wm->roots[i].mount_fd);
+    }
+    if (wm->fanotify_fd != -1)
+        close(wm->fanotify_fd);
+    close(wm->inotify_fd);
+    free(wm->table);
+    free(wm);
+}